@@ -0,0 +1,31 @@
+% Exports dados.mat signals as a PluginReplay recording (CSV with named columns), with kinematics computed as in InvDyn.m
+load('dados.mat');
+
+dt = 0.005;
+
+theta_exo = theta_exo(:)*pi/180;
+samples_number = min([length(theta_exo) length(torque_exo) length(torque_OS) size(emg_proc,1)]);
+theta_exo = theta_exo(1:samples_number);
+
+omega_exo = diff(theta_exo)/dt;
+omega_exo(end+1) = omega_exo(end);
+alfa_exo = diff(omega_exo)/dt;
+alfa_exo(end+1) = alfa_exo(end);
+N = 4;
+Wn = 0.1;
+[B,A] = butter(N,Wn);
+omega_exo_f = filter(B,A,omega_exo);
+alfa_exo_f = filter(B,A,alfa_exo);
+
+time = (0:samples_number-1)'*dt;
+recording = [time theta_exo omega_exo_f alfa_exo_f torque_exo(1:samples_number) torque_OS(1:samples_number) emg_proc(1:samples_number,:)];
+
+header = 'time,joint0_position,joint0_velocity,joint0_acceleration,joint0_force,joint0_reference_torque';
+for muscle = 1:size(emg_proc,2)
+    header = [header sprintf(',emg%d',muscle-1)];
+end
+
+file = fopen('dados.csv','w');
+fprintf(file,'%s\n',header);
+fclose(file);
+dlmwrite('dados.csv',recording,'-append','precision','%.10g');
@@ -0,0 +1,103 @@
+#include "batch_kernels.h"
+
+#include <cmath>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+
+const size_t SIMD_WIDTH = 4;
+
+// Cody-Waite range reduction to |r| <= ln(2)/2, then degree 13 Taylor polynomial, accurate to a few ulps
+static inline __m256d ExpAVX2( __m256d x )
+{
+  const double EXP_COEFFICIENTS[] = { 1.0 / 6227020800.0, 1.0 / 479001600.0, 1.0 / 39916800.0, 1.0 / 3628800.0, 1.0 / 362880.0, 1.0 / 40320.0, 
+                                      1.0 / 5040.0, 1.0 / 720.0, 1.0 / 120.0, 1.0 / 24.0, 1.0 / 6.0, 0.5, 1.0, 1.0 };
+  
+  x = _mm256_min_pd( _mm256_max_pd( x, _mm256_set1_pd( -708.0 ) ), _mm256_set1_pd( 709.0 ) );
+  __m256d exponent = _mm256_round_pd( _mm256_mul_pd( x, _mm256_set1_pd( 1.4426950408889634074 ) ), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC );
+  __m256d reduced = _mm256_fnmadd_pd( exponent, _mm256_set1_pd( 6.93147180369123816490e-01 ), x );
+  reduced = _mm256_fnmadd_pd( exponent, _mm256_set1_pd( 1.90821492927058770002e-10 ), reduced );
+  
+  __m256d result = _mm256_set1_pd( EXP_COEFFICIENTS[ 0 ] );
+  for( size_t coefficientIndex = 1; coefficientIndex < sizeof(EXP_COEFFICIENTS) / sizeof(double); coefficientIndex++ )
+    result = _mm256_fmadd_pd( result, reduced, _mm256_set1_pd( EXP_COEFFICIENTS[ coefficientIndex ] ) );
+  
+  // Scale by 2^exponent, building the double exponent bits directly
+  __m256i exponentBits = _mm256_cvtepi32_epi64( _mm256_cvtpd_epi32( exponent ) );
+  exponentBits = _mm256_slli_epi64( _mm256_add_epi64( exponentBits, _mm256_set1_epi64x( 1023 ) ), 52 );
+  return _mm256_mul_pd( result, _mm256_castsi256_pd( exponentBits ) );
+}
+#endif
+
+void CalculateActivationsScalar( const double* emgInputsList, double activationFactor, size_t samplesNumber, double* activationsList )
+{
+  double normalizationFactor = std::exp( activationFactor ) - 1;
+  for( size_t sampleIndex = 0; sampleIndex < samplesNumber; sampleIndex++ )
+    activationsList[ sampleIndex ] = ( std::exp( activationFactor * emgInputsList[ sampleIndex ] ) - 1 ) / normalizationFactor;
+}
+
+void CalculateActivationsBatch( const double* emgInputsList, double activationFactor, size_t samplesNumber, double* activationsList )
+{
+  size_t vectorSamplesNumber = 0;
+#ifdef __AVX2__
+  vectorSamplesNumber = samplesNumber - samplesNumber % SIMD_WIDTH;
+  __m256d factor = _mm256_set1_pd( activationFactor );
+  __m256d one = _mm256_set1_pd( 1.0 );
+  __m256d normalizationFactor = _mm256_set1_pd( std::exp( activationFactor ) - 1 );
+  for( size_t sampleIndex = 0; sampleIndex < vectorSamplesNumber; sampleIndex += SIMD_WIDTH )
+  {
+    __m256d activation = ExpAVX2( _mm256_mul_pd( factor, _mm256_loadu_pd( emgInputsList + sampleIndex ) ) );
+    _mm256_storeu_pd( activationsList + sampleIndex, _mm256_div_pd( _mm256_sub_pd( activation, one ), normalizationFactor ) );
+  }
+#endif
+  CalculateActivationsScalar( emgInputsList + vectorSamplesNumber, activationFactor, samplesNumber - vectorSamplesNumber, activationsList + vectorSamplesNumber );
+}
+
+void CalculateJointTorquesScalar( const double* forcesTable, const double* momentArmsTable, size_t musclesNumber, size_t samplesNumber, 
+                                  double* torquesList, double* stiffnessesList )
+{
+  for( size_t sampleIndex = 0; sampleIndex < samplesNumber; sampleIndex++ )
+  {
+    torquesList[ sampleIndex ] = stiffnessesList[ sampleIndex ] = 0.0;
+    for( size_t muscleIndex = 0; muscleIndex < musclesNumber; muscleIndex++ )
+    {
+      double muscleJointTorque = forcesTable[ muscleIndex * samplesNumber + sampleIndex ] * momentArmsTable[ muscleIndex * samplesNumber + sampleIndex ];
+      torquesList[ sampleIndex ] += muscleJointTorque;
+      stiffnessesList[ sampleIndex ] += std::abs( muscleJointTorque );
+    }
+  }
+}
+
+void CalculateJointTorquesBatch( const double* forcesTable, const double* momentArmsTable, size_t musclesNumber, size_t samplesNumber, 
+                                 double* torquesList, double* stiffnessesList )
+{
+  size_t vectorSamplesNumber = 0;
+#ifdef __AVX2__
+  vectorSamplesNumber = samplesNumber - samplesNumber % SIMD_WIDTH;
+  __m256d signMask = _mm256_set1_pd( -0.0 );
+  for( size_t sampleIndex = 0; sampleIndex < vectorSamplesNumber; sampleIndex += SIMD_WIDTH )
+  {
+    __m256d torque = _mm256_setzero_pd(), stiffness = _mm256_setzero_pd();
+    for( size_t muscleIndex = 0; muscleIndex < musclesNumber; muscleIndex++ )
+    {
+      size_t tableIndex = muscleIndex * samplesNumber + sampleIndex;
+      __m256d muscleJointTorque = _mm256_mul_pd( _mm256_loadu_pd( forcesTable + tableIndex ), _mm256_loadu_pd( momentArmsTable + tableIndex ) );
+      torque = _mm256_add_pd( torque, muscleJointTorque );
+      stiffness = _mm256_add_pd( stiffness, _mm256_andnot_pd( signMask, muscleJointTorque ) );
+    }
+    _mm256_storeu_pd( torquesList + sampleIndex, torque );
+    _mm256_storeu_pd( stiffnessesList + sampleIndex, stiffness );
+  }
+#endif
+  // Remaining samples, with the same muscle summation order
+  for( size_t sampleIndex = vectorSamplesNumber; sampleIndex < samplesNumber; sampleIndex++ )
+  {
+    torquesList[ sampleIndex ] = stiffnessesList[ sampleIndex ] = 0.0;
+    for( size_t muscleIndex = 0; muscleIndex < musclesNumber; muscleIndex++ )
+    {
+      double muscleJointTorque = forcesTable[ muscleIndex * samplesNumber + sampleIndex ] * momentArmsTable[ muscleIndex * samplesNumber + sampleIndex ];
+      torquesList[ sampleIndex ] += muscleJointTorque;
+      stiffnessesList[ sampleIndex ] += std::abs( muscleJointTorque );
+    }
+  }
+}
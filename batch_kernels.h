@@ -0,0 +1,17 @@
+#ifndef BATCH_KERNELS_H
+#define BATCH_KERNELS_H
+
+#include <cstddef>
+
+/* Normalized exponential EMG to activation mapping, ( exp( A * u ) - 1 ) / ( exp( A ) - 1 ), for one muscle over many samples */
+void CalculateActivationsBatch( const double* emgInputsList, double activationFactor, size_t samplesNumber, double* activationsList );
+void CalculateActivationsScalar( const double* emgInputsList, double activationFactor, size_t samplesNumber, double* activationsList );
+
+/* Sums of muscle torques (force times moment arm) and of their absolute values for one joint over many samples.
+   Forces and moment arms tables hold one row of samples per muscle */
+void CalculateJointTorquesBatch( const double* forcesTable, const double* momentArmsTable, size_t musclesNumber, size_t samplesNumber, 
+                                 double* torquesList, double* stiffnessesList );
+void CalculateJointTorquesScalar( const double* forcesTable, const double* momentArmsTable, size_t musclesNumber, size_t samplesNumber, 
+                                  double* torquesList, double* stiffnessesList );
+
+#endif // BATCH_KERNELS_H
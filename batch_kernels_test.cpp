@@ -0,0 +1,79 @@
+#include <iostream>
+#include <vector>
+#include <random>
+#include <cmath>
+#include <cstring>
+
+#include "batch_kernels.h"
+
+// Activations are in [0,1], and vector exp stays within a few ulps of std::exp
+const double MAX_ACTIVATION_DEVIATION = 1.0e-14;
+const size_t SAMPLES_NUMBERS_LIST[] = { 0, 1, 3, 4, 5, 17, 1000 };
+const size_t MUSCLES_NUMBERS_LIST[] = { 1, 5, 12 };
+const double ACTIVATION_FACTORS_LIST[] = { -3.0, -2.0, -0.5, 0.5, 2.0 };
+
+bool TestActivations( std::mt19937& generator )
+{
+  std::uniform_real_distribution<double> emgDistribution( 0.0, 1.0 );
+  bool isPassed = true;
+  for( size_t samplesNumber : SAMPLES_NUMBERS_LIST )
+  {
+    std::vector<double> emgInputsList( samplesNumber ), batchActivationsList( samplesNumber ), scalarActivationsList( samplesNumber );
+    for( size_t sampleIndex = 0; sampleIndex < samplesNumber; sampleIndex++ )
+      emgInputsList[ sampleIndex ] = emgDistribution( generator );
+    for( double activationFactor : ACTIVATION_FACTORS_LIST )
+    {
+      CalculateActivationsBatch( emgInputsList.data(), activationFactor, samplesNumber, batchActivationsList.data() );
+      CalculateActivationsScalar( emgInputsList.data(), activationFactor, samplesNumber, scalarActivationsList.data() );
+      double maxDeviation = 0.0;
+      for( size_t sampleIndex = 0; sampleIndex < samplesNumber; sampleIndex++ )
+        maxDeviation = std::max( maxDeviation, std::abs( batchActivationsList[ sampleIndex ] - scalarActivationsList[ sampleIndex ] ) );
+      if( maxDeviation <= MAX_ACTIVATION_DEVIATION ) continue;
+      std::cout << "activations: " << samplesNumber << " samples, factor " << activationFactor << ": max deviation " << maxDeviation << std::endl;
+      isPassed = false;
+    }
+  }
+
+  return isPassed;
+}
+
+// Summation order is the same on both paths, so results must match bitwise
+bool TestJointTorques( std::mt19937& generator )
+{
+  std::uniform_real_distribution<double> forceDistribution( 0.0, 3000.0 ), momentArmDistribution( -0.05, 0.05 );
+  bool isPassed = true;
+  for( size_t musclesNumber : MUSCLES_NUMBERS_LIST )
+  {
+    for( size_t samplesNumber : SAMPLES_NUMBERS_LIST )
+    {
+      std::vector<double> forcesTable( musclesNumber * samplesNumber ), momentArmsTable( musclesNumber * samplesNumber );
+      for( size_t valueIndex = 0; valueIndex < forcesTable.size(); valueIndex++ )
+      {
+        forcesTable[ valueIndex ] = forceDistribution( generator );
+        momentArmsTable[ valueIndex ] = momentArmDistribution( generator );
+      }
+      std::vector<double> batchTorquesList( samplesNumber ), batchStiffnessesList( samplesNumber );
+      std::vector<double> scalarTorquesList( samplesNumber ), scalarStiffnessesList( samplesNumber );
+      CalculateJointTorquesBatch( forcesTable.data(), momentArmsTable.data(), musclesNumber, samplesNumber, batchTorquesList.data(), batchStiffnessesList.data() );
+      CalculateJointTorquesScalar( forcesTable.data(), momentArmsTable.data(), musclesNumber, samplesNumber, scalarTorquesList.data(), scalarStiffnessesList.data() );
+      if( std::memcmp( batchTorquesList.data(), scalarTorquesList.data(), samplesNumber * sizeof(double) ) == 0
+          && std::memcmp( batchStiffnessesList.data(), scalarStiffnessesList.data(), samplesNumber * sizeof(double) ) == 0 ) continue;
+      std::cout << "joint torques: " << musclesNumber << " muscles, " << samplesNumber << " samples: results differ from scalar ones" << std::endl;
+      isPassed = false;
+    }
+  }
+
+  return isPassed;
+}
+
+int main( int argc, char* argv[] )
+{
+  std::mt19937 generator( 0 );
+
+  bool isPassed = TestActivations( generator );
+  isPassed = TestJointTorques( generator ) && isPassed;
+
+  std::cout << "batch kernels: " << ( isPassed ? "passed" : "FAILED" ) << std::endl;
+
+  return isPassed ? 0 : 1;
+}
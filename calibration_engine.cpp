@@ -0,0 +1,108 @@
+#include "calibration_engine.h"
+
+const double CONVERGENCE_TOLERANCE = 0.05;
+const int MAX_ITERATIONS = 1000;
+const int LIMITED_MEMORY_HISTORY = 500;
+
+CalibrationEngine::CalibrationEngine( NMSProcessorBase& processor ) 
+  : OptimizerSystem( processor.getNumParameters() ), processor( processor ), isRunning( false ), isCancelled( false ), hasNewParameters( false ), 
+    iterationsCount( 0 ), residual( 0.0 )
+{
+  if( processor.getHasLimits() )
+  {
+    double* parametersMinList = NULL;
+    double* parametersMaxList = NULL;
+    processor.getParameterLimits( &parametersMinList, &parametersMaxList );
+    setParameterLimits( SimTK::Vector( getNumParameters(), parametersMinList ), SimTK::Vector( getNumParameters(), parametersMaxList ) );
+  }
+}
+
+CalibrationEngine::~CalibrationEngine()
+{
+  Stop();
+}
+
+// Returning an error makes the optimizer give up, which is the only way to interrupt it
+int CalibrationEngine::objectiveFunc( const SimTK::Vector& parametersList, bool newCoefficients, SimTK::Real& remainingError ) const
+{
+  if( isCancelled.load() ) return -1;
+  int status = processor.objectiveFunc( parametersList, newCoefficients, remainingError );
+  residual.store( remainingError );
+  return status;
+}
+
+// Limited memory BFGS takes one gradient per iteration
+int CalibrationEngine::gradientFunc( const SimTK::Vector& parametersList, bool newCoefficients, SimTK::Vector& gradientsList ) const
+{
+  if( isCancelled.load() ) return -1;
+  int status = processor.gradientFunc( parametersList, newCoefficients, gradientsList );
+  iterationsCount++;
+  return status;
+}
+
+void CalibrationEngine::SetInitialParameters( const SimTK::Vector& parametersList )
+{
+  Stop();
+  
+  initialParametersList = parametersList;
+}
+
+void CalibrationEngine::Start()
+{
+  Stop();
+  
+  isCancelled.store( false );
+  // Results not fetched yet are dropped, as the processor prepares new ones
+  hasNewParameters.store( false );
+  iterationsCount.store( 0 );
+  isRunning.store( true );
+  calibrationThread = std::thread( &CalibrationEngine::Run, this );
+}
+
+void CalibrationEngine::Stop()
+{
+  isCancelled.store( true );
+  if( calibrationThread.joinable() ) calibrationThread.join();
+}
+
+void CalibrationEngine::Run()
+{
+  std::cout << "starting optimization" << std::endl;
+  try
+  {
+    // Work on a local copy: published parameters are only replaced once optimization ends
+    SimTK::Vector parametersList = ( initialParametersList.size() == getNumParameters() ) ? initialParametersList : processor.GetInitialParameters();
+    SimTK::Optimizer optimizer( *this, SimTK::LBFGSB );
+    optimizer.setConvergenceTolerance( CONVERGENCE_TOLERANCE );
+    optimizer.useNumericalGradient( false ); // Parallel gradient from NMSProcessorBase
+    optimizer.setMaxIterations( MAX_ITERATIONS );
+    optimizer.setLimitedMemoryHistory( LIMITED_MEMORY_HISTORY );
+    SimTK::Real remainingError = optimizer.optimize( parametersList );
+    std::cout << "optimization ended with residual: " << remainingError << std::endl;
+    residual.store( remainingError );
+    // Anything expensive to apply them is done here, leaving a swap to the control thread
+    processor.PrepareParameters( parametersList );
+    calibratedParametersList = parametersList;
+    hasNewParameters.store( true );
+  }
+  catch( std::exception ex )
+  {
+    if( isCancelled.load() ) std::cout << "optimization cancelled" << std::endl;
+    else std::cout << ex.what() << std::endl;
+  }
+  
+  isRunning.store( false );
+}
+
+bool CalibrationEngine::FetchParameters( SimTK::Vector& parametersList )
+{
+  if( not hasNewParameters.exchange( false ) ) return false;
+  parametersList = calibratedParametersList;
+  return true;
+}
+
+bool CalibrationEngine::IsRunning() const { return isRunning.load(); }
+
+size_t CalibrationEngine::GetIterationsCount() const { return iterationsCount.load(); }
+
+double CalibrationEngine::GetResidual() const { return residual.load(); }
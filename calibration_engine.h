@@ -0,0 +1,45 @@
+#ifndef CALIBRATION_ENGINE_H
+#define CALIBRATION_ENGINE_H
+
+#include "nms_processor-base.h"
+
+#include <thread>
+#include <atomic>
+
+/* Runs NMS parameters optimization on its own thread, publishing progress and final parameters without locking */
+class CalibrationEngine : public SimTK::OptimizerSystem
+{
+  public:
+    /* Constructor class. Parameter limits are taken from the given processor */
+    CalibrationEngine( NMSProcessorBase& );
+    ~CalibrationEngine();
+
+    int objectiveFunc( const SimTK::Vector&, bool, SimTK::Real& ) const;
+    int gradientFunc( const SimTK::Vector&, bool, SimTK::Vector& ) const;
+
+    /* Starting point for the next optimizations, instead of the processor initial parameters (e.g. a stored calibration) */
+    void SetInitialParameters( const SimTK::Vector& );
+
+    void Start();
+    /* Aborts optimization at the next objective evaluation and waits for the thread to end */
+    void Stop();
+
+    /* Copies parameters from the last finished optimization, only once. They are then ready to be committed by the processor */
+    bool FetchParameters( SimTK::Vector& );
+
+    bool IsRunning() const;
+    size_t GetIterationsCount() const;
+    double GetResidual() const;
+
+  private:
+    void Run();
+
+    NMSProcessorBase& processor;
+    std::thread calibrationThread;
+    SimTK::Vector initialParametersList, calibratedParametersList;
+    std::atomic<bool> isRunning, isCancelled, hasNewParameters;
+    mutable std::atomic<size_t> iterationsCount;
+    mutable std::atomic<double> residual;
+};
+
+#endif // CALIBRATION_ENGINE_H
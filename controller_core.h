@@ -0,0 +1,86 @@
+#ifndef CONTROLLER_CORE_H
+#define CONTROLLER_CORE_H
+
+#include <cstddef>
+#include <cmath>
+
+#include "nms_processor-base.h"
+
+/* Per control step loops over joints and muscles, with counts fixed at compile time so that they are unrolled and vectorized.
+   Zero template counts take the runtime ones instead (dynamic fallback) */
+template <size_t JOINTS_NUMBER, size_t MUSCLES_NUMBER>
+struct ControllerCore
+{
+  static inline size_t GetJointsNumber( size_t jointsNumber ) { return ( JOINTS_NUMBER > 0 ) ? JOINTS_NUMBER : jointsNumber; }
+  static inline size_t GetMusclesNumber( size_t musclesNumber ) { return ( MUSCLES_NUMBER > 0 ) ? MUSCLES_NUMBER : musclesNumber; }
+
+  /* Joint measures to per joint NMS input variables. Acceleration doubles as setpoint */
+  template <typename DoFVariablesType>
+  static void PackInputs( DoFVariablesType** jointMeasuresList, size_t jointsNumber, double* inputsList )
+  {
+    jointsNumber = GetJointsNumber( jointsNumber );
+    for( size_t jointIndex = 0; jointIndex < jointsNumber; jointIndex++ )
+    {
+      double* jointInputsList = inputsList + jointIndex * NMS_INPUT_VARS_NUMBER;
+      jointInputsList[ NMS_POSITION ] = jointMeasuresList[ jointIndex ]->position;
+      jointInputsList[ NMS_VELOCITY ] = jointMeasuresList[ jointIndex ]->velocity;
+      jointInputsList[ NMS_ACCELERATION ] = jointMeasuresList[ jointIndex ]->acceleration;
+      jointInputsList[ NMS_SETPOINT ] = jointMeasuresList[ jointIndex ]->acceleration;
+      jointInputsList[ NMS_TORQUE_EXT ] = jointMeasuresList[ jointIndex ]->force;
+    }
+  }
+
+  /* Simulated kinematics and NMS outputs to axis measures, passing axis setpoints through to joints */
+  template <typename DoFVariablesType>
+  static void UnpackOutputs( const double* inputsList, const double* outputsList, DoFVariablesType** axisMeasuresList,
+                             DoFVariablesType** jointSetpointsList, DoFVariablesType** axisSetpointsList, size_t jointsNumber )
+  {
+    jointsNumber = GetJointsNumber( jointsNumber );
+    for( size_t jointIndex = 0; jointIndex < jointsNumber; jointIndex++ )
+    {
+      const double* jointInputsList = inputsList + jointIndex * NMS_INPUT_VARS_NUMBER;
+      const double* jointOutputsList = outputsList + jointIndex * NMS_OUTPUT_VARS_NUMBER;
+      axisMeasuresList[ jointIndex ]->position = jointInputsList[ NMS_POSITION ];
+      axisMeasuresList[ jointIndex ]->velocity = jointInputsList[ NMS_VELOCITY ];
+      axisMeasuresList[ jointIndex ]->acceleration = jointInputsList[ NMS_ACCELERATION ];
+      axisMeasuresList[ jointIndex ]->force = jointOutputsList[ NMS_TORQUE_INT ];
+      axisMeasuresList[ jointIndex ]->stiffness = jointOutputsList[ NMS_STIFFNESS ];
+
+      jointSetpointsList[ jointIndex ]->position = axisSetpointsList[ jointIndex ]->position;
+      jointSetpointsList[ jointIndex ]->velocity = axisSetpointsList[ jointIndex ]->velocity;
+      jointSetpointsList[ jointIndex ]->acceleration = axisSetpointsList[ jointIndex ]->acceleration;
+      jointSetpointsList[ jointIndex ]->force = axisSetpointsList[ jointIndex ]->force;
+    }
+  }
+
+  /* Joint torques and stiffnesses (sums of muscle torques and of their absolute values). Moment arms hold one row of muscles per joint */
+  static void SumJointTorques( const double* forcesList, const double* momentArmsList, size_t jointsNumber, size_t musclesNumber, double* outputsList )
+  {
+    jointsNumber = GetJointsNumber( jointsNumber );
+    musclesNumber = GetMusclesNumber( musclesNumber );
+    for( size_t jointIndex = 0; jointIndex < jointsNumber; jointIndex++ )
+    {
+      const double* jointMomentArmsList = momentArmsList + jointIndex * musclesNumber;
+      double torque = 0.0, stiffness = 0.0;
+      for( size_t muscleIndex = 0; muscleIndex < musclesNumber; muscleIndex++ )
+      {
+        double muscleJointTorque = forcesList[ muscleIndex ] * jointMomentArmsList[ muscleIndex ];
+        torque += muscleJointTorque;
+        stiffness += std::abs( muscleJointTorque );
+      }
+      outputsList[ jointIndex * NMS_OUTPUT_VARS_NUMBER + NMS_TORQUE_INT ] = torque;
+      outputsList[ jointIndex * NMS_OUTPUT_VARS_NUMBER + NMS_STIFFNESS ] = stiffness;
+    }
+  }
+};
+
+/* Common configurations get specialized loops, anything else runs the dynamic ones */
+#define SELECT_CONTROLLER_CORE( jointsNumber, musclesNumber, FUNCTION ) \
+  ( ( (jointsNumber) == 1 && (musclesNumber) == 5 ) ? &ControllerCore<1, 5>::FUNCTION : \
+    ( (jointsNumber) == 2 && (musclesNumber) == 5 ) ? &ControllerCore<2, 5>::FUNCTION : \
+    ( (jointsNumber) == 1 ) ? &ControllerCore<1, 0>::FUNCTION : \
+    ( (jointsNumber) == 2 ) ? &ControllerCore<2, 0>::FUNCTION : &ControllerCore<0, 0>::FUNCTION )
+
+typedef void (*JointTorquesFunction)( const double*, const double*, size_t, size_t, double* );
+
+#endif // CONTROLLER_CORE_H
@@ -0,0 +1,33 @@
+#ifndef CONTROLLER_INSTANCE_H
+#define CONTROLLER_INSTANCE_H
+
+#include "interface/robot_control.h"
+
+/* Opaque handle to a controller holding all the state of one model. Instances share no mutable data,
+   so several of them may be driven concurrently, each from its own thread */
+typedef struct ControllerInstance* Controller;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Loads the named model, returning NULL on failure */
+Controller CreateController( const char* );
+void DestroyController( Controller );
+
+size_t GetControllerJointsNumber( Controller );
+const char** GetControllerJointNamesList( Controller );
+size_t GetControllerAxesNumber( Controller );
+const char** GetControllerAxisNamesList( Controller );
+size_t GetControllerExtraInputsNumber( Controller );
+void SetControllerExtraInputsList( Controller, double* );
+size_t GetControllerExtraOutputsNumber( Controller );
+void GetControllerExtraOutputsList( Controller, double* );
+void SetControllerState( Controller, enum ControlState );
+void RunControllerStep( Controller, DoFVariables**, DoFVariables**, DoFVariables**, DoFVariables**, double );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CONTROLLER_INSTANCE_H
@@ -0,0 +1,57 @@
+#include "integration_engine.h"
+
+IntegrationEngine::IntegrationEngine( OpenSim::Model& model, IntegratorType integratorType, double fixedStepSize )
+{
+  const SimTK::MultibodySystem& system = model.getMultibodySystem();
+
+  if( integratorType == INTEGRATOR_EXPLICIT_EULER ) integrator = new SimTK::ExplicitEulerIntegrator( system );
+  else if( integratorType == INTEGRATOR_RUNGE_KUTTA_2 ) integrator = new SimTK::RungeKutta2Integrator( system );
+  else if( integratorType == INTEGRATOR_RUNGE_KUTTA_3 ) integrator = new SimTK::RungeKutta3Integrator( system );
+  else if( integratorType == INTEGRATOR_SEMI_EXPLICIT_EULER_2 ) integrator = new SimTK::SemiExplicitEuler2Integrator( system );
+  else if( integratorType == INTEGRATOR_VERLET ) integrator = new SimTK::VerletIntegrator( system );
+  else integrator = new SimTK::RungeKuttaMersonIntegrator( system );
+
+  // Always stop exactly at the requested time, instead of interpolating
+  integrator->setAllowInterpolation( false );
+  integrator->setReturnEveryInternalStep( false );
+  if( fixedStepSize > 0.0 ) integrator->setFixedStepSize( fixedStepSize );
+
+  std::cout << "Integration engine created: " << integrator->getMethodName() << ", step size: " << fixedStepSize << std::endl;
+}
+
+IntegrationEngine::~IntegrationEngine()
+{
+  delete integrator;
+}
+
+void IntegrationEngine::Initialize( const SimTK::State& state )
+{
+  integrator->initialize( state );
+}
+
+void IntegrationEngine::Integrate( SimTK::State& state, double timeDelta )
+{
+  // Re-seed the integrator internal state with the given (externally modified) one, reusing its storage
+  SimTK::State& integratorState = integrator->updAdvancedState();
+  integratorState.updTime() = state.getTime();
+  integratorState.updY() = state.getY();
+  // Discrete variables hold actuator overrides and force enabling flags
+  for( int subsystemIndex = 0; subsystemIndex < state.getNumSubsystems(); subsystemIndex++ )
+  {
+    SimTK::SubsystemIndex subsystem( subsystemIndex );
+    for( int variableIndex = 0; variableIndex < state.getNDiscreteVariables( subsystem ); variableIndex++ )
+    {
+      SimTK::DiscreteVariableIndex variable( variableIndex );
+      integratorState.updDiscreteVariable( subsystem, variable ) = state.getDiscreteVariable( subsystem, variable );
+    }
+  }
+  integrator->reinitialize( SimTK::Stage::Instance, false );
+
+  double finalTime = state.getTime() + timeDelta;
+  while( integrator->getTime() < finalTime && not integrator->isSimulationOver() )
+    integrator->stepTo( finalTime );
+
+  // Copy results back without reallocating caller state
+  state.updTime() = integrator->getTime();
+  state.updY() = integrator->getState().getY();
+}
@@ -0,0 +1,24 @@
+#ifndef INTEGRATION_ENGINE_H
+#define INTEGRATION_ENGINE_H
+
+#include <OpenSim/OpenSim.h>
+
+enum IntegratorType { INTEGRATOR_EXPLICIT_EULER, INTEGRATOR_RUNGE_KUTTA_2, INTEGRATOR_RUNGE_KUTTA_3, INTEGRATOR_RUNGE_KUTTA_MERSON,
+                      INTEGRATOR_SEMI_EXPLICIT_EULER_2, INTEGRATOR_VERLET, INTEGRATOR_TYPES_NUMBER };
+
+class IntegrationEngine
+{
+  public:
+    /* Constructor class. Non-positive fixed step sizes select error controlled stepping */
+    IntegrationEngine( OpenSim::Model&, IntegratorType = INTEGRATOR_RUNGE_KUTTA_MERSON, double fixedStepSize = 0.0 );
+    ~IntegrationEngine();
+
+    void Initialize( const SimTK::State& );
+
+    void Integrate( SimTK::State&, double );
+
+  private:
+    SimTK::Integrator* integrator;
+};
+
+#endif // INTEGRATION_ENGINE_H
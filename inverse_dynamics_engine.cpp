@@ -0,0 +1,20 @@
+#include "inverse_dynamics_engine.h"
+
+InverseDynamicsEngine::InverseDynamicsEngine( OpenSim::Model& model )
+: internalModel( model ), accelerationsList( model.getNumSpeeds(), 0.0 )
+{ 
+}
+
+InverseDynamicsEngine::~InverseDynamicsEngine() { }
+
+SimTK::Vector& InverseDynamicsEngine::UpdAccelerationsList() { return accelerationsList; }
+
+void InverseDynamicsEngine::Solve( const SimTK::State& state, SimTK::Vector& idForcesList )
+{
+  // Same as OpenSim::InverseDynamicsSolver::solve(), but writing to caller storage
+  const SimTK::MultibodySystem& system = internalModel.getMultibodySystem();
+  system.realize( state, SimTK::Stage::Dynamics );
+  const SimTK::Vector& appliedMobilityForces = system.getMobilityForces( state, SimTK::Stage::Dynamics );
+  const SimTK::Vector_<SimTK::SpatialVec>& appliedBodyForces = system.getRigidBodyForces( state, SimTK::Stage::Dynamics );
+  system.getMatterSubsystem().calcResidualForceIgnoringConstraints( state, appliedMobilityForces, appliedBodyForces, accelerationsList, idForcesList );
+}
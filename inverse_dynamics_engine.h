@@ -0,0 +1,22 @@
+#ifndef INVERSE_DYNAMICS_ENGINE_H
+#define INVERSE_DYNAMICS_ENGINE_H
+
+#include <OpenSim/OpenSim.h>
+
+class InverseDynamicsEngine
+{
+  public:
+    /* Constructor class. Work buffers are sized once for the given model */
+    InverseDynamicsEngine( OpenSim::Model& );
+    ~InverseDynamicsEngine();
+
+    SimTK::Vector& UpdAccelerationsList();
+
+    void Solve( const SimTK::State&, SimTK::Vector& );
+
+  private:
+    OpenSim::Model& internalModel;
+    SimTK::Vector accelerationsList;
+};
+
+#endif // INVERSE_DYNAMICS_ENGINE_H
@@ -0,0 +1,86 @@
+#include "inverse_kinematics_engine.h"
+
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+
+MarkerSetpointsReference::MarkerSetpointsReference() : MarkersReference() { }
+
+MarkerSetpointsReference::MarkerSetpointsReference( OpenSim::TimeSeriesTableVec3& markersTable, OpenSim::Set<OpenSim::MarkerWeight>* markerWeights )
+: MarkersReference( markersTable, markerWeights ), setpointsList( markersTable.getNumColumns(), SimTK::Vec3( 0.0 ) )
+{ 
+}
+
+void MarkerSetpointsReference::getValues( const SimTK::State& state, SimTK::Array_<SimTK::Vec3>& valuesList ) const
+{
+  valuesList = setpointsList;
+}
+
+
+InverseKinematicsEngine::InverseKinematicsEngine( OpenSim::Model& model, const std::vector<std::string>& markerLabels, const std::vector<SimTK::Vec3>& markerInitialLocations, 
+                                                  OpenSim::Set<OpenSim::MarkerWeight>& markerWeights, SimTK::Array_<OpenSim::CoordinateReference>& coordinateReferences, 
+                                                  double accuracy, double maxMarkerError )
+: squaredMarkerErrorsList( markerLabels.size(), 0.0 ), maxSquaredMarkerError( maxMarkerError * maxMarkerError ), assembledSquaredMarkerError( 0.0 ), isAssembled( false )
+{
+  SimTK::Matrix_<SimTK::Vec3> markersMatrix( 1, markerLabels.size() );
+  for( size_t markerIndex = 0; markerIndex < markerLabels.size(); markerIndex++ )
+    markersMatrix.set( 0, markerIndex, markerInitialLocations[ markerIndex ] );
+  OpenSim::TimeSeriesTableVec3 markersTable( std::vector<double>( { 0.0 } ), markersMatrix, markerLabels );
+  
+  markersReference = new MarkerSetpointsReference( markersTable, &markerWeights );
+  for( size_t markerIndex = 0; markerIndex < markerLabels.size(); markerIndex++ )
+    markersReference->setpointsList[ markerIndex ] = markerInitialLocations[ markerIndex ];
+  std::cout << "OSim: generated markers reference size: " << markersReference->getNumRefs() << std::endl;
+  std::cout << "OSim: generated coordinates reference size: " << coordinateReferences.size() << std::endl;
+  ikSolver = new OpenSim::InverseKinematicsSolver( model, *markersReference, coordinateReferences, 0.0 );
+  ikSolver->setAccuracy( accuracy );
+}
+
+InverseKinematicsEngine::~InverseKinematicsEngine()
+{
+  delete ikSolver;
+  delete markersReference;
+}
+
+void InverseKinematicsEngine::SetMarkerSetpoint( size_t markerIndex, const SimTK::Vec3& setpoint )
+{
+  markersReference->setpointsList[ markerIndex ] = setpoint;
+}
+
+bool InverseKinematicsEngine::Solve( SimTK::State& state )
+{
+  // Warm start from previous solution, assembling again only when tracking diverges
+  if( isAssembled )
+  {
+    try
+    {
+      ikSolver->track( state );
+      double squaredMarkerError = GetMaxSquaredMarkerError();
+      if( squaredMarkerError > maxSquaredMarkerError && squaredMarkerError > assembledSquaredMarkerError ) isAssembled = false;
+    }
+    catch( std::exception ex )
+    {
+      std::cout << ex.what() << std::endl;
+      isAssembled = false;
+    }
+  }
+  
+  if( isAssembled ) return true;
+  
+  ikSolver->assemble( state );
+  assembledSquaredMarkerError = GetMaxSquaredMarkerError();
+  isAssembled = true;
+  
+  return false;
+}
+
+double InverseKinematicsEngine::GetMaxMarkerError() { return std::sqrt( GetMaxSquaredMarkerError() ); }
+
+double InverseKinematicsEngine::GetMaxSquaredMarkerError()
+{
+  ikSolver->computeCurrentSquaredMarkerErrors( squaredMarkerErrorsList );
+  double maxError = 0.0;
+  for( size_t markerIndex = 0; markerIndex < squaredMarkerErrorsList.size(); markerIndex++ )
+    maxError = std::max( maxError, squaredMarkerErrorsList[ markerIndex ] );
+  return maxError;
+}
@@ -0,0 +1,50 @@
+#ifndef INVERSE_KINEMATICS_ENGINE_H
+#define INVERSE_KINEMATICS_ENGINE_H
+
+#include <OpenSim/OpenSim.h>
+#include <OpenSim/Simulation/MarkersReference.h>
+#include <OpenSim/Simulation/InverseKinematicsSolver.h>
+
+#include <vector>
+#include <string>
+
+/* Markers reference returning the last given setpoints, whatever the requested time */
+class MarkerSetpointsReference : public OpenSim::MarkersReference
+{
+  OpenSim_DECLARE_CONCRETE_OBJECT( MarkerSetpointsReference, OpenSim::MarkersReference );
+
+  public:
+    MarkerSetpointsReference();
+    MarkerSetpointsReference( OpenSim::TimeSeriesTableVec3&, OpenSim::Set<OpenSim::MarkerWeight>* );
+
+    void getValues( const SimTK::State&, SimTK::Array_<SimTK::Vec3>& ) const override;
+
+    SimTK::Array_<SimTK::Vec3> setpointsList;
+};
+
+class InverseKinematicsEngine
+{
+  public:
+    /* Constructor class. Marker setpoints start at the given initial locations */
+    InverseKinematicsEngine( OpenSim::Model&, const std::vector<std::string>&, const std::vector<SimTK::Vec3>&, OpenSim::Set<OpenSim::MarkerWeight>&, 
+                             SimTK::Array_<OpenSim::CoordinateReference>&, double accuracy = 1.0e-4, double maxMarkerError = 0.05 );
+    ~InverseKinematicsEngine();
+
+    void SetMarkerSetpoint( size_t, const SimTK::Vec3& );
+
+    bool Solve( SimTK::State& );
+
+    /* Largest distance between a marker and its setpoint, for the last solution */
+    double GetMaxMarkerError();
+
+  private:
+    double GetMaxSquaredMarkerError();
+
+    MarkerSetpointsReference* markersReference;
+    OpenSim::InverseKinematicsSolver* ikSolver;
+    SimTK::Array_<double> squaredMarkerErrorsList;
+    double maxSquaredMarkerError, assembledSquaredMarkerError;
+    bool isAssembled;
+};
+
+#endif // INVERSE_KINEMATICS_ENGINE_H
@@ -0,0 +1,523 @@
+#include "mlp_network.h"
+
+#include <cmath>
+#include <algorithm>
+#include <numeric>
+
+const size_t TRAINING_BATCH_SIZE = 32;
+const double TRAINING_LEARNING_RATE = 1.0e-3;
+const size_t PROCESSING_BLOCK_SIZE = 64;
+const double ADAM_FIRST_DECAY = 0.9, ADAM_SECOND_DECAY = 0.999, ADAM_EPSILON = 1.0e-8;
+
+// Register blocked C = A * B^T, with A rows x inner and B columns x inner
+static void MultiplyTransposed( const double* aTable, const double* bTable, double* cTable, size_t rowsNumber, size_t columnsNumber, size_t innerNumber )
+{
+  const size_t BLOCK_SIZE = 4;
+  size_t rowIndex = 0;
+  for( ; rowIndex + BLOCK_SIZE <= rowsNumber; rowIndex += BLOCK_SIZE )
+  {
+    const double* aRowsList[ BLOCK_SIZE ] = { aTable + rowIndex * innerNumber, aTable + ( rowIndex + 1 ) * innerNumber, 
+                                              aTable + ( rowIndex + 2 ) * innerNumber, aTable + ( rowIndex + 3 ) * innerNumber };
+    for( size_t columnIndex = 0; columnIndex < columnsNumber; columnIndex++ )
+    {
+      const double* bRow = bTable + columnIndex * innerNumber;
+      double sum0 = 0.0, sum1 = 0.0, sum2 = 0.0, sum3 = 0.0;
+      for( size_t innerIndex = 0; innerIndex < innerNumber; innerIndex++ )
+      {
+        double b = bRow[ innerIndex ];
+        sum0 += aRowsList[ 0 ][ innerIndex ] * b;
+        sum1 += aRowsList[ 1 ][ innerIndex ] * b;
+        sum2 += aRowsList[ 2 ][ innerIndex ] * b;
+        sum3 += aRowsList[ 3 ][ innerIndex ] * b;
+      }
+      cTable[ rowIndex * columnsNumber + columnIndex ] = sum0;
+      cTable[ ( rowIndex + 1 ) * columnsNumber + columnIndex ] = sum1;
+      cTable[ ( rowIndex + 2 ) * columnsNumber + columnIndex ] = sum2;
+      cTable[ ( rowIndex + 3 ) * columnsNumber + columnIndex ] = sum3;
+    }
+  }
+  for( ; rowIndex < rowsNumber; rowIndex++ )
+  {
+    const double* aRow = aTable + rowIndex * innerNumber;
+    for( size_t columnIndex = 0; columnIndex < columnsNumber; columnIndex++ )
+    {
+      const double* bRow = bTable + columnIndex * innerNumber;
+      double sum = 0.0;
+      for( size_t innerIndex = 0; innerIndex < innerNumber; innerIndex++ )
+        sum += aRow[ innerIndex ] * bRow[ innerIndex ];
+      cTable[ rowIndex * columnsNumber + columnIndex ] = sum;
+    }
+  }
+}
+
+// C = A * B, with A rows x inner and B inner x columns. Contiguous innermost loop, for vectorization
+static void Multiply( const double* aTable, const double* bTable, double* cTable, size_t rowsNumber, size_t columnsNumber, size_t innerNumber )
+{
+  for( size_t rowIndex = 0; rowIndex < rowsNumber; rowIndex++ )
+  {
+    double* cRow = cTable + rowIndex * columnsNumber;
+    std::fill( cRow, cRow + columnsNumber, 0.0 );
+    for( size_t innerIndex = 0; innerIndex < innerNumber; innerIndex++ )
+    {
+      double a = aTable[ rowIndex * innerNumber + innerIndex ];
+      const double* bRow = bTable + innerIndex * columnsNumber;
+      for( size_t columnIndex = 0; columnIndex < columnsNumber; columnIndex++ )
+        cRow[ columnIndex ] += a * bRow[ columnIndex ];
+    }
+  }
+}
+
+// C += A^T * B, with A inner x rows and B inner x columns
+static void AccumulateTransposed( const double* aTable, const double* bTable, double* cTable, size_t rowsNumber, size_t columnsNumber, size_t innerNumber )
+{
+  // Each C row stays in cache while the (block sized) B is swept
+  for( size_t rowIndex = 0; rowIndex < rowsNumber; rowIndex++ )
+  {
+    double* cRow = cTable + rowIndex * columnsNumber;
+    for( size_t innerIndex = 0; innerIndex < innerNumber; innerIndex++ )
+    {
+      double a = aTable[ innerIndex * rowsNumber + rowIndex ];
+      const double* bRow = bTable + innerIndex * columnsNumber;
+      for( size_t columnIndex = 0; columnIndex < columnsNumber; columnIndex++ )
+        cRow[ columnIndex ] += a * bRow[ columnIndex ];
+    }
+  }
+}
+
+MLPNetwork::MLPNetwork( size_t inputsNumber, size_t outputsNumber, size_t hiddenNeuronsNumber, unsigned int seed )
+: inputsNumber( inputsNumber ), outputsNumber( outputsNumber ), hiddenNeuronsNumber( std::max( hiddenNeuronsNumber, (size_t) 1 ) ), 
+  optimizationStepsCount( 0 ), randomGenerator( seed ), isBatchProcessingEnabled( true ), hasTrainedWeights( false )
+{
+  size_t hiddenWeightsNumber = this->hiddenNeuronsNumber * inputsNumber;
+  size_t outputWeightsNumber = outputsNumber * this->hiddenNeuronsNumber;
+  parametersList.resize( hiddenWeightsNumber + this->hiddenNeuronsNumber + outputWeightsNumber + outputsNumber, 0.0 );
+  gradientsList.resize( parametersList.size(), 0.0 );
+  firstMomentsList.resize( parametersList.size(), 0.0 );
+  secondMomentsList.resize( parametersList.size(), 0.0 );
+  BindParameters();
+  
+  // Xavier uniform initialization, biases start at zero
+  std::uniform_real_distribution<double> hiddenWeightsDistribution( -1.0, 1.0 );
+  double hiddenWeightsLimit = std::sqrt( 6.0 / ( inputsNumber + this->hiddenNeuronsNumber ) );
+  for( size_t weightIndex = 0; weightIndex < hiddenWeightsNumber; weightIndex++ )
+    hiddenWeightsTable[ weightIndex ] = hiddenWeightsLimit * hiddenWeightsDistribution( randomGenerator );
+  double outputWeightsLimit = std::sqrt( 6.0 / ( this->hiddenNeuronsNumber + outputsNumber ) );
+  for( size_t weightIndex = 0; weightIndex < outputWeightsNumber; weightIndex++ )
+    outputWeightsTable[ weightIndex ] = outputWeightsLimit * hiddenWeightsDistribution( randomGenerator );
+  
+  inputMeansList.assign( inputsNumber, 0.0 );
+  inputScalesList.assign( inputsNumber, 1.0 );
+  outputMeansList.assign( outputsNumber, 0.0 );
+  outputScalesList.assign( outputsNumber, 1.0 );
+  normalizedInputsList.resize( inputsNumber );
+  hiddenOutputsList.resize( this->hiddenNeuronsNumber );
+  hiddenDeltasList.resize( this->hiddenNeuronsNumber );
+  outputDeltasList.resize( outputsNumber );
+  blockInputsTable.resize( PROCESSING_BLOCK_SIZE * inputsNumber );
+  blockHiddenTable.resize( PROCESSING_BLOCK_SIZE * this->hiddenNeuronsNumber );
+  blockHiddenDeltasTable.resize( PROCESSING_BLOCK_SIZE * this->hiddenNeuronsNumber );
+  blockOutputsTable.resize( PROCESSING_BLOCK_SIZE * outputsNumber );
+}
+
+MLPNetwork::MLPNetwork( const MLPNetwork& network )
+: inputsNumber( network.inputsNumber ), outputsNumber( network.outputsNumber ), hiddenNeuronsNumber( network.hiddenNeuronsNumber ), 
+  parametersList( network.parametersList ), gradientsList( network.gradientsList ), 
+  firstMomentsList( network.firstMomentsList ), secondMomentsList( network.secondMomentsList ), 
+  inputMeansList( network.inputMeansList ), inputScalesList( network.inputScalesList ), 
+  outputMeansList( network.outputMeansList ), outputScalesList( network.outputScalesList ), 
+  normalizedInputsList( network.normalizedInputsList ), hiddenOutputsList( network.hiddenOutputsList ), 
+  hiddenDeltasList( network.hiddenDeltasList ), outputDeltasList( network.outputDeltasList ), 
+  blockInputsTable( network.blockInputsTable ), blockHiddenTable( network.blockHiddenTable ), 
+  blockHiddenDeltasTable( network.blockHiddenDeltasTable ), blockOutputsTable( network.blockOutputsTable ), 
+  optimizationStepsCount( network.optimizationStepsCount ), randomGenerator( network.randomGenerator ), 
+  isBatchProcessingEnabled( network.isBatchProcessingEnabled ), hasTrainedWeights( network.hasTrainedWeights )
+{
+  BindParameters();
+}
+
+MLPNetwork::~MLPNetwork() { }
+
+MLPNetwork& MLPNetwork::operator=( const MLPNetwork& network )
+{
+  if( &network == this ) return *this;
+  
+  inputsNumber = network.inputsNumber;
+  outputsNumber = network.outputsNumber;
+  hiddenNeuronsNumber = network.hiddenNeuronsNumber;
+  parametersList = network.parametersList;
+  gradientsList = network.gradientsList;
+  firstMomentsList = network.firstMomentsList;
+  secondMomentsList = network.secondMomentsList;
+  inputMeansList = network.inputMeansList;
+  inputScalesList = network.inputScalesList;
+  outputMeansList = network.outputMeansList;
+  outputScalesList = network.outputScalesList;
+  normalizedInputsList = network.normalizedInputsList;
+  hiddenOutputsList = network.hiddenOutputsList;
+  hiddenDeltasList = network.hiddenDeltasList;
+  outputDeltasList = network.outputDeltasList;
+  blockInputsTable = network.blockInputsTable;
+  blockHiddenTable = network.blockHiddenTable;
+  blockHiddenDeltasTable = network.blockHiddenDeltasTable;
+  blockOutputsTable = network.blockOutputsTable;
+  isBatchProcessingEnabled = network.isBatchProcessingEnabled;
+  hasTrainedWeights = network.hasTrainedWeights;
+  optimizationStepsCount = network.optimizationStepsCount;
+  randomGenerator = network.randomGenerator;
+  BindParameters();
+  
+  return *this;
+}
+
+void MLPNetwork::CopyWeights( const MLPNetwork& network )
+{
+  if( network.inputsNumber != inputsNumber || network.outputsNumber != outputsNumber ) return;
+  
+  size_t sharedNeuronsNumber = std::min( hiddenNeuronsNumber, network.hiddenNeuronsNumber );
+  std::copy( network.hiddenWeightsTable, network.hiddenWeightsTable + sharedNeuronsNumber * inputsNumber, hiddenWeightsTable );
+  std::copy( network.hiddenBiasesList, network.hiddenBiasesList + sharedNeuronsNumber, hiddenBiasesList );
+  for( size_t outputIndex = 0; outputIndex < outputsNumber; outputIndex++ )
+  {
+    const double* sourceWeightsList = network.outputWeightsTable + outputIndex * network.hiddenNeuronsNumber;
+    double* outputWeightsList = outputWeightsTable + outputIndex * hiddenNeuronsNumber;
+    std::copy( sourceWeightsList, sourceWeightsList + sharedNeuronsNumber, outputWeightsList );
+    // Added neurons do not change outputs until trained
+    std::fill( outputWeightsList + sharedNeuronsNumber, outputWeightsList + hiddenNeuronsNumber, 0.0 );
+  }
+  std::copy( network.outputBiasesList, network.outputBiasesList + outputsNumber, outputBiasesList );
+  
+  inputMeansList = network.inputMeansList;
+  inputScalesList = network.inputScalesList;
+  outputMeansList = network.outputMeansList;
+  outputScalesList = network.outputScalesList;
+  
+  // Optimizer state does not carry over between different parameter sets
+  std::fill( firstMomentsList.begin(), firstMomentsList.end(), 0.0 );
+  std::fill( secondMomentsList.begin(), secondMomentsList.end(), 0.0 );
+  optimizationStepsCount = 0;
+  hasTrainedWeights = true;
+}
+
+size_t MLPNetwork::GetInputsNumber() const { return inputsNumber; }
+
+size_t MLPNetwork::GetOutputsNumber() const { return outputsNumber; }
+
+size_t MLPNetwork::GetHiddenNeuronsNumber() const { return hiddenNeuronsNumber; }
+
+size_t MLPNetwork::GetStateSize() const { return parametersList.size() + 2 * inputsNumber + 2 * outputsNumber; }
+
+void MLPNetwork::GetState( double* stateList ) const
+{
+  stateList = std::copy( parametersList.begin(), parametersList.end(), stateList );
+  stateList = std::copy( inputMeansList.begin(), inputMeansList.end(), stateList );
+  stateList = std::copy( inputScalesList.begin(), inputScalesList.end(), stateList );
+  stateList = std::copy( outputMeansList.begin(), outputMeansList.end(), stateList );
+  std::copy( outputScalesList.begin(), outputScalesList.end(), stateList );
+}
+
+void MLPNetwork::SetState( const double* stateList )
+{
+  std::copy( stateList, stateList + parametersList.size(), parametersList.begin() );
+  stateList += parametersList.size();
+  std::copy( stateList, stateList + inputsNumber, inputMeansList.begin() );
+  std::copy( stateList + inputsNumber, stateList + 2 * inputsNumber, inputScalesList.begin() );
+  stateList += 2 * inputsNumber;
+  std::copy( stateList, stateList + outputsNumber, outputMeansList.begin() );
+  std::copy( stateList + outputsNumber, stateList + 2 * outputsNumber, outputScalesList.begin() );
+  hasTrainedWeights = true;
+  
+  std::fill( firstMomentsList.begin(), firstMomentsList.end(), 0.0 );
+  std::fill( secondMomentsList.begin(), secondMomentsList.end(), 0.0 );
+  optimizationStepsCount = 0;
+}
+
+void MLPNetwork::SetBatchProcessing( bool enabled ) { isBatchProcessingEnabled = enabled; }
+
+void MLPNetwork::BindParameters()
+{
+  hiddenWeightsTable = parametersList.data();
+  hiddenBiasesList = hiddenWeightsTable + hiddenNeuronsNumber * inputsNumber;
+  outputWeightsTable = hiddenBiasesList + hiddenNeuronsNumber;
+  outputBiasesList = outputWeightsTable + outputsNumber * hiddenNeuronsNumber;
+}
+
+void MLPNetwork::SetNormalization( const double* inputsTable, size_t inputsStride, const double* outputsTable, size_t outputsStride, size_t samplesNumber )
+{
+  if( samplesNumber == 0 ) return;
+  
+  auto CalculateStatistics = [ samplesNumber ]( const double* valuesTable, size_t stride, size_t valuesNumber, AlignedVector& meansList, AlignedVector& scalesList )
+  {
+    for( size_t valueIndex = 0; valueIndex < valuesNumber; valueIndex++ )
+    {
+      double mean = 0.0, variance = 0.0;
+      for( size_t sampleIndex = 0; sampleIndex < samplesNumber; sampleIndex++ )
+        mean += valuesTable[ sampleIndex * stride + valueIndex ] / samplesNumber;
+      for( size_t sampleIndex = 0; sampleIndex < samplesNumber; sampleIndex++ )
+        variance += std::pow( valuesTable[ sampleIndex * stride + valueIndex ] - mean, 2.0 ) / samplesNumber;
+      meansList[ valueIndex ] = mean;
+      // Constant values are only centered
+      scalesList[ valueIndex ] = ( variance > 1.0e-12 ) ? std::sqrt( variance ) : 1.0;
+    }
+  };
+  
+  CalculateStatistics( inputsTable, inputsStride, inputsNumber, inputMeansList, inputScalesList );
+  CalculateStatistics( outputsTable, outputsStride, outputsNumber, outputMeansList, outputScalesList );
+}
+
+// Folds the change from the given previous normalization into first and last layer weights, keeping the network function
+void MLPNetwork::RescaleWeights( const AlignedVector& previousInputMeansList, const AlignedVector& previousInputScalesList, 
+                                 const AlignedVector& previousOutputMeansList, const AlignedVector& previousOutputScalesList )
+{
+  for( size_t neuronIndex = 0; neuronIndex < hiddenNeuronsNumber; neuronIndex++ )
+  {
+    double* weightsList = hiddenWeightsTable + neuronIndex * inputsNumber;
+    for( size_t inputIndex = 0; inputIndex < inputsNumber; inputIndex++ )
+    {
+      double rawWeight = weightsList[ inputIndex ] / previousInputScalesList[ inputIndex ];
+      hiddenBiasesList[ neuronIndex ] += rawWeight * ( inputMeansList[ inputIndex ] - previousInputMeansList[ inputIndex ] );
+      weightsList[ inputIndex ] = rawWeight * inputScalesList[ inputIndex ];
+    }
+  }
+  for( size_t outputIndex = 0; outputIndex < outputsNumber; outputIndex++ )
+  {
+    double scaleRatio = previousOutputScalesList[ outputIndex ] / outputScalesList[ outputIndex ];
+    double* weightsList = outputWeightsTable + outputIndex * hiddenNeuronsNumber;
+    for( size_t neuronIndex = 0; neuronIndex < hiddenNeuronsNumber; neuronIndex++ )
+      weightsList[ neuronIndex ] *= scaleRatio;
+    outputBiasesList[ outputIndex ] = outputBiasesList[ outputIndex ] * scaleRatio 
+                                      + ( previousOutputMeansList[ outputIndex ] - outputMeansList[ outputIndex ] ) / outputScalesList[ outputIndex ];
+  }
+}
+
+double MLPNetwork::Train( const double* inputsTable, size_t inputsStride, const double* outputsTable, size_t outputsStride, size_t samplesNumber, size_t epochsNumber )
+{
+  if( samplesNumber == 0 ) return 0.0;
+  
+  // Weights fitted under another normalization are adapted to the new one
+  AlignedVector previousInputMeansList( inputMeansList ), previousInputScalesList( inputScalesList );
+  AlignedVector previousOutputMeansList( outputMeansList ), previousOutputScalesList( outputScalesList );
+  SetNormalization( inputsTable, inputsStride, outputsTable, outputsStride, samplesNumber );
+  if( hasTrainedWeights ) RescaleWeights( previousInputMeansList, previousInputScalesList, previousOutputMeansList, previousOutputScalesList );
+  hasTrainedWeights = true;
+  
+  std::vector<size_t> sampleIndexesList( samplesNumber );
+  std::iota( sampleIndexesList.begin(), sampleIndexesList.end(), 0 );
+  for( size_t epochIndex = 0; epochIndex < epochsNumber; epochIndex++ )
+  {
+    std::shuffle( sampleIndexesList.begin(), sampleIndexesList.end(), randomGenerator );
+    for( size_t batchStartIndex = 0; batchStartIndex < samplesNumber; batchStartIndex += TRAINING_BATCH_SIZE )
+    {
+      size_t batchSize = std::min( TRAINING_BATCH_SIZE, samplesNumber - batchStartIndex );
+      TrainBatch( inputsTable, inputsStride, outputsTable, outputsStride, sampleIndexesList.data() + batchStartIndex, batchSize, TRAINING_LEARNING_RATE );
+    }
+  }
+  
+  return Validate( inputsTable, inputsStride, outputsTable, outputsStride, samplesNumber );
+}
+
+double MLPNetwork::TrainBatch( const double* inputsTable, size_t inputsStride, const double* outputsTable, size_t outputsStride, 
+                               const size_t* sampleIndexesList, size_t batchSize, double learningRate )
+{
+  if( batchSize == 0 ) return 0.0;
+  
+  std::fill( gradientsList.begin(), gradientsList.end(), 0.0 );
+  double batchError = 0.0;
+  if( isBatchProcessingEnabled )
+  {
+    double* hiddenWeightGradientsTable = gradientsList.data();
+    double* hiddenBiasGradientsList = hiddenWeightGradientsTable + hiddenNeuronsNumber * inputsNumber;
+    double* outputWeightGradientsTable = hiddenBiasGradientsList + hiddenNeuronsNumber;
+    double* outputBiasGradientsList = outputWeightGradientsTable + outputsNumber * hiddenNeuronsNumber;
+    for( size_t blockStartIndex = 0; blockStartIndex < batchSize; blockStartIndex += PROCESSING_BLOCK_SIZE )
+    {
+      size_t blockSize = std::min( PROCESSING_BLOCK_SIZE, batchSize - blockStartIndex );
+      PropagateBlock( inputsTable, inputsStride, sampleIndexesList + blockStartIndex, 0, blockSize );
+      batchError += CalculateBlockDeltas( outputsTable, outputsStride, sampleIndexesList + blockStartIndex, 0, blockSize );
+      
+      AccumulateTransposed( blockOutputsTable.data(), blockHiddenTable.data(), outputWeightGradientsTable, outputsNumber, hiddenNeuronsNumber, blockSize );
+      Multiply( blockOutputsTable.data(), outputWeightsTable, blockHiddenDeltasTable.data(), blockSize, hiddenNeuronsNumber, outputsNumber );
+      for( size_t blockIndex = 0; blockIndex < blockSize; blockIndex++ )
+      {
+        const double* outputDeltasRow = blockOutputsTable.data() + blockIndex * outputsNumber;
+        for( size_t outputIndex = 0; outputIndex < outputsNumber; outputIndex++ )
+          outputBiasGradientsList[ outputIndex ] += outputDeltasRow[ outputIndex ];
+        const double* hiddenOutputsRow = blockHiddenTable.data() + blockIndex * hiddenNeuronsNumber;
+        double* hiddenDeltasRow = blockHiddenDeltasTable.data() + blockIndex * hiddenNeuronsNumber;
+        for( size_t neuronIndex = 0; neuronIndex < hiddenNeuronsNumber; neuronIndex++ )
+        {
+          hiddenDeltasRow[ neuronIndex ] *= ( 1.0 - hiddenOutputsRow[ neuronIndex ] * hiddenOutputsRow[ neuronIndex ] );
+          hiddenBiasGradientsList[ neuronIndex ] += hiddenDeltasRow[ neuronIndex ];
+        }
+      }
+      AccumulateTransposed( blockHiddenDeltasTable.data(), blockInputsTable.data(), hiddenWeightGradientsTable, hiddenNeuronsNumber, inputsNumber, blockSize );
+    }
+  }
+  else
+  {
+    for( size_t batchIndex = 0; batchIndex < batchSize; batchIndex++ )
+    {
+      size_t sampleIndex = sampleIndexesList[ batchIndex ];
+      batchError += AccumulateGradients( inputsTable + sampleIndex * inputsStride, outputsTable + sampleIndex * outputsStride );
+    }
+  }
+  
+  UpdateParameters( learningRate, 1.0 / batchSize );
+  
+  return batchError / batchSize;
+}
+
+double MLPNetwork::Validate( const double* inputsTable, size_t inputsStride, const double* outputsTable, size_t outputsStride, size_t samplesNumber ) const
+{
+  if( samplesNumber == 0 ) return 0.0;
+  
+  double validationError = 0.0;
+  if( isBatchProcessingEnabled )
+  {
+    for( size_t blockStartIndex = 0; blockStartIndex < samplesNumber; blockStartIndex += PROCESSING_BLOCK_SIZE )
+    {
+      size_t blockSize = std::min( PROCESSING_BLOCK_SIZE, samplesNumber - blockStartIndex );
+      PropagateBlock( inputsTable, inputsStride, NULL, blockStartIndex, blockSize );
+      validationError += CalculateBlockDeltas( outputsTable, outputsStride, NULL, blockStartIndex, blockSize );
+    }
+  }
+  else
+  {
+    std::vector<double> outputsList( outputsNumber );
+    for( size_t sampleIndex = 0; sampleIndex < samplesNumber; sampleIndex++ )
+    {
+      Process( inputsTable + sampleIndex * inputsStride, outputsList.data() );
+      const double* targetsList = outputsTable + sampleIndex * outputsStride;
+      for( size_t outputIndex = 0; outputIndex < outputsNumber; outputIndex++ )
+        validationError += std::pow( ( outputsList[ outputIndex ] - targetsList[ outputIndex ] ) / outputScalesList[ outputIndex ], 2.0 );
+    }
+  }
+  
+  return validationError / samplesNumber;
+}
+
+void MLPNetwork::Process( const double* inputsList, double* outputsList ) const
+{
+  for( size_t inputIndex = 0; inputIndex < inputsNumber; inputIndex++ )
+    normalizedInputsList[ inputIndex ] = ( inputsList[ inputIndex ] - inputMeansList[ inputIndex ] ) / inputScalesList[ inputIndex ];
+  for( size_t neuronIndex = 0; neuronIndex < hiddenNeuronsNumber; neuronIndex++ )
+  {
+    const double* neuronWeightsList = hiddenWeightsTable + neuronIndex * inputsNumber;
+    double activation = hiddenBiasesList[ neuronIndex ];
+    for( size_t inputIndex = 0; inputIndex < inputsNumber; inputIndex++ )
+      activation += neuronWeightsList[ inputIndex ] * normalizedInputsList[ inputIndex ];
+    hiddenOutputsList[ neuronIndex ] = std::tanh( activation );
+  }
+  for( size_t outputIndex = 0; outputIndex < outputsNumber; outputIndex++ )
+  {
+    const double* outputWeightsList = outputWeightsTable + outputIndex * hiddenNeuronsNumber;
+    double output = outputBiasesList[ outputIndex ];
+    for( size_t neuronIndex = 0; neuronIndex < hiddenNeuronsNumber; neuronIndex++ )
+      output += outputWeightsList[ neuronIndex ] * hiddenOutputsList[ neuronIndex ];
+    outputsList[ outputIndex ] = output * outputScalesList[ outputIndex ] + outputMeansList[ outputIndex ];
+  }
+}
+
+// Normalized layer values for a block of samples, either indexed or consecutive from the given one
+void MLPNetwork::PropagateBlock( const double* inputsTable, size_t inputsStride, const size_t* sampleIndexesList, size_t firstSampleIndex, size_t blockSize ) const
+{
+  for( size_t blockIndex = 0; blockIndex < blockSize; blockIndex++ )
+  {
+    size_t sampleIndex = ( sampleIndexesList != NULL ) ? sampleIndexesList[ blockIndex ] : firstSampleIndex + blockIndex;
+    const double* inputsList = inputsTable + sampleIndex * inputsStride;
+    double* inputsRow = blockInputsTable.data() + blockIndex * inputsNumber;
+    for( size_t inputIndex = 0; inputIndex < inputsNumber; inputIndex++ )
+      inputsRow[ inputIndex ] = ( inputsList[ inputIndex ] - inputMeansList[ inputIndex ] ) / inputScalesList[ inputIndex ];
+  }
+  
+  MultiplyTransposed( blockInputsTable.data(), hiddenWeightsTable, blockHiddenTable.data(), blockSize, hiddenNeuronsNumber, inputsNumber );
+  for( size_t blockIndex = 0; blockIndex < blockSize; blockIndex++ )
+  {
+    double* hiddenRow = blockHiddenTable.data() + blockIndex * hiddenNeuronsNumber;
+    for( size_t neuronIndex = 0; neuronIndex < hiddenNeuronsNumber; neuronIndex++ )
+      hiddenRow[ neuronIndex ] = std::tanh( hiddenRow[ neuronIndex ] + hiddenBiasesList[ neuronIndex ] );
+  }
+  
+  MultiplyTransposed( blockHiddenTable.data(), outputWeightsTable, blockOutputsTable.data(), blockSize, outputsNumber, hiddenNeuronsNumber );
+  for( size_t blockIndex = 0; blockIndex < blockSize; blockIndex++ )
+  {
+    double* outputsRow = blockOutputsTable.data() + blockIndex * outputsNumber;
+    for( size_t outputIndex = 0; outputIndex < outputsNumber; outputIndex++ )
+      outputsRow[ outputIndex ] += outputBiasesList[ outputIndex ];
+  }
+}
+
+// Replaces propagated block outputs by their normalized errors, returning the summed squares
+double MLPNetwork::CalculateBlockDeltas( const double* outputsTable, size_t outputsStride, const size_t* sampleIndexesList, size_t firstSampleIndex, size_t blockSize ) const
+{
+  double blockError = 0.0;
+  for( size_t blockIndex = 0; blockIndex < blockSize; blockIndex++ )
+  {
+    size_t sampleIndex = ( sampleIndexesList != NULL ) ? sampleIndexesList[ blockIndex ] : firstSampleIndex + blockIndex;
+    const double* targetsList = outputsTable + sampleIndex * outputsStride;
+    double* outputsRow = blockOutputsTable.data() + blockIndex * outputsNumber;
+    for( size_t outputIndex = 0; outputIndex < outputsNumber; outputIndex++ )
+    {
+      outputsRow[ outputIndex ] -= ( targetsList[ outputIndex ] - outputMeansList[ outputIndex ] ) / outputScalesList[ outputIndex ];
+      blockError += outputsRow[ outputIndex ] * outputsRow[ outputIndex ];
+    }
+  }
+  
+  return blockError;
+}
+
+// Backpropagation of the squared normalized error of a single sample, returned
+double MLPNetwork::AccumulateGradients( const double* inputsList, const double* targetsList )
+{
+  Process( inputsList, outputDeltasList.data() );
+  
+  double sampleError = 0.0;
+  for( size_t outputIndex = 0; outputIndex < outputsNumber; outputIndex++ )
+  {
+    outputDeltasList[ outputIndex ] = ( outputDeltasList[ outputIndex ] - targetsList[ outputIndex ] ) / outputScalesList[ outputIndex ];
+    sampleError += outputDeltasList[ outputIndex ] * outputDeltasList[ outputIndex ];
+  }
+  
+  double* hiddenWeightGradientsTable = gradientsList.data();
+  double* hiddenBiasGradientsList = hiddenWeightGradientsTable + hiddenNeuronsNumber * inputsNumber;
+  double* outputWeightGradientsTable = hiddenBiasGradientsList + hiddenNeuronsNumber;
+  double* outputBiasGradientsList = outputWeightGradientsTable + outputsNumber * hiddenNeuronsNumber;
+  std::fill( hiddenDeltasList.begin(), hiddenDeltasList.end(), 0.0 );
+  for( size_t outputIndex = 0; outputIndex < outputsNumber; outputIndex++ )
+  {
+    double outputDelta = outputDeltasList[ outputIndex ];
+    const double* outputWeightsList = outputWeightsTable + outputIndex * hiddenNeuronsNumber;
+    double* outputWeightGradientsList = outputWeightGradientsTable + outputIndex * hiddenNeuronsNumber;
+    for( size_t neuronIndex = 0; neuronIndex < hiddenNeuronsNumber; neuronIndex++ )
+    {
+      outputWeightGradientsList[ neuronIndex ] += outputDelta * hiddenOutputsList[ neuronIndex ];
+      hiddenDeltasList[ neuronIndex ] += outputDelta * outputWeightsList[ neuronIndex ];
+    }
+    outputBiasGradientsList[ outputIndex ] += outputDelta;
+  }
+  for( size_t neuronIndex = 0; neuronIndex < hiddenNeuronsNumber; neuronIndex++ )
+  {
+    double hiddenDelta = hiddenDeltasList[ neuronIndex ] * ( 1.0 - hiddenOutputsList[ neuronIndex ] * hiddenOutputsList[ neuronIndex ] );
+    double* hiddenWeightGradientsList = hiddenWeightGradientsTable + neuronIndex * inputsNumber;
+    for( size_t inputIndex = 0; inputIndex < inputsNumber; inputIndex++ )
+      hiddenWeightGradientsList[ inputIndex ] += hiddenDelta * normalizedInputsList[ inputIndex ];
+    hiddenBiasGradientsList[ neuronIndex ] += hiddenDelta;
+  }
+  
+  return sampleError;
+}
+
+void MLPNetwork::UpdateParameters( double learningRate, double gradientsScale )
+{
+  optimizationStepsCount++;
+  double firstCorrection = 1.0 - std::pow( ADAM_FIRST_DECAY, (double) optimizationStepsCount );
+  double secondCorrection = 1.0 - std::pow( ADAM_SECOND_DECAY, (double) optimizationStepsCount );
+  for( size_t parameterIndex = 0; parameterIndex < parametersList.size(); parameterIndex++ )
+  {
+    double gradient = gradientsList[ parameterIndex ] * gradientsScale;
+    firstMomentsList[ parameterIndex ] = ADAM_FIRST_DECAY * firstMomentsList[ parameterIndex ] + ( 1.0 - ADAM_FIRST_DECAY ) * gradient;
+    secondMomentsList[ parameterIndex ] = ADAM_SECOND_DECAY * secondMomentsList[ parameterIndex ] + ( 1.0 - ADAM_SECOND_DECAY ) * gradient * gradient;
+    double firstMoment = firstMomentsList[ parameterIndex ] / firstCorrection;
+    double secondMoment = secondMomentsList[ parameterIndex ] / secondCorrection;
+    parametersList[ parameterIndex ] -= learningRate * firstMoment / ( std::sqrt( secondMoment ) + ADAM_EPSILON );
+  }
+}
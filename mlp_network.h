@@ -0,0 +1,98 @@
+#ifndef MLP_NETWORK_H
+#define MLP_NETWORK_H
+
+#include <vector>
+#include <random>
+#include <cstdlib>
+#include <cstdint>
+#include <new>
+
+const size_t CACHE_LINE_SIZE = 64;
+
+/* Minimal allocator returning cache line aligned storage, so that hot buffers do not straddle or share lines */
+template <typename T> struct CacheAlignedAllocator
+{
+  typedef T value_type;
+  
+  CacheAlignedAllocator() { }
+  template <typename U> CacheAlignedAllocator( const CacheAlignedAllocator<U>& ) { }
+  
+  T* allocate( size_t elementsNumber )
+  {
+    // Original pointer is kept right before the aligned block
+    void* memory = std::malloc( elementsNumber * sizeof(T) + CACHE_LINE_SIZE + sizeof(void*) );
+    if( memory == NULL ) throw std::bad_alloc();
+    uintptr_t alignedAddress = ( (uintptr_t) memory + sizeof(void*) + CACHE_LINE_SIZE - 1 ) & ~( (uintptr_t) CACHE_LINE_SIZE - 1 );
+    ( (void**) alignedAddress )[ -1 ] = memory;
+    return (T*) alignedAddress;
+  }
+  
+  void deallocate( T* elementsList, size_t ) { if( elementsList != NULL ) std::free( ( (void**) elementsList )[ -1 ] ); }
+};
+
+template <typename T, typename U> bool operator==( const CacheAlignedAllocator<T>&, const CacheAlignedAllocator<U>& ) { return true; }
+template <typename T, typename U> bool operator!=( const CacheAlignedAllocator<T>&, const CacheAlignedAllocator<U>& ) { return false; }
+
+typedef std::vector<double, CacheAlignedAllocator<double>> AlignedVector;
+
+/* Single hidden layer perceptron (tanh hidden units, linear outputs) trained with Adam over normalized data.
+   Samples are read from row-major tables, one row every stride values */
+class MLPNetwork
+{
+  public:
+    /* Constructor class. Weights are randomly initialized, with identity normalization */
+    MLPNetwork( size_t inputsNumber, size_t outputsNumber, size_t hiddenNeuronsNumber, unsigned int seed = 1 );
+    MLPNetwork( const MLPNetwork& );
+    ~MLPNetwork();
+
+    MLPNetwork& operator=( const MLPNetwork& );
+
+    /* Warm start from a network with the same inputs and outputs. Hidden neurons not present there keep random input weights and null output weights.
+       Train() rescales copied, loaded or already trained weights to its own normalization, so that outputs do not change with it */
+    void CopyWeights( const MLPNetwork& );
+
+    size_t GetInputsNumber() const;
+    size_t GetOutputsNumber() const;
+    size_t GetHiddenNeuronsNumber() const;
+
+    /* Weights followed by normalization statistics, as GetStateSize() values, for persistence */
+    size_t GetStateSize() const;
+    void GetState( double* ) const;
+    void SetState( const double* );
+
+    /* Sets input/output normalization from samples statistics and trains over them for the given epochs. Returns final training error */
+    double Train( const double*, size_t, const double*, size_t, size_t, size_t epochsNumber );
+    /* Single optimization step over the indexed samples, keeping normalization. Allocation free */
+    double TrainBatch( const double*, size_t, const double*, size_t, const size_t*, size_t, double learningRate );
+    /* Mean squared normalized output error */
+    double Validate( const double*, size_t, const double*, size_t, size_t ) const;
+
+    /* Writes into caller owned outputs, using only preallocated layer buffers */
+    void Process( const double*, double* ) const;
+
+    /* Process training and validation samples in blocks, as matrix products, instead of one at a time (enabled by default) */
+    void SetBatchProcessing( bool );
+
+  private:
+    void BindParameters();
+    void PropagateBlock( const double*, size_t, const size_t*, size_t, size_t ) const;
+    double CalculateBlockDeltas( const double*, size_t, const size_t*, size_t, size_t ) const;
+    void SetNormalization( const double*, size_t, const double*, size_t, size_t );
+    void RescaleWeights( const AlignedVector&, const AlignedVector&, const AlignedVector&, const AlignedVector& );
+    double AccumulateGradients( const double*, const double* );
+    void UpdateParameters( double, double );
+
+    size_t inputsNumber, outputsNumber, hiddenNeuronsNumber;
+    // Packed hidden weights, hidden biases, output weights and output biases
+    AlignedVector parametersList, gradientsList, firstMomentsList, secondMomentsList;
+    double *hiddenWeightsTable, *hiddenBiasesList, *outputWeightsTable, *outputBiasesList;
+    AlignedVector inputMeansList, inputScalesList, outputMeansList, outputScalesList;
+    mutable AlignedVector normalizedInputsList, hiddenOutputsList, hiddenDeltasList, outputDeltasList;
+    // Row-major per block layer values: normalized inputs, hidden outputs, hidden deltas and outputs (replaced by output deltas when training)
+    mutable AlignedVector blockInputsTable, blockHiddenTable, blockHiddenDeltasTable, blockOutputsTable;
+    size_t optimizationStepsCount;
+    std::mt19937 randomGenerator;
+    bool isBatchProcessingEnabled, hasTrainedWeights;
+};
+
+#endif // MLP_NETWORK_H
@@ -0,0 +1,81 @@
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "mlp_network.h"
+
+const size_t HIDDEN_NEURONS_NUMBERS_LIST[] = { 8, 16, 32, 64, 128, 256 };
+const size_t TRAINING_BATCH_SIZE = 32;
+
+double GetElapsedSeconds( std::chrono::steady_clock::time_point initialTime )
+{
+  return std::chrono::duration_cast<std::chrono::duration<double>>( std::chrono::steady_clock::now() - initialTime ).count();
+}
+
+// Samples per second of validation and mini-batch training passes over the whole sample block
+void MeasureThroughput( MLPNetwork& network, const std::vector<double>& inputsTable, const std::vector<double>& outputsTable, size_t samplesNumber, 
+                        size_t repetitionsNumber, double& validationRate, double& trainingRate )
+{
+  size_t inputsNumber = network.GetInputsNumber();
+  size_t outputsNumber = network.GetOutputsNumber();
+  
+  std::chrono::steady_clock::time_point initialTime = std::chrono::steady_clock::now();
+  double validationError = 0.0;
+  for( size_t repetitionIndex = 0; repetitionIndex < repetitionsNumber; repetitionIndex++ )
+    validationError += network.Validate( inputsTable.data(), inputsNumber, outputsTable.data(), outputsNumber, samplesNumber );
+  validationRate = repetitionsNumber * samplesNumber / GetElapsedSeconds( initialTime );
+  
+  std::vector<size_t> sampleIndexesList( samplesNumber );
+  for( size_t sampleIndex = 0; sampleIndex < samplesNumber; sampleIndex++ )
+    sampleIndexesList[ sampleIndex ] = sampleIndex;
+  initialTime = std::chrono::steady_clock::now();
+  for( size_t repetitionIndex = 0; repetitionIndex < repetitionsNumber; repetitionIndex++ )
+  {
+    for( size_t batchStartIndex = 0; batchStartIndex + TRAINING_BATCH_SIZE <= samplesNumber; batchStartIndex += TRAINING_BATCH_SIZE )
+      network.TrainBatch( inputsTable.data(), inputsNumber, outputsTable.data(), outputsNumber, sampleIndexesList.data() + batchStartIndex, TRAINING_BATCH_SIZE, 1.0e-3 );
+  }
+  trainingRate = repetitionsNumber * ( samplesNumber - samplesNumber % TRAINING_BATCH_SIZE ) / GetElapsedSeconds( initialTime );
+  
+  // Keep the validation work observable
+  if( validationError < 0.0 ) std::cout << validationError << std::endl;
+}
+
+int main( int argc, char* argv[] )
+{
+  size_t inputsNumber = ( argc > 1 ) ? (size_t) atoi( argv[ 1 ] ) : 30;
+  size_t outputsNumber = ( argc > 2 ) ? (size_t) atoi( argv[ 2 ] ) : 10;
+  size_t samplesNumber = ( argc > 3 ) ? (size_t) atoi( argv[ 3 ] ) : 4096;
+  size_t repetitionsNumber = ( argc > 4 ) ? (size_t) atoi( argv[ 4 ] ) : 10;
+  if( inputsNumber == 0 || outputsNumber == 0 || samplesNumber == 0 || repetitionsNumber == 0 )
+  {
+    std::cout << "usage: " << argv[ 0 ] << " [inputs number] [outputs number] [samples number] [repetitions number]" << std::endl;
+    exit( -1 );
+  }
+  
+  // Random contiguous sample blocks, laid out as in NMSProcessorBase
+  std::mt19937 randomGenerator( 1 );
+  std::normal_distribution<double> valuesDistribution( 0.0, 1.0 );
+  std::vector<double> inputsTable( samplesNumber * inputsNumber ), outputsTable( samplesNumber * outputsNumber );
+  for( size_t valueIndex = 0; valueIndex < inputsTable.size(); valueIndex++ )
+    inputsTable[ valueIndex ] = valuesDistribution( randomGenerator );
+  for( size_t valueIndex = 0; valueIndex < outputsTable.size(); valueIndex++ )
+    outputsTable[ valueIndex ] = valuesDistribution( randomGenerator );
+  
+  std::cout << "Inputs: " << inputsNumber << ", outputs: " << outputsNumber << ", samples: " << samplesNumber << std::endl;
+  std::cout << "hidden neurons\tvalidation samples/s (per sample, batched)\ttraining samples/s (per sample, batched)" << std::endl;
+  for( size_t hiddenNeuronsNumber : HIDDEN_NEURONS_NUMBERS_LIST )
+  {
+    MLPNetwork network( inputsNumber, outputsNumber, hiddenNeuronsNumber );
+    double sampleValidationRate, sampleTrainingRate, batchValidationRate, batchTrainingRate;
+    network.SetBatchProcessing( false );
+    MeasureThroughput( network, inputsTable, outputsTable, samplesNumber, repetitionsNumber, sampleValidationRate, sampleTrainingRate );
+    network.SetBatchProcessing( true );
+    MeasureThroughput( network, inputsTable, outputsTable, samplesNumber, repetitionsNumber, batchValidationRate, batchTrainingRate );
+    std::cout << hiddenNeuronsNumber << "\t" << sampleValidationRate << "\t" << batchValidationRate << " (x" << batchValidationRate / sampleValidationRate << ")"
+              << "\t" << sampleTrainingRate << "\t" << batchTrainingRate << " (x" << batchTrainingRate / sampleTrainingRate << ")" << std::endl;
+  }
+  
+  exit( 0 );
+}
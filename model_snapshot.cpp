@@ -0,0 +1,135 @@
+#include "model_snapshot.h"
+
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <cstring>
+#include <cstdio>
+
+#ifdef _WIN32
+  #include <process.h>
+  #define getpid _getpid
+#else
+  #include <unistd.h>
+#endif
+
+const char FILE_SIGNATURE[ 8 ] = { 'N', 'M', 'S', 'S', 'N', 'A', 'P', '1' };
+
+const uint64_t HASH_OFFSET_BASIS = 14695981039346656037ULL, HASH_PRIME = 1099511628211ULL;
+
+ModelSnapshot::ModelSnapshot( const std::string& modelFilePath )
+{
+  filePath = modelFilePath.substr( 0, modelFilePath.rfind( ".osim" ) ) + "-snapshot.bin";
+  modelHash = HashFile( modelFilePath );
+  if( modelHash != 0 ) LoadSections( sectionsTable );
+}
+
+ModelSnapshot::~ModelSnapshot() { }
+
+bool ModelSnapshot::HasSection( const std::string& sectionName ) const
+{
+  return ( sectionsTable.find( sectionName ) != sectionsTable.end() );
+}
+
+bool ModelSnapshot::GetSection( const std::string& sectionName, std::vector<double>& valuesList, size_t valuesNumber ) const
+{
+  SectionsTable::const_iterator sectionIterator = sectionsTable.find( sectionName );
+  if( sectionIterator == sectionsTable.end() ) return false;
+  if( valuesNumber > 0 && sectionIterator->second.size() != valuesNumber ) return false;
+  valuesList = sectionIterator->second;
+  return true;
+}
+
+void ModelSnapshot::SetSection( const std::string& sectionName, const std::vector<double>& valuesList )
+{
+  sectionsTable[ sectionName ] = valuesList;
+}
+
+bool ModelSnapshot::Save() const
+{
+  if( modelHash == 0 ) return false;
+  
+  SectionsTable storedSectionsTable;
+  LoadSections( storedSectionsTable );
+  for( SectionsTable::const_iterator sectionIterator = sectionsTable.begin(); sectionIterator != sectionsTable.end(); sectionIterator++ )
+    storedSectionsTable[ sectionIterator->first ] = sectionIterator->second;
+  
+  // Written aside and renamed, so that concurrent readers never see a partial file
+  std::string temporaryFilePath = GetTemporaryFilePath( filePath );
+  std::ofstream snapshotFile( temporaryFilePath.c_str(), std::ios::binary );
+  if( not snapshotFile.is_open() ) return false;
+  
+  uint64_t sectionsNumber = storedSectionsTable.size();
+  snapshotFile.write( FILE_SIGNATURE, sizeof(FILE_SIGNATURE) );
+  snapshotFile.write( (const char*) &modelHash, sizeof(modelHash) );
+  snapshotFile.write( (const char*) &sectionsNumber, sizeof(sectionsNumber) );
+  for( SectionsTable::const_iterator sectionIterator = storedSectionsTable.begin(); sectionIterator != storedSectionsTable.end(); sectionIterator++ )
+  {
+    uint64_t valuesNumber = sectionIterator->second.size();
+    snapshotFile.write( sectionIterator->first.c_str(), sectionIterator->first.size() + 1 );
+    snapshotFile.write( (const char*) &valuesNumber, sizeof(valuesNumber) );
+    snapshotFile.write( (const char*) sectionIterator->second.data(), valuesNumber * sizeof(double) );
+  }
+  snapshotFile.close();
+  if( snapshotFile.good() && std::rename( temporaryFilePath.c_str(), filePath.c_str() ) == 0 ) return true;
+  
+  std::remove( temporaryFilePath.c_str() );
+  return false;
+}
+
+std::string ModelSnapshot::GetTemporaryFilePath( const std::string& filePath )
+{
+  std::ostringstream pathStream;
+  pathStream << filePath << "." << getpid() << "-" << std::this_thread::get_id() << ".tmp";
+  return pathStream.str();
+}
+
+// FNV-1a over the whole file contents. Zero for unreadable files
+uint64_t ModelSnapshot::HashFile( const std::string& filePath )
+{
+  std::ifstream hashedFile( filePath.c_str(), std::ios::binary );
+  if( not hashedFile.is_open() ) return 0;
+  
+  uint64_t hash = HASH_OFFSET_BASIS;
+  char buffer[ 65536 ];
+  while( hashedFile.read( buffer, sizeof(buffer) ) || hashedFile.gcount() > 0 )
+  {
+    for( std::streamsize byteIndex = 0; byteIndex < hashedFile.gcount(); byteIndex++ )
+      hash = ( hash ^ (unsigned char) buffer[ byteIndex ] ) * HASH_PRIME;
+  }
+  
+  return hash;
+}
+
+bool ModelSnapshot::LoadSections( SectionsTable& loadedSectionsTable ) const
+{
+  std::ifstream snapshotFile( filePath.c_str(), std::ios::binary );
+  if( not snapshotFile.is_open() ) return false;
+  
+  char signature[ sizeof(FILE_SIGNATURE) ];
+  uint64_t storedHash, sectionsNumber;
+  snapshotFile.read( signature, sizeof(signature) );
+  snapshotFile.read( (char*) &storedHash, sizeof(storedHash) );
+  snapshotFile.read( (char*) &sectionsNumber, sizeof(sectionsNumber) );
+  if( not snapshotFile.good() || std::memcmp( signature, FILE_SIGNATURE, sizeof(FILE_SIGNATURE) ) != 0 ) return false;
+  // Stale snapshot, from a previous version of the model file
+  if( storedHash != modelHash ) return false;
+  
+  SectionsTable fileSectionsTable;
+  for( uint64_t sectionIndex = 0; sectionIndex < sectionsNumber; sectionIndex++ )
+  {
+    std::string sectionName;
+    uint64_t valuesNumber;
+    std::getline( snapshotFile, sectionName, '\0' );
+    snapshotFile.read( (char*) &valuesNumber, sizeof(valuesNumber) );
+    if( not snapshotFile.good() ) return false;
+    std::vector<double>& valuesList = fileSectionsTable[ sectionName ];
+    valuesList.resize( valuesNumber );
+    snapshotFile.read( (char*) valuesList.data(), valuesNumber * sizeof(double) );
+    if( not snapshotFile.good() ) return false;
+  }
+  
+  loadedSectionsTable.swap( fileSectionsTable );
+  
+  return true;
+}
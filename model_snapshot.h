@@ -0,0 +1,41 @@
+#ifndef MODEL_SNAPSHOT_H
+#define MODEL_SNAPSHOT_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdint>
+
+/* Startup data derived from a model file, stored next to it as named sections of values.
+   Sections are discarded as soon as the model file contents (hash) change.
+   Only results of model queries are kept: OpenSim models are still parsed and their systems built on every start */
+class ModelSnapshot
+{
+  public:
+    /* Loads the stored sections, if any, for the given model file */
+    ModelSnapshot( const std::string& );
+    ~ModelSnapshot();
+
+    bool HasSection( const std::string& ) const;
+    /* False if the section is missing or of another size (when a positive one is given) */
+    bool GetSection( const std::string&, std::vector<double>&, size_t = 0 ) const;
+    void SetSection( const std::string&, const std::vector<double>& );
+
+    /* Sections stored meanwhile by other users of the same model are kept, unless replaced by ours */
+    bool Save() const;
+
+    static uint64_t HashFile( const std::string& );
+    /* Path next to the given one, unique for the calling process and thread, to write files aside before renaming them */
+    static std::string GetTemporaryFilePath( const std::string& );
+
+  private:
+    typedef std::map<std::string, std::vector<double>> SectionsTable;
+
+    bool LoadSections( SectionsTable& ) const;
+
+    std::string filePath;
+    uint64_t modelHash;
+    SectionsTable sectionsTable;
+};
+
+#endif // MODEL_SNAPSHOT_H
@@ -0,0 +1,138 @@
+#include "muscle_force_engine.h"
+
+#include <cmath>
+#include <algorithm>
+
+const size_t CURVE_POINTS_NUMBER = 2001;
+const size_t MAX_EQUILIBRIUM_ITERATIONS = 100;
+
+MuscleForceEngine::MuscleForceEngine( OpenSim::Model& model, double tolerance ) : musclesNumber( 0 ), tolerance( tolerance )
+{
+  std::vector<const OpenSim::Function*> activeForceLengthFunctionsList, forceVelocityFunctionsList;
+  std::vector<const OpenSim::Function*> passiveForceLengthFunctionsList, tendonForceLengthFunctionsList;
+  
+  const OpenSim::Set<OpenSim::Muscle>& muscleSet = model.getMuscles();
+  for( int muscleIndex = 0; muscleIndex < muscleSet.getSize(); muscleIndex++ )
+  {
+    const OpenSim::Millard2012EquilibriumMuscle* muscle = dynamic_cast<const OpenSim::Millard2012EquilibriumMuscle*>(&(muscleSet[ muscleIndex ]));
+    if( muscle == NULL )
+    {
+      std::cout << "Muscle " << muscleSet[ muscleIndex ].getName() << " is not a Millard2012EquilibriumMuscle: muscle force engine disabled" << std::endl;
+      return;
+    }
+    pennationSinesList.push_back( std::sin( muscle->get_pennation_angle_at_optimal() ) );
+    maxVelocitiesList.push_back( muscle->get_max_contraction_velocity() );
+    minActivationsList.push_back( muscle->get_minimum_activation() );
+    fiberDampingsList.push_back( muscle->get_fiber_damping() );
+    rigidTendonsList.push_back( muscle->get_ignore_tendon_compliance() );
+    activeForceLengthFunctionsList.push_back( &(muscle->getActiveForceLengthCurve()) );
+    forceVelocityFunctionsList.push_back( &(muscle->getForceVelocityCurve()) );
+    passiveForceLengthFunctionsList.push_back( &(muscle->getFiberForceLengthCurve()) );
+    tendonForceLengthFunctionsList.push_back( &(muscle->getTendonForceLengthCurve()) );
+  }
+  
+  // Normalized domains cover the curves nonlinear regions, as they are linearly extended outside
+  BuildCurve( activeForceLengthCurve, 0.0, 2.0, activeForceLengthFunctionsList );
+  BuildCurve( forceVelocityCurve, -1.0, 1.0, forceVelocityFunctionsList );
+  BuildCurve( passiveForceLengthCurve, 0.5, 2.0, passiveForceLengthFunctionsList );
+  BuildCurve( tendonForceLengthCurve, 0.95, 1.15, tendonForceLengthFunctionsList );
+  
+  musclesNumber = muscleSet.getSize();
+}
+
+MuscleForceEngine::~MuscleForceEngine() { }
+
+bool MuscleForceEngine::IsValid() const { return ( musclesNumber > 0 ); }
+
+void MuscleForceEngine::BuildCurve( CurveTable& curve, double minValue, double maxValue, const std::vector<const OpenSim::Function*>& functionsList )
+{
+  curve.minValue = minValue;
+  curve.pointsNumber = CURVE_POINTS_NUMBER;
+  curve.step = ( maxValue - minValue ) / ( curve.pointsNumber - 1 );
+  curve.valuesList.resize( functionsList.size() * curve.pointsNumber );
+  SimTK::Vector argumentsList( 1 );
+  for( size_t muscleIndex = 0; muscleIndex < functionsList.size(); muscleIndex++ )
+  {
+    for( size_t pointIndex = 0; pointIndex < curve.pointsNumber; pointIndex++ )
+    {
+      argumentsList[ 0 ] = minValue + pointIndex * curve.step;
+      curve.valuesList[ muscleIndex * curve.pointsNumber + pointIndex ] = functionsList[ muscleIndex ]->calcValue( argumentsList );
+    }
+  }
+}
+
+double MuscleForceEngine::InterpolateCurve( const CurveTable& curve, size_t muscleIndex, double value ) const
+{
+  double segmentPosition = ( value - curve.minValue ) / curve.step;
+  double pointPosition = std::min( std::max( std::floor( segmentPosition ), 0.0 ), (double) curve.pointsNumber - 2 );
+  size_t pointIndex = (size_t) pointPosition;
+  const double* valuesList = curve.valuesList.data() + muscleIndex * curve.pointsNumber + pointIndex;
+  return valuesList[ 0 ] + ( segmentPosition - pointPosition ) * ( valuesList[ 1 ] - valuesList[ 0 ] );
+}
+
+void MuscleForceEngine::CalculateFiberForces( const double* propertiesList, size_t propertiesStride, const double* activationsList, 
+                                              const double* lengthsList, const double* velocitiesList, double* forcesList ) const
+{
+  for( size_t muscleIndex = 0; muscleIndex < musclesNumber; muscleIndex++ )
+  {
+    const double* muscleProperties = propertiesList + muscleIndex * propertiesStride;
+    double maxForce = muscleProperties[ 0 ], optimalFiberLength = muscleProperties[ 1 ], tendonSlackLength = muscleProperties[ 2 ];
+    double activation = std::min( std::max( activationsList[ muscleIndex ], minActivationsList[ muscleIndex ] ), 1.0 );
+    double fiberHeight = optimalFiberLength * pennationSinesList[ muscleIndex ];
+    double maxFiberVelocity = optimalFiberLength * maxVelocitiesList[ muscleIndex ];
+    double muscleLength = lengthsList[ muscleIndex ];
+    
+    // Normalized fiber force, and the fiber/tendon force residual, for a given fiber length projected along the tendon.
+    // Fiber velocity is approximated by the muscle-tendon one, as for a rigid tendon
+    double fiberLength, normalizedVelocity, fiberForce;
+    auto CalculateResidual = [ & ]( double projectedLength )
+    {
+      fiberLength = std::sqrt( projectedLength * projectedLength + fiberHeight * fiberHeight );
+      double pennationCosine = projectedLength / fiberLength;
+      normalizedVelocity = velocitiesList[ muscleIndex ] * pennationCosine / maxFiberVelocity;
+      double normalizedLength = fiberLength / optimalFiberLength;
+      fiberForce = activation * InterpolateCurve( activeForceLengthCurve, muscleIndex, normalizedLength ) * InterpolateCurve( forceVelocityCurve, muscleIndex, normalizedVelocity )
+                   + InterpolateCurve( passiveForceLengthCurve, muscleIndex, normalizedLength ) + fiberDampingsList[ muscleIndex ] * normalizedVelocity;
+      if( rigidTendonsList[ muscleIndex ] ) return 0.0;
+      return fiberForce * pennationCosine - InterpolateCurve( tendonForceLengthCurve, muscleIndex, ( muscleLength - projectedLength ) / tendonSlackLength );
+    };
+    
+    double minProjectedLength = 0.01 * optimalFiberLength;
+    double maxProjectedLength = std::max( muscleLength - 0.95 * tendonSlackLength, 2.0 * minProjectedLength );
+    if( rigidTendonsList[ muscleIndex ] ) 
+      CalculateResidual( std::max( muscleLength - tendonSlackLength, minProjectedLength ) );
+    else
+    {
+      // Residual grows with fiber length: bracket the root and refine it with Illinois false position
+      double lowerLength = minProjectedLength, lowerResidual = CalculateResidual( lowerLength );
+      double upperLength = maxProjectedLength, upperResidual = CalculateResidual( upperLength );
+      if( lowerResidual >= 0.0 ) CalculateResidual( lowerLength );
+      else if( upperResidual > 0.0 )
+      {
+        int retainedSide = 0;
+        for( size_t iteration = 0; iteration < MAX_EQUILIBRIUM_ITERATIONS; iteration++ )
+        {
+          double projectedLength = ( lowerLength * upperResidual - upperLength * lowerResidual ) / ( upperResidual - lowerResidual );
+          double residual = CalculateResidual( projectedLength );
+          if( std::abs( residual ) < tolerance || upperLength - lowerLength < tolerance * optimalFiberLength ) break;
+          if( residual < 0.0 )
+          {
+            lowerLength = projectedLength;
+            lowerResidual = residual;
+            if( retainedSide == -1 ) upperResidual /= 2.0;
+            retainedSide = -1;
+          }
+          else
+          {
+            upperLength = projectedLength;
+            upperResidual = residual;
+            if( retainedSide == 1 ) lowerResidual /= 2.0;
+            retainedSide = 1;
+          }
+        }
+      }
+    }
+    
+    forcesList[ muscleIndex ] = maxForce * fiberForce;
+  }
+}
@@ -0,0 +1,43 @@
+#ifndef MUSCLE_FORCE_ENGINE_H
+#define MUSCLE_FORCE_ENGINE_H
+
+#include <OpenSim/OpenSim.h>
+
+#include <vector>
+
+/* Standalone Hill-type evaluation of Millard2012EquilibriumMuscle fiber forces, with tabulated characteristic curves
+   and fiber/tendon equilibrium solved without touching the model state */
+class MuscleForceEngine
+{
+  public:
+    /* Constructor class. Tolerance is the equilibrium force residual, normalized by max isometric force */
+    MuscleForceEngine( OpenSim::Model&, double tolerance = 1.0e-8 );
+    ~MuscleForceEngine();
+
+    bool IsValid() const;
+
+    /* Active plus passive fiber forces of all muscles. Properties are max isometric force, optimal fiber length and
+       tendon slack length, in that order, for each muscle every stride values. Nothing is allocated */
+    void CalculateFiberForces( const double* propertiesList, size_t propertiesStride, const double* activationsList, 
+                               const double* lengthsList, const double* velocitiesList, double* forcesList ) const;
+
+  private:
+    /* Curve values over uniform samples, one row per muscle, linearly interpolated and extrapolated */
+    struct CurveTable
+    {
+      double minValue, step;
+      size_t pointsNumber;
+      std::vector<double> valuesList;
+    };
+    
+    void BuildCurve( CurveTable&, double, double, const std::vector<const OpenSim::Function*>& );
+    double InterpolateCurve( const CurveTable&, size_t, double ) const;
+
+    size_t musclesNumber;
+    double tolerance;
+    std::vector<double> pennationSinesList, maxVelocitiesList, minActivationsList, fiberDampingsList;
+    std::vector<bool> rigidTendonsList;
+    CurveTable activeForceLengthCurve, forceVelocityCurve, passiveForceLengthCurve, tendonForceLengthCurve;
+};
+
+#endif // MUSCLE_FORCE_ENGINE_H
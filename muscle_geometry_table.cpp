@@ -0,0 +1,192 @@
+#include "muscle_geometry_table.h"
+
+#include <fstream>
+#include <iostream>
+#include <cstring>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+const char FILE_SIGNATURE[ 8 ] = { 'N', 'M', 'S', 'G', 'E', 'O', 'M', '3' };
+
+MuscleGeometryTable::MuscleGeometryTable() : musclesNumber( 0 ), coordinatesNumber( 0 ), pointsNumber( 0 ) { }
+
+MuscleGeometryTable::~MuscleGeometryTable() { }
+
+bool MuscleGeometryTable::IsValid() const { return ( pointsNumber >= 2 ); }
+
+void MuscleGeometryTable::Build( OpenSim::Model& model, SimTK::State& state, const std::vector<OpenSim::Coordinate*>& coordinatesList, const size_t samplePointsNumber )
+{
+  const OpenSim::Set<OpenSim::Muscle>& muscleSet = model.getMuscles();
+  musclesNumber = muscleSet.getSize();
+  coordinatesNumber = coordinatesList.size();
+  pointsNumber = std::max( samplePointsNumber, (size_t) 2 );
+  
+  muscleNamesList.clear();
+  for( size_t muscleIndex = 0; muscleIndex < musclesNumber; muscleIndex++ )
+    muscleNamesList.push_back( muscleSet[ muscleIndex ].getName() );
+  coordinateNamesList.clear();
+  positionMinList.resize( coordinatesNumber );
+  positionStepList.resize( coordinatesNumber );
+  for( size_t coordinateIndex = 0; coordinateIndex < coordinatesNumber; coordinateIndex++ )
+  {
+    coordinateNamesList.push_back( coordinatesList[ coordinateIndex ]->getName() );
+    positionMinList[ coordinateIndex ] = coordinatesList[ coordinateIndex ]->getRangeMin();
+    positionStepList[ coordinateIndex ] = ( coordinatesList[ coordinateIndex ]->getRangeMax() - positionMinList[ coordinateIndex ] ) / ( pointsNumber - 1 );
+  }
+  
+  valuesTable.assign( musclesNumber * coordinatesNumber * GEOMETRY_CURVES_NUMBER * pointsNumber, 0.0 );
+  curvaturesTable.assign( valuesTable.size(), 0.0 );
+  referenceLengthsList.resize( musclesNumber );
+  for( size_t jointIndex = 0; jointIndex < coordinatesNumber; jointIndex++ )
+    coordinatesList[ jointIndex ]->setValue( state, coordinatesList[ jointIndex ]->getDefaultValue(), false );
+  model.realizePosition( state );
+  for( size_t muscleIndex = 0; muscleIndex < musclesNumber; muscleIndex++ )
+    referenceLengthsList[ muscleIndex ] = muscleSet[ muscleIndex ].getLength( state );
+  // Sweep each coordinate over its range, with the others at their default values
+  for( size_t coordinateIndex = 0; coordinateIndex < coordinatesNumber; coordinateIndex++ )
+  {
+    for( size_t jointIndex = 0; jointIndex < coordinatesNumber; jointIndex++ )
+      coordinatesList[ jointIndex ]->setValue( state, coordinatesList[ jointIndex ]->getDefaultValue(), false );
+    for( size_t pointIndex = 0; pointIndex < pointsNumber; pointIndex++ )
+    {
+      double position = positionMinList[ coordinateIndex ] + pointIndex * positionStepList[ coordinateIndex ];
+      coordinatesList[ coordinateIndex ]->setValue( state, position, false );
+      model.realizePosition( state );
+      for( size_t muscleIndex = 0; muscleIndex < musclesNumber; muscleIndex++ )
+      {
+        const OpenSim::Muscle& muscle = muscleSet[ muscleIndex ];
+        valuesTable[ GetCurveOffset( muscleIndex, coordinateIndex, GEOMETRY_MOMENT_ARM ) + pointIndex ] = muscle.computeMomentArm( state, *(coordinatesList[ coordinateIndex ]) );
+        valuesTable[ GetCurveOffset( muscleIndex, coordinateIndex, GEOMETRY_LENGTH_OFFSET ) + pointIndex ] = muscle.getLength( state ) - referenceLengthsList[ muscleIndex ];
+      }
+    }
+    for( size_t muscleIndex = 0; muscleIndex < musclesNumber; muscleIndex++ )
+    {
+      for( size_t curveType = 0; curveType < GEOMETRY_CURVES_NUMBER; curveType++ )
+        CalculateCurvatures( GetCurveOffset( muscleIndex, coordinateIndex, curveType ), coordinateIndex );
+    }
+  }
+}
+
+// Natural cubic spline second derivatives over uniform steps (tridiagonal system solved with Thomas algorithm)
+void MuscleGeometryTable::CalculateCurvatures( size_t curveOffset, size_t coordinateIndex )
+{
+  const double* valuesList = valuesTable.data() + curveOffset;
+  double* curvaturesList = curvaturesTable.data() + curveOffset;
+  double stepSquared = positionStepList[ coordinateIndex ] * positionStepList[ coordinateIndex ];
+  
+  std::vector<double> diagonalsList( pointsNumber, 4.0 );
+  curvaturesList[ 0 ] = curvaturesList[ pointsNumber - 1 ] = 0.0;
+  for( size_t pointIndex = 1; pointIndex < pointsNumber - 1; pointIndex++ )
+    curvaturesList[ pointIndex ] = 6.0 * ( valuesList[ pointIndex + 1 ] - 2.0 * valuesList[ pointIndex ] + valuesList[ pointIndex - 1 ] ) / stepSquared;
+  for( size_t pointIndex = 2; pointIndex < pointsNumber - 1; pointIndex++ )
+  {
+    double factor = 1.0 / diagonalsList[ pointIndex - 1 ];
+    diagonalsList[ pointIndex ] -= factor;
+    curvaturesList[ pointIndex ] -= factor * curvaturesList[ pointIndex - 1 ];
+  }
+  for( size_t pointIndex = pointsNumber - 2; pointIndex >= 1; pointIndex-- )
+    curvaturesList[ pointIndex ] = ( curvaturesList[ pointIndex ] - curvaturesList[ pointIndex + 1 ] ) / diagonalsList[ pointIndex ];
+}
+
+// Compare interpolated moment arms against exact values at segment midpoints, where spline error is largest
+double MuscleGeometryTable::CalculateMaxError( OpenSim::Model& model, SimTK::State& state, const std::vector<OpenSim::Coordinate*>& coordinatesList ) const
+{
+  const OpenSim::Set<OpenSim::Muscle>& muscleSet = model.getMuscles();
+  double maxError = 0.0;
+  for( size_t coordinateIndex = 0; coordinateIndex < coordinatesNumber; coordinateIndex++ )
+  {
+    for( size_t jointIndex = 0; jointIndex < coordinatesNumber; jointIndex++ )
+      coordinatesList[ jointIndex ]->setValue( state, coordinatesList[ jointIndex ]->getDefaultValue(), false );
+    for( size_t pointIndex = 0; pointIndex < pointsNumber - 1; pointIndex++ )
+    {
+      double position = positionMinList[ coordinateIndex ] + ( pointIndex + 0.5 ) * positionStepList[ coordinateIndex ];
+      coordinatesList[ coordinateIndex ]->setValue( state, position, false );
+      model.realizePosition( state );
+      for( size_t muscleIndex = 0; muscleIndex < musclesNumber; muscleIndex++ )
+      {
+        double exactValue = muscleSet[ muscleIndex ].computeMomentArm( state, *(coordinatesList[ coordinateIndex ]) );
+        maxError = std::max( maxError, std::abs( GetMomentArm( muscleIndex, coordinateIndex, position ) - exactValue ) );
+      }
+    }
+  }
+  
+  return maxError;
+}
+
+bool MuscleGeometryTable::Save( const std::string& filePath, uint64_t modelHash ) const
+{
+  std::ofstream tableFile( filePath.c_str(), std::ios::binary );
+  if( not tableFile.is_open() ) return false;
+  
+  uint32_t sizesList[ 3 ] = { (uint32_t) musclesNumber, (uint32_t) coordinatesNumber, (uint32_t) pointsNumber };
+  tableFile.write( FILE_SIGNATURE, sizeof(FILE_SIGNATURE) );
+  tableFile.write( (const char*) &modelHash, sizeof(modelHash) );
+  tableFile.write( (const char*) sizesList, sizeof(sizesList) );
+  std::vector<std::string> namesList( muscleNamesList );
+  namesList.insert( namesList.end(), coordinateNamesList.begin(), coordinateNamesList.end() );
+  for( size_t nameIndex = 0; nameIndex < namesList.size(); nameIndex++ )
+    tableFile.write( namesList[ nameIndex ].c_str(), namesList[ nameIndex ].size() + 1 );
+  tableFile.write( (const char*) positionMinList.data(), coordinatesNumber * sizeof(double) );
+  tableFile.write( (const char*) positionStepList.data(), coordinatesNumber * sizeof(double) );
+  tableFile.write( (const char*) referenceLengthsList.data(), musclesNumber * sizeof(double) );
+  tableFile.write( (const char*) valuesTable.data(), valuesTable.size() * sizeof(double) );
+  tableFile.write( (const char*) curvaturesTable.data(), curvaturesTable.size() * sizeof(double) );
+  
+  return tableFile.good();
+}
+
+bool MuscleGeometryTable::Load( const std::string& filePath, uint64_t modelHash, OpenSim::Model& model, const std::vector<OpenSim::Coordinate*>& coordinatesList )
+{
+  std::ifstream tableFile( filePath.c_str(), std::ios::binary );
+  if( not tableFile.is_open() ) return false;
+  
+  char signature[ sizeof(FILE_SIGNATURE) ];
+  uint64_t storedHash;
+  uint32_t sizesList[ 3 ];
+  tableFile.read( signature, sizeof(signature) );
+  tableFile.read( (char*) &storedHash, sizeof(storedHash) );
+  tableFile.read( (char*) sizesList, sizeof(sizesList) );
+  if( not tableFile.good() || std::memcmp( signature, FILE_SIGNATURE, sizeof(FILE_SIGNATURE) ) != 0 ) return false;
+  // Path geometry edited in the model file, which names and ranges would not reveal
+  if( storedHash != modelHash ) return false;
+  // Reject tables built for other muscles or joints
+  const OpenSim::Set<OpenSim::Muscle>& muscleSet = model.getMuscles();
+  if( sizesList[ 0 ] != (uint32_t) muscleSet.getSize() || sizesList[ 1 ] != coordinatesList.size() || sizesList[ 2 ] < 2 ) return false;
+  std::vector<std::string> namesList;
+  for( int muscleIndex = 0; muscleIndex < muscleSet.getSize(); muscleIndex++ )
+    namesList.push_back( muscleSet[ muscleIndex ].getName() );
+  for( size_t coordinateIndex = 0; coordinateIndex < coordinatesList.size(); coordinateIndex++ )
+    namesList.push_back( coordinatesList[ coordinateIndex ]->getName() );
+  for( size_t nameIndex = 0; nameIndex < namesList.size(); nameIndex++ )
+  {
+    std::string storedName;
+    std::getline( tableFile, storedName, '\0' );
+    if( storedName != namesList[ nameIndex ] ) return false;
+  }
+  
+  pointsNumber = 0;
+  musclesNumber = sizesList[ 0 ];
+  coordinatesNumber = sizesList[ 1 ];
+  muscleNamesList.assign( namesList.begin(), namesList.begin() + musclesNumber );
+  coordinateNamesList.assign( namesList.begin() + musclesNumber, namesList.end() );
+  positionMinList.resize( coordinatesNumber );
+  positionStepList.resize( coordinatesNumber );
+  referenceLengthsList.resize( musclesNumber );
+  valuesTable.resize( musclesNumber * coordinatesNumber * GEOMETRY_CURVES_NUMBER * sizesList[ 2 ] );
+  curvaturesTable.resize( valuesTable.size() );
+  tableFile.read( (char*) positionMinList.data(), coordinatesNumber * sizeof(double) );
+  tableFile.read( (char*) positionStepList.data(), coordinatesNumber * sizeof(double) );
+  // Coordinate ranges changed in the model file
+  for( size_t coordinateIndex = 0; coordinateIndex < coordinatesNumber; coordinateIndex++ )
+  {
+    double positionStep = ( coordinatesList[ coordinateIndex ]->getRangeMax() - coordinatesList[ coordinateIndex ]->getRangeMin() ) / ( sizesList[ 2 ] - 1 );
+    if( positionMinList[ coordinateIndex ] != coordinatesList[ coordinateIndex ]->getRangeMin() || positionStepList[ coordinateIndex ] != positionStep ) return false;
+  }
+  tableFile.read( (char*) referenceLengthsList.data(), musclesNumber * sizeof(double) );
+  tableFile.read( (char*) valuesTable.data(), valuesTable.size() * sizeof(double) );
+  tableFile.read( (char*) curvaturesTable.data(), curvaturesTable.size() * sizeof(double) );
+  pointsNumber = tableFile.good() ? sizesList[ 2 ] : 0;
+  
+  return IsValid();
+}
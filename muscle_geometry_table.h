@@ -0,0 +1,72 @@
+#ifndef MUSCLE_GEOMETRY_TABLE_H
+#define MUSCLE_GEOMETRY_TABLE_H
+
+#include <OpenSim/OpenSim.h>
+
+#include <vector>
+#include <string>
+#include <cstdint>
+
+/* Muscle moment arms and muscle-tendon lengths sampled over each joint coordinate range and interpolated with natural cubic splines.
+   Each muscle/coordinate curve is taken with the other coordinates at their default values, so lengths are added up as offsets */
+class MuscleGeometryTable
+{
+  public:
+    MuscleGeometryTable();
+    ~MuscleGeometryTable();
+
+    void Build( OpenSim::Model&, SimTK::State&, const std::vector<OpenSim::Coordinate*>&, const size_t );
+    double CalculateMaxError( OpenSim::Model&, SimTK::State&, const std::vector<OpenSim::Coordinate*>& ) const;
+
+    /* Tables are stored with the hash of the model file they were built from, and only loaded for the same one */
+    bool Load( const std::string&, uint64_t, OpenSim::Model&, const std::vector<OpenSim::Coordinate*>& );
+    bool Save( const std::string&, uint64_t ) const;
+
+    bool IsValid() const;
+
+    inline double GetMomentArm( size_t muscleIndex, size_t coordinateIndex, double position ) const
+    {
+      return Interpolate( GetCurveOffset( muscleIndex, coordinateIndex, GEOMETRY_MOMENT_ARM ), coordinateIndex, position );
+    }
+    
+    /* Muscle-tendon length with all coordinates at their default values */
+    inline double GetReferenceLength( size_t muscleIndex ) const { return referenceLengthsList[ muscleIndex ]; }
+    
+    /* Muscle-tendon length change from the reference one when moving a single coordinate */
+    inline double GetLengthOffset( size_t muscleIndex, size_t coordinateIndex, double position ) const
+    {
+      return Interpolate( GetCurveOffset( muscleIndex, coordinateIndex, GEOMETRY_LENGTH_OFFSET ), coordinateIndex, position );
+    }
+
+  private:
+    enum { GEOMETRY_MOMENT_ARM, GEOMETRY_LENGTH_OFFSET, GEOMETRY_CURVES_NUMBER };
+    
+    inline size_t GetCurveOffset( size_t muscleIndex, size_t coordinateIndex, size_t curveType ) const
+    {
+      return ( ( muscleIndex * coordinatesNumber + coordinateIndex ) * GEOMETRY_CURVES_NUMBER + curveType ) * pointsNumber;
+    }
+    
+    inline double Interpolate( size_t curveOffset, size_t coordinateIndex, double position ) const
+    {
+      double segmentPosition = ( position - positionMinList[ coordinateIndex ] ) / positionStepList[ coordinateIndex ];
+      if( segmentPosition < 0.0 ) segmentPosition = 0.0;
+      else if( segmentPosition > pointsNumber - 1 ) segmentPosition = pointsNumber - 1;
+      size_t pointIndex = (size_t) segmentPosition;
+      if( pointIndex > pointsNumber - 2 ) pointIndex = pointsNumber - 2;
+      double b = segmentPosition - pointIndex, a = 1.0 - b;
+      const double* valuesList = valuesTable.data() + curveOffset + pointIndex;
+      const double* curvaturesList = curvaturesTable.data() + curveOffset + pointIndex;
+      double stepSquared = positionStepList[ coordinateIndex ] * positionStepList[ coordinateIndex ];
+      return a * valuesList[ 0 ] + b * valuesList[ 1 ] + ( ( a * a * a - a ) * curvaturesList[ 0 ] + ( b * b * b - b ) * curvaturesList[ 1 ] ) * stepSquared / 6.0;
+    }
+
+    void CalculateCurvatures( size_t, size_t );
+
+    size_t musclesNumber, coordinatesNumber, pointsNumber;
+    std::vector<std::string> muscleNamesList, coordinateNamesList;
+    std::vector<double> positionMinList, positionStepList;
+    std::vector<double> referenceLengthsList;
+    std::vector<double> valuesTable, curvaturesTable;
+};
+
+#endif // MUSCLE_GEOMETRY_TABLE_H
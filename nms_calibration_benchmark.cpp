@@ -0,0 +1,153 @@
+#include <OpenSim/OpenSim.h>
+
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include <vector>
+
+#include "nms_processor-osim.h"
+#include "batch_kernels.h"
+
+double GetElapsedSeconds( std::chrono::steady_clock::time_point initialTime )
+{
+  return std::chrono::duration_cast<std::chrono::duration<double>>( std::chrono::steady_clock::now() - initialTime ).count();
+}
+
+// Forward differences over serial objective calls, as done by SimTK::Optimizer numerical gradient
+void CalculateNumericalGradient( NMSProcessor& nmsProcessor, const SimTK::Vector& parametersList, SimTK::Vector& gradientsList )
+{
+  SimTK::Real referenceError, perturbedError;
+  nmsProcessor.objectiveFunc( parametersList, true, referenceError );
+  SimTK::Vector perturbedParametersList = parametersList;
+  for( int parameterIndex = 0; parameterIndex < parametersList.size(); parameterIndex++ )
+  {
+    double step = std::sqrt( SimTK::Eps ) * std::max( std::abs( parametersList[ parameterIndex ] ), 1.0 );
+    perturbedParametersList[ parameterIndex ] = parametersList[ parameterIndex ] + step;
+    nmsProcessor.objectiveFunc( perturbedParametersList, true, perturbedError );
+    gradientsList[ parameterIndex ] = ( perturbedError - referenceError ) / step;
+    perturbedParametersList[ parameterIndex ] = parametersList[ parameterIndex ];
+  }
+}
+
+int main( int argc, char* argv[] )
+{
+  if( argc < 2 )
+  {
+    std::cout << "usage: " << argv[ 0 ] << " <model.osim> [samples number] [gradients number]" << std::endl;
+    exit( -1 );
+  }
+  size_t samplesNumber = ( argc > 2 ) ? (size_t) atoi( argv[ 2 ] ) : 1000;
+  size_t gradientsNumber = ( argc > 3 ) ? (size_t) atoi( argv[ 3 ] ) : 5;
+  
+  try
+  {
+    OpenSim::Model osimModel( argv[ 1 ] );
+    osimModel.setUseVisualizer( false );
+    osimModel.initSystem();
+    
+    ActuatorsList actuatorsList;
+    const OpenSim::Set<OpenSim::Muscle>& muscleSet = osimModel.getMuscles();
+    const OpenSim::Set<OpenSim::Actuator>& actuatorSet = osimModel.getActuators();
+    for( int actuatorIndex = 0; actuatorIndex < actuatorSet.getSize(); actuatorIndex++ )
+    {
+      if( muscleSet.contains( actuatorSet[ actuatorIndex ].getName() ) ) continue;
+      OpenSim::CoordinateActuator* actuator = dynamic_cast<OpenSim::CoordinateActuator*>(&(actuatorSet[ actuatorIndex ]));
+      if( actuator != NULL ) actuatorsList.push_back( actuator );
+    }
+    std::cout << "Muscles number: " << muscleSet.getSize() << ", actuators number: " << actuatorsList.size() << std::endl;
+    
+    NMSProcessor nmsProcessor( osimModel, actuatorsList, samplesNumber );
+    SimTK::Vector initialParametersList = nmsProcessor.GetInitialParameters();
+    nmsProcessor.SetParameters( initialParametersList );
+    nmsProcessor.SetMomentArmTable( false );
+    nmsProcessor.SetMuscleForceEngine( false );
+    
+    // Synthetic samples generated by the model itself, with random joint positions and EMG
+    SimTK::Random::Uniform random( 0.0, 1.0 );
+    SimTK::Vector dynInputs( NMS_INPUT_VARS_NUMBER * actuatorsList.size(), 0.0 );
+    SimTK::Vector emgInputs( muscleSet.getSize(), 0.0 );
+    for( size_t sampleIndex = 0; sampleIndex < samplesNumber; sampleIndex++ )
+    {
+      for( size_t jointIndex = 0; jointIndex < actuatorsList.size(); jointIndex++ )
+      {
+        const OpenSim::Coordinate* jointCoordinate = actuatorsList[ jointIndex ]->getCoordinate();
+        double positionRange = jointCoordinate->getRangeMax() - jointCoordinate->getRangeMin();
+        dynInputs[ jointIndex * NMS_INPUT_VARS_NUMBER + NMS_POSITION ] = jointCoordinate->getRangeMin() + random.getValue() * positionRange;
+      }
+      for( int muscleIndex = 0; muscleIndex < emgInputs.size(); muscleIndex++ )
+        emgInputs[ muscleIndex ] = random.getValue();
+      SimTK::Vector outputs = nmsProcessor.CalculateOutputs( dynInputs, emgInputs );
+      nmsProcessor.StoreSamples( dynInputs, emgInputs, outputs );
+    }
+    
+    // Start away from the generating parameters, so that gradients are not trivially null
+    SimTK::Vector parametersList = 0.8 * initialParametersList;
+    SimTK::Vector gradientsList( parametersList.size() );
+    
+    std::chrono::steady_clock::time_point initialTime = std::chrono::steady_clock::now();
+    nmsProcessor.SetKinematicsReuse( false );
+    for( size_t gradientIndex = 0; gradientIndex < gradientsNumber; gradientIndex++ )
+      CalculateNumericalGradient( nmsProcessor, parametersList, gradientsList );
+    double numericalRate = gradientsNumber / GetElapsedSeconds( initialTime );
+    
+    initialTime = std::chrono::steady_clock::now();
+    for( size_t gradientIndex = 0; gradientIndex < gradientsNumber; gradientIndex++ )
+      nmsProcessor.gradientFunc( parametersList, true, gradientsList );
+    double parallelRate = gradientsNumber / GetElapsedSeconds( initialTime );
+    
+    nmsProcessor.SetKinematicsReuse( true );
+    initialTime = std::chrono::steady_clock::now();
+    for( size_t gradientIndex = 0; gradientIndex < gradientsNumber; gradientIndex++ )
+      nmsProcessor.gradientFunc( parametersList, true, gradientsList );
+    double reuseRate = gradientsNumber / GetElapsedSeconds( initialTime );
+    
+    nmsProcessor.SetKinematicsReuse( false );
+    nmsProcessor.SetMomentArmTable( true );
+    initialTime = std::chrono::steady_clock::now();
+    for( size_t gradientIndex = 0; gradientIndex < gradientsNumber; gradientIndex++ )
+      nmsProcessor.gradientFunc( parametersList, true, gradientsList );
+    double tableRate = gradientsNumber / GetElapsedSeconds( initialTime );
+    
+    nmsProcessor.SetMuscleForceEngine( true );
+    initialTime = std::chrono::steady_clock::now();
+    for( size_t gradientIndex = 0; gradientIndex < gradientsNumber; gradientIndex++ )
+      nmsProcessor.gradientFunc( parametersList, true, gradientsList );
+    double engineRate = gradientsNumber / GetElapsedSeconds( initialTime );
+    
+    // Vector kernels against their scalar references, over random rows and the default activation factor
+    const double activationFactor = -2.0;
+    std::vector<double> emgTable( samplesNumber ), batchTable( samplesNumber ), scalarTable( samplesNumber );
+    for( size_t sampleIndex = 0; sampleIndex < samplesNumber; sampleIndex++ )
+      emgTable[ sampleIndex ] = random.getValue();
+    CalculateActivationsBatch( emgTable.data(), activationFactor, samplesNumber, batchTable.data() );
+    CalculateActivationsScalar( emgTable.data(), activationFactor, samplesNumber, scalarTable.data() );
+    double maxKernelDeviation = 0.0;
+    for( size_t sampleIndex = 0; sampleIndex < samplesNumber; sampleIndex++ )
+      maxKernelDeviation = std::max( maxKernelDeviation, std::abs( batchTable[ sampleIndex ] - scalarTable[ sampleIndex ] ) );
+    
+    // Each L-BFGS-B iteration takes about one gradient evaluation
+    std::cout << "samples: " << samplesNumber << ", parameters: " << parametersList.size() << std::endl;
+    std::cout << "serial numerical gradient: " << numericalRate << " iterations/s" << std::endl;
+    std::cout << "parallel gradient: " << parallelRate << " iterations/s (x" << parallelRate / numericalRate << ")" << std::endl;
+    std::cout << "parallel gradient with kinematics reuse: " << reuseRate << " iterations/s (x" << reuseRate / numericalRate << ")" << std::endl;
+    std::cout << "parallel gradient with moment arm table: " << tableRate << " iterations/s (x" << tableRate / numericalRate << ")";
+    std::cout << ", max moment arm error: " << nmsProcessor.GetMomentArmTableError() << std::endl;
+    std::cout << "parallel gradient with muscle force engine: " << engineRate << " iterations/s (x" << engineRate / numericalRate << ")";
+    std::cout << ", max relative force error: " << nmsProcessor.GetMuscleForceEngineError() << std::endl;
+    std::cout << "batch activation kernel max deviation from scalar: " << maxKernelDeviation << std::endl;
+  }
+  catch( OpenSim::Exception ex )
+  {
+    std::cout << ex.getMessage() << std::endl;
+    exit( -1 );
+  }
+  catch( std::exception ex )
+  {
+    std::cout << ex.what() << std::endl;
+    exit( -1 );
+  }
+  
+  exit( 0 );
+}
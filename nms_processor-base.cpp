@@ -1,28 +1,256 @@
 #include "nms_processor-base.h"
 
-NMSProcessorBase::NMSProcessorBase( const size_t parametersNumber, const size_t samplesNumber ) 
-  : OptimizerSystem( parametersNumber ), MAX_SAMPLES_COUNT( samplesNumber ) { std::cout << "Parameters number: " << parametersNumber << std::endl; }
+#include "model_snapshot.h"
+
+#include <cmath>
+#include <algorithm>
+#include <fstream>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+
+#ifndef _WIN32
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+#endif
+
+const double GRADIENT_RELATIVE_STEP = 1.0e-5;
+#ifdef EVALUATION_WORKERS_PER_INSTANCE
+const size_t EVALUATION_WORKERS_NUMBER = EVALUATION_WORKERS_PER_INSTANCE; // Zero for one per hardware thread
+#else
+const size_t EVALUATION_WORKERS_NUMBER = 0;
+#endif
+
+const char CALIBRATION_FILE_SIGNATURE[ 8 ] = { 'N', 'M', 'S', 'C', 'A', 'L', 'I', 'B' };
+const uint32_t CALIBRATION_FILE_VERSION = 2;
+// Version and model file hash, then parameters, inputs, outputs and stored data numbers
+enum { CALIBRATION_VERSION, CALIBRATION_MODEL_HASH, CALIBRATION_PARAMETERS_NUMBER, CALIBRATION_INPUTS_NUMBER, CALIBRATION_OUTPUTS_NUMBER, CALIBRATION_DATA_SIZE, CALIBRATION_SIZES_NUMBER };
+
+/* Read only view over a whole file, memory mapped where supported */
+class MappedFile
+{
+  public:
+    MappedFile( const std::string& filePath ) : dataList( NULL ), dataSize( 0 )
+    {
+#ifdef _WIN32
+      std::ifstream dataFile( filePath.c_str(), std::ios::binary | std::ios::ate );
+      if( not dataFile.is_open() ) return;
+      bufferList.resize( (size_t) dataFile.tellg() );
+      dataFile.seekg( 0 );
+      if( dataFile.read( bufferList.data(), bufferList.size() ) ) { dataList = bufferList.data(); dataSize = bufferList.size(); }
+#else
+      int fileDescriptor = open( filePath.c_str(), O_RDONLY );
+      if( fileDescriptor < 0 ) return;
+      struct stat fileStatus;
+      if( fstat( fileDescriptor, &fileStatus ) == 0 && fileStatus.st_size > 0 )
+      {
+        void* mappedData = mmap( NULL, (size_t) fileStatus.st_size, PROT_READ, MAP_PRIVATE, fileDescriptor, 0 );
+        if( mappedData != MAP_FAILED ) { dataList = (const char*) mappedData; dataSize = (size_t) fileStatus.st_size; }
+      }
+      close( fileDescriptor );
+#endif
+    }
+    ~MappedFile()
+    {
+#ifndef _WIN32
+      if( dataList != NULL ) munmap( (void*) dataList, dataSize );
+#endif
+    }
+    
+    const char* dataList;
+    size_t dataSize;
+    
+  private:
+#ifdef _WIN32
+    std::vector<char> bufferList;
+#endif
+};
+
+std::mutex NMSProcessorBase::modelLoadingMutex;
+
+NMSProcessorBase::NMSProcessorBase( const size_t parametersNumber, const size_t samplesNumber, const size_t inputsNumber, const size_t outputsNumber ) 
+  : OptimizerSystem( parametersNumber ), MAX_SAMPLES_COUNT( samplesNumber ), INPUTS_NUMBER( inputsNumber ), OUTPUTS_NUMBER( outputsNumber ), 
+    samplesCount( 0 ), workerPool( EVALUATION_WORKERS_NUMBER ), samplesRevision( 1 ), isKinematicsReuseEnabled( true ), hasPendingParameters( false ) 
+{ 
+  std::cout << "Parameters number: " << parametersNumber << std::endl; 
+  
+  inputSamplesTable.resize( MAX_SAMPLES_COUNT * INPUTS_NUMBER );
+  outputSamplesTable.resize( MAX_SAMPLES_COUNT * OUTPUTS_NUMBER );
+}
     
 NMSProcessorBase::~NMSProcessorBase() { }
 
 bool NMSProcessorBase::StoreSamples( SimTK::Vector& dynInputSample, SimTK::Vector& emgInputSample, SimTK::Vector& outputSample )
 {
-  if( inputSamplesList.size() >= MAX_SAMPLES_COUNT ) return false;
+  if( samplesCount >= MAX_SAMPLES_COUNT ) return false;
+  if( (size_t) ( dynInputSample.size() + emgInputSample.size() ) != INPUTS_NUMBER || (size_t) outputSample.size() != OUTPUTS_NUMBER ) return false;
   
-  SimTK::Vector inputSample( dynInputSample.size() + emgInputSample.size() );
-  for( size_t valueIndex = 0; valueIndex < dynInputSample.size(); valueIndex++ )
-    inputSample[ valueIndex ] = dynInputSample[ valueIndex ];
-  for( size_t valueIndex = 0; valueIndex < dynInputSample.size(); valueIndex++ )
-    inputSample[ dynInputSample.size() + valueIndex ] = emgInputSample[ valueIndex ];
+  // Plain copies into preallocated rows, safe for the control loop
+  double* inputSample = inputSamplesTable.data() + samplesCount * INPUTS_NUMBER;
+  std::copy( dynInputSample.getContiguousScalarData(), dynInputSample.getContiguousScalarData() + dynInputSample.size(), inputSample );
+  std::copy( emgInputSample.getContiguousScalarData(), emgInputSample.getContiguousScalarData() + emgInputSample.size(), inputSample + dynInputSample.size() );
+  std::copy( outputSample.getContiguousScalarData(), outputSample.getContiguousScalarData() + OUTPUTS_NUMBER, outputSamplesTable.data() + samplesCount * OUTPUTS_NUMBER );
   
-  inputSamplesList.push_back( inputSample );
-  outputSamplesList.push_back( outputSample );
+  samplesCount++;
+  samplesRevision++;
   
   return true;
 }
 
 void NMSProcessorBase::ResetSamplesStorage()
 {
-  inputSamplesList.clear();
-  outputSamplesList.clear();
+  samplesCount = 0;
+  samplesRevision++;
+}
+
+SamplesColumn NMSProcessorBase::GetInputsColumn( size_t variableIndex ) const
+{
+  SamplesColumn column = { inputSamplesTable.data() + variableIndex, INPUTS_NUMBER, samplesCount };
+  return column;
+}
+
+SamplesColumn NMSProcessorBase::GetOutputsColumn( size_t variableIndex ) const
+{
+  SamplesColumn column = { outputSamplesTable.data() + variableIndex, OUTPUTS_NUMBER, samplesCount };
+  return column;
+}
+
+void NMSProcessorBase::SetKinematicsReuse( bool enabled ) { isKinematicsReuseEnabled = enabled; }
+
+void NMSProcessorBase::PrepareParameters( const SimTK::Vector& parametersList )
+{
+  pendingParametersList = parametersList;
+  hasPendingParameters = true;
+}
+
+bool NMSProcessorBase::CommitParameters()
+{
+  if( not hasPendingParameters ) return false;
+  SetParameters( pendingParametersList );
+  hasPendingParameters = false;
+  return true;
+}
+
+bool NMSProcessorBase::SaveCalibration( const std::string& filePath, uint64_t modelHash, const SimTK::Vector& parametersList ) const
+{
+  if( parametersList.size() != getNumParameters() ) return false;
+  
+  std::vector<double> calibrationDataList;
+  GetCalibrationData( calibrationDataList );
+  
+  // Written aside and renamed, so that a failed write never replaces a stored calibration with a partial one
+  std::string temporaryFilePath = ModelSnapshot::GetTemporaryFilePath( filePath );
+  std::ofstream calibrationFile( temporaryFilePath.c_str(), std::ios::binary );
+  if( not calibrationFile.is_open() ) return false;
+  
+  uint64_t sizesList[ CALIBRATION_SIZES_NUMBER ] = { CALIBRATION_FILE_VERSION, modelHash, (uint64_t) parametersList.size(), INPUTS_NUMBER, OUTPUTS_NUMBER, calibrationDataList.size() };
+  calibrationFile.write( CALIBRATION_FILE_SIGNATURE, sizeof(CALIBRATION_FILE_SIGNATURE) );
+  calibrationFile.write( (const char*) sizesList, sizeof(sizesList) );
+  for( int parameterIndex = 0; parameterIndex < parametersList.size(); parameterIndex++ )
+    calibrationFile.write( (const char*) &(parametersList[ parameterIndex ]), sizeof(double) );
+  calibrationFile.write( (const char*) calibrationDataList.data(), calibrationDataList.size() * sizeof(double) );
+  calibrationFile.close();
+  if( calibrationFile.good() && std::rename( temporaryFilePath.c_str(), filePath.c_str() ) == 0 ) return true;
+  
+  std::remove( temporaryFilePath.c_str() );
+  return false;
+}
+
+bool NMSProcessorBase::LoadCalibration( const std::string& filePath, uint64_t modelHash, SimTK::Vector& parametersList )
+{
+  MappedFile calibrationFile( filePath );
+  if( calibrationFile.dataList == NULL ) return false;
+  
+  const size_t HEADER_SIZE = sizeof(CALIBRATION_FILE_SIGNATURE) + CALIBRATION_SIZES_NUMBER * sizeof(uint64_t);
+  if( calibrationFile.dataSize < HEADER_SIZE ) return false;
+  if( std::memcmp( calibrationFile.dataList, CALIBRATION_FILE_SIGNATURE, sizeof(CALIBRATION_FILE_SIGNATURE) ) != 0 ) return false;
+  uint64_t sizesList[ CALIBRATION_SIZES_NUMBER ];
+  std::memcpy( sizesList, calibrationFile.dataList + sizeof(CALIBRATION_FILE_SIGNATURE), sizeof(sizesList) );
+  // Files from other versions, or for other processors or models, are ignored
+  if( sizesList[ CALIBRATION_VERSION ] != CALIBRATION_FILE_VERSION || sizesList[ CALIBRATION_MODEL_HASH ] != modelHash ) return false;
+  if( sizesList[ CALIBRATION_PARAMETERS_NUMBER ] != (uint64_t) getNumParameters() ) return false;
+  if( sizesList[ CALIBRATION_INPUTS_NUMBER ] != INPUTS_NUMBER || sizesList[ CALIBRATION_OUTPUTS_NUMBER ] != OUTPUTS_NUMBER ) return false;
+  size_t valuesNumber = sizesList[ CALIBRATION_PARAMETERS_NUMBER ] + sizesList[ CALIBRATION_DATA_SIZE ];
+  if( calibrationFile.dataSize != HEADER_SIZE + valuesNumber * sizeof(double) ) return false;
+  
+  // Values are 8 byte aligned after the header, as the mapping is page aligned
+  const double* valuesList = (const double*) ( calibrationFile.dataList + HEADER_SIZE );
+  SimTK::Vector loadedParametersList( getNumParameters() );
+  for( int parameterIndex = 0; parameterIndex < loadedParametersList.size(); parameterIndex++ )
+  {
+    loadedParametersList[ parameterIndex ] = valuesList[ parameterIndex ];
+    if( not std::isfinite( loadedParametersList[ parameterIndex ] ) ) return false;
+  }
+  if( not SetCalibration( loadedParametersList, valuesList + getNumParameters(), sizesList[ CALIBRATION_DATA_SIZE ] ) ) return false;
+  
+  parametersList = loadedParametersList;
+  
+  return true;
+}
+
+void NMSProcessorBase::GetCalibrationData( std::vector<double>& calibrationDataList ) const { calibrationDataList.clear(); }
+
+bool NMSProcessorBase::SetCalibration( const SimTK::Vector& parametersList, const double* calibrationDataList, size_t calibrationDataSize )
+{
+  if( calibrationDataSize > 0 ) return false;
+  SetParameters( parametersList );
+  return true;
+}
+
+void NMSProcessorBase::CalculateOutputs( const SimTK::Vector& dynInputs, const SimTK::Vector& emgInputs, SimTK::Vector& outputs ) const
+{
+  outputs = CalculateOutputs( dynInputs, emgInputs );
+}
+
+bool NMSProcessorBase::LearnOnline( const SimTK::Vector& dynInputSample, const SimTK::Vector& emgInputSample, const SimTK::Vector& outputSample, double timeBudget ) { return false; }
+
+void NMSProcessorBase::PrepareEvaluation() const { }
+
+SimTK::Real NMSProcessorBase::CalculateError( const SimTK::Vector& parametersList, size_t jobIndex ) const
+{
+  SimTK::Real error = 0.0;
+  objectiveFunc( parametersList, true, error );
+  return error;
+}
+
+int NMSProcessorBase::gradientFunc( const SimTK::Vector& parametersList, bool newCoefficients, SimTK::Vector& gradientsList ) const
+{
+  PrepareEvaluation();
+  
+  double* parametersMinList = NULL;
+  double* parametersMaxList = NULL;
+  if( getHasLimits() ) getParameterLimits( &parametersMinList, &parametersMaxList );
+  
+  // Last evaluation is the unperturbed one. Each job takes a strided subset, on its own model copy
+  size_t parametersNumber = parametersList.size();
+  std::vector<double> errorsList( parametersNumber + 1 ), stepsList( parametersNumber, 0.0 );
+  size_t jobsNumber = workerPool.GetWorkersNumber();
+  workerPool.Run( jobsNumber, [ & ]( size_t jobIndex )
+  {
+    SimTK::Vector perturbedParametersList = parametersList;
+    for( size_t evaluationIndex = jobIndex; evaluationIndex <= parametersNumber; evaluationIndex += jobsNumber )
+    {
+      if( evaluationIndex < parametersNumber )
+      {
+        double parameter = parametersList[ evaluationIndex ];
+        double step = GRADIENT_RELATIVE_STEP * std::max( std::abs( parameter ), 1.0 );
+        // Step backwards when the upper limit would be crossed
+        if( parametersMaxList != NULL && parameter + step > parametersMaxList[ evaluationIndex ] ) step = -step;
+        perturbedParametersList[ evaluationIndex ] = parameter + step;
+        stepsList[ evaluationIndex ] = step;
+      }
+      
+      errorsList[ evaluationIndex ] = CalculateError( perturbedParametersList, jobIndex );
+      
+      if( evaluationIndex < parametersNumber ) perturbedParametersList[ evaluationIndex ] = parametersList[ evaluationIndex ];
+    }
+  } );
+  
+  gradientsList.resize( parametersNumber );
+  for( size_t parameterIndex = 0; parameterIndex < parametersNumber; parameterIndex++ )
+    gradientsList[ parameterIndex ] = ( errorsList[ parameterIndex ] - errorsList[ parametersNumber ] ) / stepsList[ parameterIndex ];
+  
+  return 0;
 }
@@ -3,21 +3,40 @@
 
 #include <OpenSim/OpenSim.h>
 
+#include <mutex>
+#include <cstdint>
+
+#include "worker_pool.h"
+
 typedef std::vector<OpenSim::CoordinateActuator*> ActuatorsList;
 
 enum { NMS_POSITION, NMS_VELOCITY, NMS_ACCELERATION, NMS_SETPOINT, NMS_TORQUE_EXT, NMS_INPUT_VARS_NUMBER };
 enum { NMS_TORQUE_INT, NMS_STIFFNESS, NMS_OUTPUT_VARS_NUMBER };
 
+/* Strided view over a single variable of all stored samples */
+struct SamplesColumn
+{
+  const double* valuesList;
+  size_t stride, count;
+  
+  inline double operator[]( size_t sampleIndex ) const { return valuesList[ sampleIndex * stride ]; }
+};
+
 class NMSProcessorBase : public SimTK::OptimizerSystem
 {
   public:
-    /* Constructor class. Parameters accessed in objectiveFunc() class */
-    NMSProcessorBase( const size_t parametersNumber, const size_t samplesNumber );
+    /* Constructor class. Sample storage for inputs (dynamic values followed by EMG) and outputs is allocated once here */
+    NMSProcessorBase( const size_t parametersNumber, const size_t samplesNumber, const size_t inputsNumber, const size_t outputsNumber );
     virtual ~NMSProcessorBase();
  
     virtual int objectiveFunc( const SimTK::Vector&, bool, SimTK::Real& ) const = 0;
 
+    /* Forward differences gradient, with perturbed objectives evaluated concurrently */
+    int gradientFunc( const SimTK::Vector&, bool, SimTK::Vector& ) const;
+
     virtual SimTK::Vector CalculateOutputs( const SimTK::Vector&, const SimTK::Vector& ) const = 0;
+    /* Writes into caller owned (presized) outputs. Defaults to copying the returned vector */
+    virtual void CalculateOutputs( const SimTK::Vector&, const SimTK::Vector&, SimTK::Vector& ) const;
     
     bool StoreSamples( SimTK::Vector&, SimTK::Vector&, SimTK::Vector& );
     
@@ -27,9 +46,57 @@ class NMSProcessorBase : public SimTK::OptimizerSystem
     
     virtual void SetParameters( const SimTK::Vector& ) = 0;
     
+    /* Short name of the processor kind, to tell apart files it stores */
+    virtual const char* GetTypeName() const = 0;
+    
+    /* Two phase update for a running controller: preparation does any model rebuild or allocation, out of the control loop,
+       and committing only swaps prepared parameters in, returning false if there were none. Defaults defer SetParameters() */
+    virtual void PrepareParameters( const SimTK::Vector& );
+    virtual bool CommitParameters();
+    
+    /* Incremental model update from the latest sample, within the given time budget (microseconds), returning true if the model changed. No-op by default */
+    virtual bool LearnOnline( const SimTK::Vector&, const SimTK::Vector&, const SimTK::Vector&, double );
+    
+    void SetKinematicsReuse( bool );
+    
+    /* Calibrated parameters, and any state derived from them, stored in a versioned binary file along with the model file hash */
+    bool SaveCalibration( const std::string&, uint64_t, const SimTK::Vector& ) const;
+    /* Restores (memory mapped) calibrations saved by a processor of the same kind and size, for the same model file hash. 
+       False if missing or incompatible */
+    bool LoadCalibration( const std::string&, uint64_t, SimTK::Vector& );
+    
+    /* Held only while parsing OpenSim models or building their systems, which is not safe to do concurrently */
+    static std::mutex modelLoadingMutex;
+    
   protected:
-    const size_t MAX_SAMPLES_COUNT;
-    SimTK::Array_<SimTK::Vector> inputSamplesList, outputSamplesList;
+    /* State derived from the current parameters that is not recomputed from them when loading, e.g. trained weights. None by default */
+    virtual void GetCalibrationData( std::vector<double>& ) const;
+    /* Sets parameters and stored data (of the given size). Defaults to SetParameters(), accepting no data */
+    virtual bool SetCalibration( const SimTK::Vector&, const double*, size_t );
+    
+    /* Called before concurrent evaluations, outside of worker jobs */
+    virtual void PrepareEvaluation() const;
+    /* Objective value over all samples, using the copy owned by the given job, if any */
+    virtual SimTK::Real CalculateError( const SimTK::Vector&, size_t ) const;
+    
+    inline const double* GetInputSample( size_t sampleIndex ) const { return inputSamplesTable.data() + sampleIndex * INPUTS_NUMBER; }
+    inline const double* GetOutputSample( size_t sampleIndex ) const { return outputSamplesTable.data() + sampleIndex * OUTPUTS_NUMBER; }
+    SamplesColumn GetInputsColumn( size_t ) const;
+    SamplesColumn GetOutputsColumn( size_t ) const;
+    
+    const size_t MAX_SAMPLES_COUNT, INPUTS_NUMBER, OUTPUTS_NUMBER;
+    /* Row-major sample blocks */
+    std::vector<double> inputSamplesTable, outputSamplesTable;
+    size_t samplesCount;
+    /* Owned by each processor, so that calibrations of different controller instances do not wait for each other */
+    mutable WorkerPool workerPool;
+    size_t samplesRevision;
+    bool isKinematicsReuseEnabled;
+    /* Set by PrepareParameters(), cleared by CommitParameters() */
+    bool hasPendingParameters;
+    
+  private:
+    SimTK::Vector pendingParametersList;
 };
 
 #endif // NMS_PROCESSOR_BASE_H
@@ -1,13 +1,19 @@
 #include "nms_processor-nn.h"
 
-#include "perceptron/multi_layer_perceptron.h"
+#include <cmath>
+#include <algorithm>
+#include <chrono>
+
+const size_t TRAINING_EPOCHS_NUMBER = 100;
+const size_t WARM_START_EPOCHS_NUMBER = 20;
+const size_t ONLINE_WINDOW_SIZE = 64;
+const size_t ONLINE_BATCH_SIZE = 8;
+const double ONLINE_LEARNING_RATE = 1.0e-4;
 
 NMSProcessor::NMSProcessor( OpenSim::Model& model, ActuatorsList& actuatorsList, const size_t samplesNumber ) 
-: NMSProcessorBase( 2, samplesNumber )
+: NMSProcessorBase( 2, samplesNumber, model.getMuscles().getSize() + NMS_INPUT_VARS_NUMBER * actuatorsList.size(), NMS_OUTPUT_VARS_NUMBER * actuatorsList.size() ),
+  network( NULL ), pendingNetwork( NULL ), trainedNetworksRevision( 0 ), trainedNetworksGeneration( 0 ), onlineSamplesCount( 0 ), onlineSampleIndex( 0 ), onlineStepTime( 0.0 )
 {
-  inputsNumber = model.getMuscles().getSize() + NMS_INPUT_VARS_NUMBER * actuatorsList.size();
-  outputsNumber = NMS_OUTPUT_VARS_NUMBER * actuatorsList.size();
-  
   SimTK::Vector initialParametersList = GetInitialParameters();
   SimTK::Vector parametersMinList( initialParametersList.size() ), parametersMaxList( initialParametersList.size() );
   for( int parameterIndex = 0; parameterIndex < initialParametersList.size(); parameterIndex++ )
@@ -16,6 +22,11 @@ NMSProcessor::NMSProcessor( OpenSim::Model& model, ActuatorsList& actuatorsList,
     parametersMaxList[ parameterIndex ] = 1.5 * initialParametersList[ parameterIndex ];
   }
   setParameterLimits( parametersMinList, parametersMaxList );
+  
+  onlineInputsTable.resize( ONLINE_WINDOW_SIZE * INPUTS_NUMBER );
+  onlineOutputsTable.resize( ONLINE_WINDOW_SIZE * OUTPUTS_NUMBER );
+  onlineBatchIndexesList.resize( ONLINE_BATCH_SIZE );
+  networkInputsList.resize( INPUTS_NUMBER );
 
   //DataLogging.SetBaseDirectory( "test" );
   //optimizationLog = DataLogging.InitLog( "joints/optimization", 6 );
@@ -24,10 +35,15 @@ NMSProcessor::NMSProcessor( OpenSim::Model& model, ActuatorsList& actuatorsList,
 NMSProcessor::~NMSProcessor()
 {
   ResetSamplesStorage();
+  
+  delete network;
+  delete pendingNetwork;
 
   //DataLogging.EndLog( optimizationLog );
 }
 
+const char* NMSProcessor::GetTypeName() const { return "nn"; }
+
 SimTK::Vector NMSProcessor::GetInitialParameters()
 {
   SimTK::Vector initialParametersList( 2 );
@@ -39,53 +55,188 @@ SimTK::Vector NMSProcessor::GetInitialParameters()
 
 void NMSProcessor::SetParameters( const SimTK::Vector& parametersList )
 {
-  size_t hiddenNeuronsNumber = (size_t) parametersList[ 0 ];
-  size_t trainingSamplesNumber = (size_t) parametersList[ 1 ];
+  // Reuse the network trained during calibration
+  TrainedNetworkPtr trainedNetwork = GetTrainedNetwork( parametersList );
   
-  perceptron = MLPerceptron_InitNetwork( inputsNumber, outputsNumber, hiddenNeuronsNumber );
+  delete network;
+  network = new MLPNetwork( *(trainedNetwork->network) );
   
-  SimTK::Array_<const double*> trainingInputsTable, trainingOutputsTable;
-  for( size_t sampleIndex = 0; sampleIndex < trainingSamplesNumber; sampleIndex++ )
+  // Online updates start over from the newly trained network
+  onlineSamplesCount = onlineSampleIndex = 0;
+}
+
+// Cache lookup (possibly training) and network copy happen here, so that committing it is a pointer swap
+void NMSProcessor::PrepareParameters( const SimTK::Vector& parametersList )
+{
+  TrainedNetworkPtr trainedNetwork = GetTrainedNetwork( parametersList );
+  
+  // Network replaced by the last commit, if any, is released here as well
+  delete pendingNetwork;
+  pendingNetwork = new MLPNetwork( *(trainedNetwork->network) );
+  hasPendingParameters = true;
+}
+
+bool NMSProcessor::CommitParameters()
+{
+  if( not hasPendingParameters ) return false;
+  std::swap( network, pendingNetwork );
+  onlineSamplesCount = onlineSampleIndex = 0;
+  hasPendingParameters = false;
+  return true;
+}
+
+void NMSProcessor::GetCalibrationData( std::vector<double>& calibrationDataList ) const
+{
+  calibrationDataList.resize( ( network != NULL ) ? network->GetStateSize() : 0 );
+  if( network != NULL ) network->GetState( calibrationDataList.data() );
+}
+
+bool NMSProcessor::SetCalibration( const SimTK::Vector& parametersList, const double* calibrationDataList, size_t calibrationDataSize )
+{
+  size_t hiddenNeuronsNumber = (size_t) std::max( std::round( parametersList[ 0 ] ), 1.0 );
+  MLPNetwork* loadedNetwork = new MLPNetwork( INPUTS_NUMBER, OUTPUTS_NUMBER, hiddenNeuronsNumber );
+  if( calibrationDataSize != loadedNetwork->GetStateSize() )
   {
-    trainingInputsTable.push_back( inputSamplesList[ sampleIndex ].getContiguousScalarData() );
-    trainingOutputsTable.push_back( outputSamplesList[ sampleIndex ].getContiguousScalarData() );
+    delete loadedNetwork;
+    return false;
   }
+  loadedNetwork->SetState( calibrationDataList );
+  
+  delete network;
+  network = loadedNetwork;
+  
+  onlineSamplesCount = onlineSampleIndex = 0;
   
-  (void) MLPerceptron_Train( perceptron, trainingInputsTable.data(), trainingOutputsTable.data(), trainingSamplesNumber );
+  return true;
 }
 
-int NMSProcessor::objectiveFunc( const SimTK::Vector& parametersList, bool newCoefficients, SimTK::Real& remainingError ) const
+bool NMSProcessor::LearnOnline( const SimTK::Vector& dynInputSample, const SimTK::Vector& emgInputSample, const SimTK::Vector& outputSample, double timeBudget )
 {
-  size_t hiddenNeuronsNumber = (size_t) parametersList[ 0 ];
-  size_t trainingSamplesNumber = (size_t) parametersList[ 1 ];
+  if( network == NULL || timeBudget <= 0.0 ) return false;
+  if( (size_t) ( dynInputSample.size() + emgInputSample.size() ) != INPUTS_NUMBER || (size_t) outputSample.size() != OUTPUTS_NUMBER ) return false;
   
-  MLPerceptron testMLP = MLPerceptron_InitNetwork( inputsNumber, outputsNumber, hiddenNeuronsNumber );
+  // Newest sample overwrites the oldest one in the window
+  double* inputSample = onlineInputsTable.data() + onlineSampleIndex * INPUTS_NUMBER;
+  std::copy( dynInputSample.getContiguousScalarData(), dynInputSample.getContiguousScalarData() + dynInputSample.size(), inputSample );
+  std::copy( emgInputSample.getContiguousScalarData(), emgInputSample.getContiguousScalarData() + emgInputSample.size(), inputSample + dynInputSample.size() );
+  std::copy( outputSample.getContiguousScalarData(), outputSample.getContiguousScalarData() + OUTPUTS_NUMBER, onlineOutputsTable.data() + onlineSampleIndex * OUTPUTS_NUMBER );
+  onlineSampleIndex = ( onlineSampleIndex + 1 ) % ONLINE_WINDOW_SIZE;
+  onlineSamplesCount = std::min( onlineSamplesCount + 1, ONLINE_WINDOW_SIZE );
   
-  SimTK::Array_<const double*> trainingInputsTable, trainingOutputsTable;
-  for( size_t sampleIndex = 0; sampleIndex < trainingSamplesNumber; sampleIndex++ )
+  // Latest sample is always in the batch. Steps are only taken while the last measured step duration still fits in the budget
+  size_t batchSize = std::min( ONLINE_BATCH_SIZE, onlineSamplesCount );
+  size_t latestSampleIndex = ( onlineSampleIndex + ONLINE_WINDOW_SIZE - 1 ) % ONLINE_WINDOW_SIZE;
+  std::uniform_int_distribution<size_t> sampleDistribution( 0, onlineSamplesCount - 1 );
+  auto startTime = std::chrono::steady_clock::now();
+  double elapsedTime = 0.0;
+  bool hasLearned = false;
+  while( elapsedTime + onlineStepTime < timeBudget )
   {
-    trainingInputsTable.push_back( inputSamplesList[ sampleIndex ].getContiguousScalarData() );
-    trainingOutputsTable.push_back( outputSamplesList[ sampleIndex ].getContiguousScalarData() );
+    onlineBatchIndexesList[ 0 ] = latestSampleIndex;
+    for( size_t batchIndex = 1; batchIndex < batchSize; batchIndex++ )
+      onlineBatchIndexesList[ batchIndex ] = sampleDistribution( onlineRandomGenerator );
+    (void) network->TrainBatch( onlineInputsTable.data(), INPUTS_NUMBER, onlineOutputsTable.data(), OUTPUTS_NUMBER, 
+                                onlineBatchIndexesList.data(), batchSize, ONLINE_LEARNING_RATE );
+    double currentTime = std::chrono::duration<double, std::micro>( std::chrono::steady_clock::now() - startTime ).count();
+    onlineStepTime = currentTime - elapsedTime;
+    elapsedTime = currentTime;
+    hasLearned = true;
   }
   
-  double trainingError = MLPerceptron_Train( testMLP, trainingInputsTable.data(), trainingOutputsTable.data(), trainingSamplesNumber );
+  return hasLearned;
+}
+
+TrainedNetworkPtr NMSProcessor::GetTrainedNetwork( const SimTK::Vector& parametersList ) const
+{
+  size_t hiddenNeuronsNumber = (size_t) std::max( std::round( parametersList[ 0 ] ), 1.0 );
+  size_t trainingSamplesNumber = std::min( (size_t) std::max( std::round( parametersList[ 1 ] ), 0.0 ), samplesCount );
   
-  trainingInputsTable.clear();
-  trainingOutputsTable.clear();
+  TrainedNetworkPtr trainedNetwork, nearestNetwork;
+  bool isTrainingNeeded = false;
+  {
+    std::lock_guard<std::mutex> lock( trainedNetworksMutex );
+    // Cached results are only valid for the samples they were trained on
+    if( trainedNetworksRevision != samplesRevision ) trainedNetworksCache.clear();
+    trainedNetworksRevision = samplesRevision;
+    
+    TrainedNetworkPtr& cachedNetwork = trainedNetworksCache[ std::make_pair( hiddenNeuronsNumber, trainingSamplesNumber ) ];
+    if( not cachedNetwork )
+    {
+      // Networks of previous generations are all finished, unlike concurrent ones, so the choice does not depend on thread timing
+      double nearestDistance = INFINITY;
+      for( auto& cacheEntry : trainedNetworksCache )
+      {
+        const TrainedNetworkPtr& candidateNetwork = cacheEntry.second;
+        if( not candidateNetwork || not candidateNetwork->isReady || candidateNetwork->generation >= trainedNetworksGeneration ) continue;
+        double distance = std::abs( (double) candidateNetwork->hiddenNeuronsNumber - hiddenNeuronsNumber ) / hiddenNeuronsNumber
+                          + std::abs( (double) candidateNetwork->trainingSamplesNumber - trainingSamplesNumber ) / std::max( trainingSamplesNumber, (size_t) 1 );
+        if( distance < nearestDistance )
+        {
+          nearestDistance = distance;
+          nearestNetwork = candidateNetwork;
+        }
+      }
+      
+      cachedNetwork.reset( new TrainedNetwork() );
+      cachedNetwork->hiddenNeuronsNumber = hiddenNeuronsNumber;
+      cachedNetwork->trainingSamplesNumber = trainingSamplesNumber;
+      cachedNetwork->generation = trainedNetworksGeneration;
+      cachedNetwork->error = cachedNetwork->errorPromise.get_future().share();
+      cachedNetwork->isReady = false;
+      isTrainingNeeded = true;
+    }
+    trainedNetwork = cachedNetwork;
+  }
   
-  SimTK::Array_<const double*> validationInputsTable, validationOutputsTable;
-  size_t validationSamplesNumber = 0;
-  for( size_t sampleIndex = trainingSamplesNumber; sampleIndex < inputSamplesList.size(); sampleIndex++ )
+  if( isTrainingNeeded )
   {
-    validationInputsTable.push_back( inputSamplesList[ sampleIndex ].getContiguousScalarData() );
-    validationOutputsTable.push_back( outputSamplesList[ sampleIndex ].getContiguousScalarData() );
-    validationSamplesNumber++;
+    try
+    {
+      std::unique_ptr<MLPNetwork> testNetwork( new MLPNetwork( INPUTS_NUMBER, OUTPUTS_NUMBER, hiddenNeuronsNumber ) );
+      size_t epochsNumber = TRAINING_EPOCHS_NUMBER;
+      if( nearestNetwork )
+      {
+        testNetwork->CopyWeights( *(nearestNetwork->network) );
+        epochsNumber = WARM_START_EPOCHS_NUMBER;
+      }
+      
+      // Training and validation sets are consecutive slices of the stored sample blocks
+      double trainingError = testNetwork->Train( inputSamplesTable.data(), INPUTS_NUMBER, outputSamplesTable.data(), OUTPUTS_NUMBER, 
+                                                 trainingSamplesNumber, epochsNumber );
+      size_t validationSamplesNumber = samplesCount - trainingSamplesNumber;
+      double validationError = testNetwork->Validate( GetInputSample( trainingSamplesNumber ), INPUTS_NUMBER, GetOutputSample( trainingSamplesNumber ), OUTPUTS_NUMBER, 
+                                                      validationSamplesNumber );
+      
+      trainedNetwork->network = std::move( testNetwork );
+      {
+        std::lock_guard<std::mutex> lock( trainedNetworksMutex );
+        trainedNetwork->isReady = true;
+      }
+      trainedNetwork->errorPromise.set_value( trainingError + 0.5 * validationError );
+    }
+    catch( ... )
+    {
+      // Waiting evaluations get the failure instead of blocking forever, and the entry is never used for warm starts
+      trainedNetwork->errorPromise.set_exception( std::current_exception() );
+    }
   }
   
-  double validationError = MLPerceptron_Validate( testMLP, validationInputsTable.data(), validationOutputsTable.data(), validationSamplesNumber );
+  // Other evaluations of the same configuration wait for the one training it, rethrowing its failure if any
+  (void) trainedNetwork->error.get();
+  
+  return trainedNetwork;
+}
 
-  validationInputsTable.clear();
-  validationOutputsTable.clear();
+void NMSProcessor::PrepareEvaluation() const
+{
+  std::lock_guard<std::mutex> lock( trainedNetworksMutex );
+  trainedNetworksGeneration++;
+}
+
+int NMSProcessor::objectiveFunc( const SimTK::Vector& parametersList, bool newCoefficients, SimTK::Real& remainingError ) const
+{
+  PrepareEvaluation();
+  remainingError = GetTrainedNetwork( parametersList )->error.get();
     
 	// Data logging for joint 0
 // 	for( int sampleIndex = 0; sampleIndex < NMS_POS_VARS_NUMBER; sampleIndex++ )
@@ -97,28 +248,62 @@ int NMSProcessor::objectiveFunc( const SimTK::Vector& parametersList, bool newCo
 // 	DataLogging.RegisterValues( optimizationLog, 2, torqueSample[ NMS_FORCE_VARS_NUMBER + NMS_TORQUE_EXT ], emgTorqueOutputs[ NMS_FORCE_VARS_NUMBER + NMS_STIFFNESS ] );
 // 	DataLogging.EnterNewLine( optimizationLog );
 
-  remainingError = trainingError + 0.5 * validationError;
-    
   std::cout << "objective function error: " << remainingError << std::endl;
 
   return 0;
 }
 
-SimTK::Vector NMSProcessor::CalculateOutputs( const SimTK::Vector& dynInputs, const SimTK::Vector& emgInputs ) const
+int NMSProcessor::gradientFunc( const SimTK::Vector& parametersList, bool newCoefficients, SimTK::Vector& gradientsList ) const
 {
-  double* inputsList = new double[ inputsNumber ];
-  double* outputsList = new double[ outputsNumber ];
+  double* parametersMaxList = NULL;
+  double* parametersMinList = NULL;
+  if( getHasLimits() ) getParameterLimits( &parametersMinList, &parametersMaxList );
+  
+  // Last candidate is the unperturbed one. Smaller steps would hit the same rounded configuration
+  size_t parametersNumber = parametersList.size();
+  std::vector<SimTK::Vector> candidatesList( parametersNumber + 1, parametersList );
+  std::vector<double> errorsList( parametersNumber + 1 ), stepsList( parametersNumber, 1.0 );
+  for( size_t parameterIndex = 0; parameterIndex < parametersNumber; parameterIndex++ )
+  {
+    if( parametersMaxList != NULL && parametersList[ parameterIndex ] + 1.0 > parametersMaxList[ parameterIndex ] ) stepsList[ parameterIndex ] = -1.0;
+    candidatesList[ parameterIndex ][ parameterIndex ] += stepsList[ parameterIndex ];
+  }
   
-  for( size_t valueIndex = 0; valueIndex < dynInputs.size(); valueIndex++ )
-    inputsList[ valueIndex ] = dynInputs[ valueIndex ];
-  for( size_t valueIndex = 0; valueIndex < emgInputs.size(); valueIndex++ )
-    inputsList[ dynInputs.size() + valueIndex ] = emgInputs[ valueIndex ];
+  PrepareEvaluation();
   
-  MLPerceptron_ProcessInput( perceptron, inputsList, outputsList );
+  workerPool.Run( candidatesList.size(), [ & ]( size_t candidateIndex ) 
+  { 
+    errorsList[ candidateIndex ] = GetTrainedNetwork( candidatesList[ candidateIndex ] )->error.get(); 
+  } );
   
-  SimTK::Vector torqueInternalOutputs( outputsNumber, outputsList );
+  gradientsList.resize( parametersNumber );
+  for( size_t parameterIndex = 0; parameterIndex < parametersNumber; parameterIndex++ )
+    gradientsList[ parameterIndex ] = ( errorsList[ parameterIndex ] - errorsList[ parametersNumber ] ) / stepsList[ parameterIndex ];
   
-  delete[] outputsList;
+  return 0;
+}
+
+SimTK::Vector NMSProcessor::CalculateOutputs( const SimTK::Vector& dynInputs, const SimTK::Vector& emgInputs ) const
+{
+  SimTK::Vector torqueInternalOutputs( OUTPUTS_NUMBER );
+  CalculateOutputs( dynInputs, emgInputs, torqueInternalOutputs );
   
   return torqueInternalOutputs;
 }
+
+void NMSProcessor::CalculateOutputs( const SimTK::Vector& dynInputs, const SimTK::Vector& emgInputs, SimTK::Vector& outputs ) const
+{
+  if( (size_t) outputs.size() != OUTPUTS_NUMBER ) outputs.resize( OUTPUTS_NUMBER );
+  
+  if( network == NULL || (size_t) ( dynInputs.size() + emgInputs.size() ) != INPUTS_NUMBER ) 
+  {
+    outputs = 0.0;
+    return;
+  }
+  
+  double* inputsList = networkInputsList.data();
+  std::copy( dynInputs.getContiguousScalarData(), dynInputs.getContiguousScalarData() + dynInputs.size(), inputsList );
+  std::copy( emgInputs.getContiguousScalarData(), emgInputs.getContiguousScalarData() + emgInputs.size(), inputsList + dynInputs.size() );
+  
+  network->Process( inputsList, outputs.updContiguousScalarData() );
+}
@@ -3,7 +3,25 @@
 
 #include "nms_processor-base.h"
 
-#include "perceptron/multi_layer_perceptron.h"
+#include "mlp_network.h"
+
+#include <random>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <future>
+
+/* Network trained for a given hyperparameters pair, shared by concurrent evaluations once its error (or training failure) is available */
+struct TrainedNetwork
+{
+  size_t hiddenNeuronsNumber, trainingSamplesNumber, generation;
+  std::unique_ptr<MLPNetwork> network;
+  std::promise<double> errorPromise;
+  std::shared_future<double> error;
+  bool isReady;
+};
+
+typedef std::shared_ptr<TrainedNetwork> TrainedNetworkPtr;
 
 class NMSProcessor : public NMSProcessorBase
 {
@@ -13,15 +31,49 @@ class NMSProcessor : public NMSProcessorBase
     ~NMSProcessor();
  
     int objectiveFunc( const SimTK::Vector&, bool, SimTK::Real& ) const;
+    
+    /* Unit steps over the integer hyperparameters, with neighbour configurations trained concurrently */
+    int gradientFunc( const SimTK::Vector&, bool, SimTK::Vector& ) const;
 
     SimTK::Vector CalculateOutputs( const SimTK::Vector&, const SimTK::Vector& ) const;
+    /* Heap free inference path for the control loop */
+    void CalculateOutputs( const SimTK::Vector&, const SimTK::Vector&, SimTK::Vector& ) const;
 
     SimTK::Vector GetInitialParameters();
     void SetParameters( const SimTK::Vector& );
+    const char* GetTypeName() const;
+    void PrepareParameters( const SimTK::Vector& );
+    bool CommitParameters();
+    
+    /* Mini-batch updates over a window of the most recent operation samples */
+    bool LearnOnline( const SimTK::Vector&, const SimTK::Vector&, const SimTK::Vector&, double );
+    
+  protected:
+    /* Starts a new generation of cached networks, so that warm starts only use networks from previous optimizer calls */
+    void PrepareEvaluation() const;
+    
+    /* Trained network weights, so that loading needs no training */
+    void GetCalibrationData( std::vector<double>& ) const;
+    bool SetCalibration( const SimTK::Vector&, const double*, size_t );
     
   private:
-    MLPerceptron perceptron;
-    size_t inputsNumber, outputsNumber;
+    /* Cached network for the rounded parameters, trained (warm started from the nearest cached one) if needed */
+    TrainedNetworkPtr GetTrainedNetwork( const SimTK::Vector& ) const;
+    
+    /* Network used by the controller, and the next one being prepared, swapped on commit */
+    MLPNetwork* network;
+    MLPNetwork* pendingNetwork;
+    mutable AlignedVector networkInputsList;
+    
+    mutable std::map<std::pair<size_t, size_t>, TrainedNetworkPtr> trainedNetworksCache;
+    mutable std::mutex trainedNetworksMutex;
+    mutable size_t trainedNetworksRevision, trainedNetworksGeneration;
+    
+    std::vector<double> onlineInputsTable, onlineOutputsTable;
+    size_t onlineSamplesCount, onlineSampleIndex;
+    double onlineStepTime;
+    std::vector<size_t> onlineBatchIndexesList;
+    std::minstd_rand onlineRandomGenerator;
 
     //Log optimizationLog;
 };
@@ -1,22 +1,88 @@
 #include "nms_processor-osim.h"
 
+#include "batch_kernels.h"
+#include "model_snapshot.h"
+
 #include <cmath>
+#include <algorithm>
 
 enum { EMG_MAX_FORCE, EMG_FIBER_LENGTH, EMG_SLACK_LENGTH, EMG_PENNATION_ANGLE, EMG_ACTIVATION_FACTOR, EMG_OPT_VARS_NUMBER };
 
-NMSProcessor::NMSProcessor( OpenSim::Model& model, ActuatorsList& actuatorsList, const size_t samplesNumber ) 
-: NMSProcessorBase( EMG_OPT_VARS_NUMBER * model.getMuscles().getSize(), samplesNumber ), internalModel( model ), actuatorsList( actuatorsList )
+const size_t MOMENT_ARM_TABLE_POINTS_NUMBER = 101;
+// Equilibrium residual, relative to max isometric force
+const double MUSCLE_EQUILIBRIUM_TOLERANCE = 1.0e-8;
+
+// Muscle activation input as handled by the OpenSim outputs path, which the muscle force engine is validated against
+void SetMuscleActivation( OpenSim::Muscle& muscle, SimTK::State& state, double activation )
 {
-  internalModel.setUseVisualizer( false );
-  std::cout << "Activation factors number: " << internalModel.getMuscles().getSize() << std::endl;
-  activationFactorsList.resize( internalModel.getMuscles().getSize() );
+#ifdef OSIM_LEGACY
+  muscle.setActivation( state, activation );
+#else
+  muscle.setExcitation( state, activation );
+#endif
+}
+
+NMSProcessor::NMSProcessor( OpenSim::Model& model, ActuatorsList& actuatorsList, const size_t samplesNumber, double momentArmTolerance, double muscleForceTolerance ) 
+: NMSProcessorBase( EMG_OPT_VARS_NUMBER * model.getMuscles().getSize(), samplesNumber, 
+                    NMS_INPUT_VARS_NUMBER * actuatorsList.size() + model.getMuscles().getSize(), NMS_OUTPUT_VARS_NUMBER * actuatorsList.size() ),
+  momentArmTableTolerance( momentArmTolerance ), muscleForceEngineTolerance( muscleForceTolerance )
+{
+  for( size_t jointIndex = 0; jointIndex < actuatorsList.size(); jointIndex++ )
+    jointNamesList.push_back( actuatorsList[ jointIndex ]->getCoordinate()->getName() );
+  // Work on a private copy, so that changing muscle properties never invalidates the controller system
+  controlInstance = new ModelInstance();
+  pendingInstance = new ModelInstance();
+  controlInstance->model = pendingInstance->model = NULL;
+  kinematicsSamplesRevision = 0;
+  musclesNumber = model.getMuscles().getSize();
+  sumJointTorques = SELECT_CONTROLLER_CORE( jointNamesList.size(), musclesNumber, SumJointTorques );
+  CreateInstance( *controlInstance, model, SimTK::Vector() );
+  std::cout << "Activation factors number: " << musclesNumber << std::endl;
+  
+  // Moment arm curves are stored next to the model file and rebuilt if missing or built from another version of it
+  std::string modelFileName = model.getInputFileName();
+  std::string tableFileName = modelFileName.substr( 0, modelFileName.rfind( ".osim" ) ) + "-muscle_geometry.bin";
+  bool hasModelFile = ( not modelFileName.empty() && modelFileName != "Unassigned" );
+  uint64_t modelHash = hasModelFile ? ModelSnapshot::HashFile( modelFileName ) : 0;
+  bool isTableLoaded = ( modelHash != 0 ) && muscleGeometryTable.Load( tableFileName, modelHash, *(controlInstance->model), controlInstance->jointCoordinatesList );
+  if( not isTableLoaded )
+  {
+    muscleGeometryTable.Build( *(controlInstance->model), controlInstance->workingState, controlInstance->jointCoordinatesList, MOMENT_ARM_TABLE_POINTS_NUMBER );
+    if( modelHash != 0 && not muscleGeometryTable.Save( tableFileName, modelHash ) ) std::cout << "Could not write moment arm table to " << tableFileName << std::endl;
+  }
+  // Validation errors only change with the model file or a rebuilt table, so they are reused from the model snapshot otherwise
+  ModelSnapshot modelSnapshot( hasModelFile ? modelFileName : "" );
+  std::vector<double> validationErrorsList;
+  bool hasValidationErrors = isTableLoaded && modelSnapshot.GetSection( "muscle_dynamic_validation_errors", validationErrorsList, 2 );
+  
+  momentArmTableError = hasValidationErrors ? validationErrorsList[ 0 ] : muscleGeometryTable.CalculateMaxError( *(controlInstance->model), controlInstance->workingState, controlInstance->jointCoordinatesList );
+  std::cout << "Moment arm table max interpolation error: " << momentArmTableError << ( hasValidationErrors ? " (cached)" : "" ) << std::endl;
+  SetMomentArmTable( true );
+  if( not isMomentArmTableEnabled ) std::cout << "Moment arm table disabled, as its error is over " << momentArmTableTolerance << std::endl;
   
   SimTK::Vector initialParametersList = GetInitialParameters();
+  controlInstance->modelParametersList = initialParametersList;
+  // Unchanging source for worker and calibrated instances, never evaluated itself
+  templateModel = controlInstance->model->clone();
+  templateParametersList = initialParametersList;
+  
+  // Standalone muscle forces are only used by default when they match OpenSim ones
+  muscleForceEngine = new MuscleForceEngine( *(controlInstance->model), MUSCLE_EQUILIBRIUM_TOLERANCE );
+  isMuscleForceEngineEnabled = false;
+  muscleForceEngineError = hasValidationErrors ? validationErrorsList[ 1 ] : CalculateMuscleForceEngineError();
+  std::cout << "Muscle force engine max relative error: " << muscleForceEngineError << ( hasValidationErrors ? " (cached)" : "" ) << std::endl;
+  if( hasModelFile && not hasValidationErrors )
+  {
+    modelSnapshot.SetSection( "muscle_dynamic_validation_errors", std::vector<double>{ momentArmTableError, muscleForceEngineError } );
+    if( not modelSnapshot.Save() ) std::cout << "Could not write model snapshot for " << modelFileName << std::endl;
+  }
+  SetMuscleForceEngine( true );
+  
   SimTK::Vector parametersMinList( initialParametersList.size() ), parametersMaxList( initialParametersList.size() );
   for( int parameterIndex = 0; parameterIndex < initialParametersList.size(); parameterIndex++ )
   {
-    parametersMinList[ parameterIndex ] = 0.5 * initialParametersList[ parameterIndex ];
-    parametersMaxList[ parameterIndex ] = 1.5 * initialParametersList[ parameterIndex ];
+    parametersMinList[ parameterIndex ] = std::min( 0.5 * initialParametersList[ parameterIndex ], 1.5 * initialParametersList[ parameterIndex ] );
+    parametersMaxList[ parameterIndex ] = std::max( 0.5 * initialParametersList[ parameterIndex ], 1.5 * initialParametersList[ parameterIndex ] );
   }
   std::cout << "Setting parameter limits" << std::endl;
   setParameterLimits( parametersMinList, parametersMaxList );
@@ -29,13 +95,24 @@ NMSProcessor::~NMSProcessor()
 {
   ResetSamplesStorage();
 
+  for( size_t instanceIndex = 0; instanceIndex < workerInstancesList.size(); instanceIndex++ )
+    delete workerInstancesList[ instanceIndex ].model;
+  delete controlInstance->model;
+  delete controlInstance;
+  delete pendingInstance->model;
+  delete pendingInstance;
+  delete templateModel;
+  delete muscleForceEngine;
+
   //DataLogging.EndLog( optimizationLog );
 }
 
+const char* NMSProcessor::GetTypeName() const { return "osim"; }
+
 SimTK::Vector NMSProcessor::GetInitialParameters()
 {
-  SimTK::Vector initialParametersList( EMG_OPT_VARS_NUMBER * internalModel.getMuscles().getSize() );
-  OpenSim::Set<OpenSim::Muscle> muscleSet = internalModel.getMuscles();
+  SimTK::Vector initialParametersList( EMG_OPT_VARS_NUMBER * controlInstance->model->getMuscles().getSize() );
+  const OpenSim::Set<OpenSim::Muscle>& muscleSet = controlInstance->model->getMuscles();
   for( int muscleIndex = 0; muscleIndex < muscleSet.getSize(); muscleIndex++ )
   {
     int parametersIndex = muscleIndex * EMG_OPT_VARS_NUMBER;
@@ -51,27 +128,214 @@ SimTK::Vector NMSProcessor::GetInitialParameters()
 
 void NMSProcessor::SetParameters( const SimTK::Vector& parametersList )
 {
+  UpdateInstance( *controlInstance, parametersList );
+  // Activation factors are read from the instance parameters as well
+  controlInstance->modelParametersList = parametersList;
 }
 
-int NMSProcessor::objectiveFunc( const SimTK::Vector& parametersList, bool newCoefficients, SimTK::Real& remainingError ) const
+// A whole new instance is built and its system initialized here, so that committing it is a pointer swap
+void NMSProcessor::PrepareParameters( const SimTK::Vector& parametersList )
+{
+  // Instance replaced by the last commit, if any, is released here as well
+  delete pendingInstance->model;
+  CreateInstance( *pendingInstance, *templateModel, templateParametersList );
+  UpdateInstance( *pendingInstance, parametersList );
+  pendingInstance->modelParametersList = parametersList;
+  hasPendingParameters = true;
+}
+
+bool NMSProcessor::CommitParameters()
+{
+  if( not hasPendingParameters ) return false;
+  std::swap( controlInstance, pendingInstance );
+  hasPendingParameters = false;
+  return true;
+}
+
+void NMSProcessor::SetMomentArmTable( bool enabled )
 {
-  SimTK::State& state = internalModel.initSystem();
+  isMomentArmTableEnabled = enabled && muscleGeometryTable.IsValid() && momentArmTableError <= momentArmTableTolerance;
+  // Stored sample moment arms came from the previous source
+  kinematicsSamplesRevision = 0;
+}
+
+double NMSProcessor::GetMomentArmTableError() const
+{
+  return momentArmTableError;
+}
+
+void NMSProcessor::SetMuscleForceEngine( bool enabled )
+{
+  isMuscleForceEngineEnabled = enabled && muscleForceEngine->IsValid() && muscleGeometryTable.IsValid() && momentArmTableError <= momentArmTableTolerance
+                               && muscleForceEngineError <= muscleForceEngineTolerance;
+  // Engine evaluations take their moment arms from the table as well
+  kinematicsSamplesRevision = 0;
+}
+
+double NMSProcessor::GetMuscleForceEngineError() const
+{
+  return muscleForceEngineError;
+}
+
+// Compare engine and OpenSim equilibrium fiber forces over each coordinate range, for a few activation levels and joint speeds.
+// Engine muscle-tendon velocities come from tabulated moment arms, as in the control and calibration paths
+double NMSProcessor::CalculateMuscleForceEngineError()
+{
+  if( not muscleForceEngine->IsValid() || not muscleGeometryTable.IsValid() ) return SimTK::Infinity;
+  
+  const double ACTIVATIONS_LIST[] = { 0.1, 0.5, 1.0 };
+  const double SPEEDS_LIST[] = { -2.0, -0.5, 0.0, 0.5, 2.0 };
+  const size_t POSITIONS_NUMBER = 11;
+  
+  SimTK::State& state = controlInstance->workingState;
+  OpenSim::Set<OpenSim::Muscle>& muscleSet = controlInstance->model->updMuscles();
+  std::vector<OpenSim::Coordinate*>& coordinatesList = controlInstance->jointCoordinatesList;
+  std::vector<double> activationsList( musclesNumber ), lengthsList( musclesNumber ), velocitiesList( musclesNumber, 0.0 ), forcesList( musclesNumber );
+  double maxError = 0.0;
   try
   {
-    internalModel.equilibrateMuscles( state );
-    OpenSim::Set<OpenSim::Muscle>& muscleSet = internalModel.updMuscles();
-    for( int muscleIndex = 0; muscleIndex < muscleSet.getSize(); muscleIndex++ )
+    for( size_t coordinateIndex = 0; coordinateIndex < coordinatesList.size(); coordinateIndex++ )
     {
-      int parametersIndex = muscleIndex * EMG_OPT_VARS_NUMBER;
-      muscleSet[ muscleIndex ].set_max_isometric_force( parametersList[ parametersIndex + EMG_MAX_FORCE ] );
-      muscleSet[ muscleIndex ].set_optimal_fiber_length( parametersList[ parametersIndex + EMG_FIBER_LENGTH ] );
-      muscleSet[ muscleIndex ].set_tendon_slack_length( parametersList[ parametersIndex + EMG_SLACK_LENGTH ] );
-      //std::cout << "muscle " << muscleIndex << " pennation angle: " << parametersList[ parametersIndex + EMG_PENNATION_ANGLE ] << std::endl;
-      //muscleSet[ muscleIndex ].set_pennation_angle_at_optimal( parametersList[ parametersIndex + EMG_PENNATION_ANGLE ] );
-      const_cast<SimTK::Vector&>(activationFactorsList)[ muscleIndex ] = parametersList[ parametersIndex + EMG_ACTIVATION_FACTOR ];
+      for( size_t jointIndex = 0; jointIndex < coordinatesList.size(); jointIndex++ )
+      {
+        coordinatesList[ jointIndex ]->setValue( state, coordinatesList[ jointIndex ]->getDefaultValue(), false );
+        coordinatesList[ jointIndex ]->setSpeedValue( state, 0.0 );
+      }
+      for( size_t positionIndex = 0; positionIndex < POSITIONS_NUMBER; positionIndex++ )
+      {
+        const OpenSim::Coordinate* coordinate = coordinatesList[ coordinateIndex ];
+        double position = coordinate->getRangeMin() + positionIndex * ( coordinate->getRangeMax() - coordinate->getRangeMin() ) / ( POSITIONS_NUMBER - 1 );
+        coordinatesList[ coordinateIndex ]->setValue( state, position, false );
+        for( size_t muscleIndex = 0; muscleIndex < musclesNumber; muscleIndex++ )
+        {
+          lengthsList[ muscleIndex ] = muscleGeometryTable.GetReferenceLength( muscleIndex );
+          for( size_t jointIndex = 0; jointIndex < coordinatesList.size(); jointIndex++ )
+            lengthsList[ muscleIndex ] += muscleGeometryTable.GetLengthOffset( muscleIndex, jointIndex, coordinatesList[ jointIndex ]->getValue( state ) );
+        }
+        for( size_t speedIndex = 0; speedIndex < sizeof(SPEEDS_LIST) / sizeof(double); speedIndex++ )
+        {
+          coordinatesList[ coordinateIndex ]->setSpeedValue( state, SPEEDS_LIST[ speedIndex ] );
+          for( size_t muscleIndex = 0; muscleIndex < musclesNumber; muscleIndex++ )
+            velocitiesList[ muscleIndex ] = -muscleGeometryTable.GetMomentArm( muscleIndex, coordinateIndex, position ) * SPEEDS_LIST[ speedIndex ];
+          for( size_t activationIndex = 0; activationIndex < sizeof(ACTIVATIONS_LIST) / sizeof(double); activationIndex++ )
+          {
+            for( size_t muscleIndex = 0; muscleIndex < musclesNumber; muscleIndex++ )
+            {
+              activationsList[ muscleIndex ] = ACTIVATIONS_LIST[ activationIndex ];
+              SetMuscleActivation( muscleSet[ muscleIndex ], state, activationsList[ muscleIndex ] );
+            }
+            controlInstance->model->equilibrateMuscles( state );
+            muscleForceEngine->CalculateFiberForces( controlInstance->modelParametersList.getContiguousScalarData(), EMG_OPT_VARS_NUMBER, 
+                                                     activationsList.data(), lengthsList.data(), velocitiesList.data(), forcesList.data() );
+            for( size_t muscleIndex = 0; muscleIndex < musclesNumber; muscleIndex++ )
+            {
+              double exactForce = muscleSet[ muscleIndex ].getActiveFiberForce( state ) + muscleSet[ muscleIndex ].getPassiveFiberForce( state );
+              maxError = std::max( maxError, std::abs( forcesList[ muscleIndex ] - exactForce ) / muscleSet[ muscleIndex ].get_max_isometric_force() );
+            }
+          }
+        }
+        coordinatesList[ coordinateIndex ]->setSpeedValue( state, 0.0 );
+      }
     }
   }
   catch( OpenSim::Exception ex )
+  {
+    std::cout << ex.getMessage() << std::endl;
+    return SimTK::Infinity;
+  }
+  
+  return maxError;
+}
+
+void NMSProcessor::CreateInstance( ModelInstance& instance, const OpenSim::Model& baseModel, const SimTK::Vector& parametersList ) const
+{
+  instance.model = baseModel.clone();
+  instance.model->setUseVisualizer( false );
+  {
+    std::lock_guard<std::mutex> lock( modelLoadingMutex );
+    instance.workingState = instance.model->initSystem();
+  }
+  instance.jointCoordinatesList.clear();
+  for( size_t jointIndex = 0; jointIndex < jointNamesList.size(); jointIndex++ )
+    instance.jointCoordinatesList.push_back( &(instance.model->updCoordinateSet().get( jointNamesList[ jointIndex ] )) );
+  instance.modelParametersList = parametersList;
+  instance.muscleActivationsList.resize( musclesNumber );
+  instance.muscleLengthsList.resize( musclesNumber );
+  instance.muscleVelocitiesList.resize( musclesNumber );
+  instance.muscleForcesList.resize( musclesNumber );
+  instance.momentArmsList.resize( jointNamesList.size() * musclesNumber );
+}
+
+void NMSProcessor::UpdateInstance( ModelInstance& instance, const SimTK::Vector& parametersList ) const
+{
+  bool hasModelChanged = false;
+  OpenSim::Set<OpenSim::Muscle>& muscleSet = instance.model->updMuscles();
+  for( int muscleIndex = 0; muscleIndex < muscleSet.getSize(); muscleIndex++ )
+  {
+    int parametersIndex = muscleIndex * EMG_OPT_VARS_NUMBER;
+    bool hasMuscleChanged = false;
+    for( int propertyIndex = EMG_MAX_FORCE; propertyIndex <= EMG_SLACK_LENGTH; propertyIndex++ )
+    {
+      if( parametersList[ parametersIndex + propertyIndex ] == instance.modelParametersList[ parametersIndex + propertyIndex ] ) continue;
+      instance.modelParametersList[ parametersIndex + propertyIndex ] = parametersList[ parametersIndex + propertyIndex ];
+      hasMuscleChanged = true;
+    }
+    if( not hasMuscleChanged ) continue;
+    muscleSet[ muscleIndex ].set_max_isometric_force( instance.modelParametersList[ parametersIndex + EMG_MAX_FORCE ] );
+    muscleSet[ muscleIndex ].set_optimal_fiber_length( instance.modelParametersList[ parametersIndex + EMG_FIBER_LENGTH ] );
+    muscleSet[ muscleIndex ].set_tendon_slack_length( instance.modelParametersList[ parametersIndex + EMG_SLACK_LENGTH ] );
+    //muscleSet[ muscleIndex ].set_pennation_angle_at_optimal( parametersList[ parametersIndex + EMG_PENNATION_ANGLE ] );
+    hasModelChanged = true;
+  }
+  // Rebuilding the multibody system is only needed when muscle properties change
+  if( not hasModelChanged ) return;
+  std::lock_guard<std::mutex> lock( modelLoadingMutex );
+  instance.workingState = instance.model->initSystem();
+}
+
+void NMSProcessor::PrepareEvaluation() const
+{
+  // One model copy per evaluation job, created on first use
+  if( workerInstancesList.empty() )
+  {
+    workerInstancesList.resize( workerPool.GetWorkersNumber() );
+    for( size_t instanceIndex = 0; instanceIndex < workerInstancesList.size(); instanceIndex++ )
+      CreateInstance( workerInstancesList[ instanceIndex ], *templateModel, templateParametersList );
+  }
+  // Moment arms depend only on stored joint positions, never on calibrated muscle parameters
+  if( isKinematicsReuseEnabled && kinematicsSamplesRevision != samplesRevision )
+  {
+    size_t jointsNumber = jointNamesList.size();
+    size_t samplesNumber = samplesCount;
+    size_t sampleMomentArmsNumber = jointsNumber * musclesNumber;
+    momentArmsTable.resize( samplesNumber * sampleMomentArmsNumber );
+    size_t jobsNumber = workerInstancesList.size();
+    size_t jobSamplesNumber = ( samplesNumber + jobsNumber - 1 ) / jobsNumber;
+    workerPool.Run( jobsNumber, [ & ]( size_t jobIndex )
+    {
+      size_t lastSampleIndex = std::min( ( jobIndex + 1 ) * jobSamplesNumber, samplesNumber );
+      for( size_t sampleIndex = jobIndex * jobSamplesNumber; sampleIndex < lastSampleIndex; sampleIndex++ )
+        CalculateInstanceMomentArms( workerInstancesList[ jobIndex ], GetInputSample( sampleIndex ), momentArmsTable.data() + sampleIndex * sampleMomentArmsNumber );
+    } );
+    kinematicsSamplesRevision = samplesRevision;
+  }
+}
+
+SimTK::Real NMSProcessor::CalculateError( const SimTK::Vector& parametersList, size_t jobIndex ) const
+{
+  return CalculateSamplesError( workerInstancesList[ jobIndex ], parametersList, 0, samplesCount );
+}
+
+SimTK::Real NMSProcessor::CalculateSamplesError( ModelInstance& instance, const SimTK::Vector& parametersList, size_t firstSampleIndex, size_t lastSampleIndex ) const
+{
+  // The muscle force engine reads muscle properties straight from the parameters, without rebuilding the model
+  if( isMuscleForceEngineEnabled ) return CalculateBatchSamplesError( instance, parametersList, firstSampleIndex, lastSampleIndex );
+  
+  try
+  {
+    UpdateInstance( instance, parametersList );
+  }
+  catch( OpenSim::Exception ex )
   {
     std::cout << ex.getMessage() << std::endl;
   }
@@ -80,38 +344,110 @@ int NMSProcessor::objectiveFunc( const SimTK::Vector& parametersList, bool newCo
     std::cout << ex.what() << std::endl;
   }
   
-  remainingError = 0.0;
-  for( size_t sampleIndex = 0; sampleIndex < inputSamplesList.size(); sampleIndex++ )
-  {
-    SimTK::Vector inputSample = inputSamplesList[ sampleIndex ];
-    SimTK::Vector dynInputSample( NMS_INPUT_VARS_NUMBER * actuatorsList.size() );
-    for( size_t valueIndex = 0; valueIndex < dynInputSample.size(); valueIndex++ )
-        dynInputSample[ valueIndex ] = inputSample[ valueIndex ];
-    SimTK::Vector emgInputSample( activationFactorsList.size() );
-    for( size_t valueIndex = 0; valueIndex < emgInputSample.size(); valueIndex++ )
-        emgInputSample[ valueIndex ] = emgInputSample[ dynInputSample.size() + valueIndex ];
-    SimTK::Vector outputSample = outputSamplesList[ sampleIndex ];
-
-    SimTK::Vector calculatedOutputs = CalculateOutputs( dynInputSample, emgInputSample );
+  size_t jointsNumber = jointNamesList.size();
+  size_t sampleMomentArmsNumber = jointsNumber * musclesNumber;
+  bool hasMomentArms = isKinematicsReuseEnabled && kinematicsSamplesRevision == samplesRevision;
+  std::vector<double> calculatedOutputsList( NMS_OUTPUT_VARS_NUMBER * jointsNumber );
+  SimTK::Real samplesError = 0.0;
+  for( size_t sampleIndex = firstSampleIndex; sampleIndex < lastSampleIndex; sampleIndex++ )
+  {
+    const double* dynInputsList = GetInputSample( sampleIndex );
+    const double* emgInputsList = dynInputsList + NMS_INPUT_VARS_NUMBER * jointsNumber;
+    const double* outputsList = GetOutputSample( sampleIndex );
+    const double* momentArmsList = hasMomentArms ? momentArmsTable.data() + sampleIndex * sampleMomentArmsNumber : NULL;
+    
+    CalculateInstanceOutputs( instance, parametersList.getContiguousScalarData(), dynInputsList, emgInputsList, momentArmsList, calculatedOutputsList.data() );
     
-    for( size_t jointIndex = 0; jointIndex < actuatorsList.size(); jointIndex++ )
+    for( size_t jointIndex = 0; jointIndex < jointsNumber; jointIndex++ )
     {
       int torqueOutputIndex = jointIndex * NMS_OUTPUT_VARS_NUMBER + NMS_TORQUE_INT;
-      remainingError += std::pow( outputSample[ torqueOutputIndex ] - calculatedOutputs[ torqueOutputIndex ], 2.0 );
+      samplesError += std::pow( outputsList[ torqueOutputIndex ] - calculatedOutputsList[ torqueOutputIndex ], 2.0 );
       int stiffnessOutputIndex = jointIndex * NMS_OUTPUT_VARS_NUMBER + NMS_STIFFNESS;
-      remainingError += std::pow( outputSample[ stiffnessOutputIndex ] - calculatedOutputs[ stiffnessOutputIndex ], 2.0 );
+      samplesError += std::pow( outputsList[ stiffnessOutputIndex ] - calculatedOutputsList[ stiffnessOutputIndex ], 2.0 );
     }
+  }
+  
+  return samplesError;
+}
 
-	// Data logging for joint 0
-// 	for( int sampleIndex = 0; sampleIndex < EMG_POS_VARS_NUMBER; sampleIndex++ )
-// 	  DataLogging.RegisterValues( optimizationLog, 1, positionSample[ sampleIndex ] );
-// 	DataLogging.RegisterValues( optimizationLog, 1, torqueSample[ EMG_FORCE_VARS_NUMBER + EMG_TORQUE_EXT ] );
-// 	for( int sampleIndex = 0; sampleIndex < emgSample.size(); sampleIndex++ )
-// 	  DataLogging.RegisterValues( optimizationLog, 1, emgSample[ sampleIndex ] );
-// 	DataLogging.RegisterValues( optimizationLog, 2, torqueSample[ EMG_FORCE_VARS_NUMBER + EMG_TORQUE_EXT ], emgTorqueOutputs[ EMG_FORCE_VARS_NUMBER + EMG_TORQUE_INT ] );
-// 	DataLogging.RegisterValues( optimizationLog, 2, torqueSample[ EMG_FORCE_VARS_NUMBER + EMG_TORQUE_EXT ], emgTorqueOutputs[ EMG_FORCE_VARS_NUMBER + EMG_STIFFNESS ] );
-// 	DataLogging.EnterNewLine( optimizationLog );
+// Same as CalculateSamplesError, with activations and joint torques of all samples evaluated at once over per muscle rows
+SimTK::Real NMSProcessor::CalculateBatchSamplesError( ModelInstance& instance, const SimTK::Vector& parametersList, size_t firstSampleIndex, size_t lastSampleIndex ) const
+{
+  size_t samplesNumber = lastSampleIndex - firstSampleIndex;
+  size_t jointsNumber = jointNamesList.size();
+  size_t sampleMomentArmsNumber = jointsNumber * musclesNumber;
+  bool hasMomentArms = isKinematicsReuseEnabled && kinematicsSamplesRevision == samplesRevision;
+  const double* modelParametersList = parametersList.getContiguousScalarData();
+  
+  // Buffers only grow, so that repeated evaluations do not allocate
+  instance.batchEmgTable.resize( std::max( instance.batchEmgTable.size(), musclesNumber * samplesNumber ) );
+  instance.batchActivationsTable.resize( instance.batchEmgTable.size() );
+  instance.batchForcesTable.resize( instance.batchEmgTable.size() );
+  instance.batchMomentArmsTable.resize( std::max( instance.batchMomentArmsTable.size(), sampleMomentArmsNumber * samplesNumber ) );
+  instance.batchTorquesList.resize( std::max( instance.batchTorquesList.size(), samplesNumber ) );
+  instance.batchStiffnessesList.resize( instance.batchTorquesList.size() );
+  
+  for( size_t muscleIndex = 0; muscleIndex < musclesNumber; muscleIndex++ )
+  {
+    SamplesColumn emgInputsColumn = GetInputsColumn( NMS_INPUT_VARS_NUMBER * jointsNumber + muscleIndex );
+    for( size_t sampleIndex = 0; sampleIndex < samplesNumber; sampleIndex++ )
+      instance.batchEmgTable[ muscleIndex * samplesNumber + sampleIndex ] = emgInputsColumn[ firstSampleIndex + sampleIndex ];
   }
+  for( size_t muscleIndex = 0; muscleIndex < musclesNumber; muscleIndex++ )
+    CalculateActivationsBatch( instance.batchEmgTable.data() + muscleIndex * samplesNumber, modelParametersList[ muscleIndex * EMG_OPT_VARS_NUMBER + EMG_ACTIVATION_FACTOR ], 
+                               samplesNumber, instance.batchActivationsTable.data() + muscleIndex * samplesNumber );
+  
+  // Equilibrium is solved per sample, with results scattered into per muscle rows
+  for( size_t sampleIndex = 0; sampleIndex < samplesNumber; sampleIndex++ )
+  {
+    const double* dynInputsList = GetInputSample( firstSampleIndex + sampleIndex );
+    const double* momentArmsList = instance.momentArmsList.data();
+    if( hasMomentArms ) momentArmsList = momentArmsTable.data() + ( firstSampleIndex + sampleIndex ) * sampleMomentArmsNumber;
+    else CalculateInstanceMomentArms( instance, dynInputsList, instance.momentArmsList.data() );
+    for( size_t muscleIndex = 0; muscleIndex < musclesNumber; muscleIndex++ )
+      instance.muscleActivationsList[ muscleIndex ] = instance.batchActivationsTable[ muscleIndex * samplesNumber + sampleIndex ];
+    CalculateInstanceMuscleForces( instance, modelParametersList, dynInputsList, momentArmsList );
+    for( size_t muscleIndex = 0; muscleIndex < musclesNumber; muscleIndex++ )
+      instance.batchForcesTable[ muscleIndex * samplesNumber + sampleIndex ] = instance.muscleForcesList[ muscleIndex ];
+    for( size_t momentArmIndex = 0; momentArmIndex < sampleMomentArmsNumber; momentArmIndex++ )
+      instance.batchMomentArmsTable[ momentArmIndex * samplesNumber + sampleIndex ] = momentArmsList[ momentArmIndex ];
+  }
+  
+  SimTK::Real samplesError = 0.0;
+  for( size_t jointIndex = 0; jointIndex < jointsNumber; jointIndex++ )
+  {
+    CalculateJointTorquesBatch( instance.batchForcesTable.data(), instance.batchMomentArmsTable.data() + jointIndex * musclesNumber * samplesNumber, 
+                                musclesNumber, samplesNumber, instance.batchTorquesList.data(), instance.batchStiffnessesList.data() );
+    for( size_t sampleIndex = 0; sampleIndex < samplesNumber; sampleIndex++ )
+    {
+      const double* outputsList = GetOutputSample( firstSampleIndex + sampleIndex ) + jointIndex * NMS_OUTPUT_VARS_NUMBER;
+      samplesError += std::pow( outputsList[ NMS_TORQUE_INT ] - instance.batchTorquesList[ sampleIndex ], 2.0 );
+      samplesError += std::pow( outputsList[ NMS_STIFFNESS ] - instance.batchStiffnessesList[ sampleIndex ], 2.0 );
+    }
+  }
+  
+  return samplesError;
+}
+
+int NMSProcessor::objectiveFunc( const SimTK::Vector& parametersList, bool newCoefficients, SimTK::Real& remainingError ) const
+{
+  PrepareEvaluation();
+  
+  // Split samples among jobs, each one accumulating its own squared error
+  size_t samplesNumber = samplesCount;
+  size_t jobsNumber = workerInstancesList.size();
+  size_t jobSamplesNumber = ( samplesNumber + jobsNumber - 1 ) / jobsNumber;
+  std::vector<double> jobErrorsList( jobsNumber, 0.0 );
+  workerPool.Run( jobsNumber, [ & ]( size_t jobIndex )
+  {
+    size_t firstSampleIndex = std::min( jobIndex * jobSamplesNumber, samplesNumber );
+    size_t lastSampleIndex = std::min( ( jobIndex + 1 ) * jobSamplesNumber, samplesNumber );
+    jobErrorsList[ jobIndex ] = CalculateSamplesError( workerInstancesList[ jobIndex ], parametersList, firstSampleIndex, lastSampleIndex );
+  } );
+  
+  remainingError = 0.0;
+  for( size_t jobIndex = 0; jobIndex < jobsNumber; jobIndex++ )
+    remainingError += jobErrorsList[ jobIndex ];
 
   std::cout << "objective function error: " << remainingError << std::endl;
 
@@ -120,54 +456,39 @@ int NMSProcessor::objectiveFunc( const SimTK::Vector& parametersList, bool newCo
 
 SimTK::Vector NMSProcessor::CalculateOutputs( const SimTK::Vector& dynInputs, const SimTK::Vector& emgInputs ) const
 {
-  SimTK::State& state = internalModel.initSystem();
-  SimTK::Vector torqueInternalOutputs( NMS_OUTPUT_VARS_NUMBER * actuatorsList.size() );
+  SimTK::Vector torqueInternalOutputs( NMS_OUTPUT_VARS_NUMBER * jointNamesList.size() );
+  
+  CalculateInstanceOutputs( *controlInstance, controlInstance->modelParametersList.getContiguousScalarData(), dynInputs.getContiguousScalarData(), 
+                            emgInputs.getContiguousScalarData(), NULL, torqueInternalOutputs.updContiguousScalarData() );
+  
+  return torqueInternalOutputs;
+}
 
-  try
+void NMSProcessor::CalculateInstanceMomentArms( ModelInstance& instance, const double* dynInputsList, double* momentArmsList ) const
+{
+  SimTK::State& state = instance.workingState;
+  
+  if( isMomentArmTableEnabled || isMuscleForceEngineEnabled )
   {
-    for( size_t jointIndex = 0; jointIndex < actuatorsList.size(); jointIndex++ )
+    for( size_t jointIndex = 0; jointIndex < instance.jointCoordinatesList.size(); jointIndex++ )
     {
-      OpenSim::Coordinate* jointCoordinate = actuatorsList[ jointIndex ]->getCoordinate();
-      int dynInputsIndex = jointIndex * NMS_INPUT_VARS_NUMBER;
-      jointCoordinate->setValue( state, dynInputs[ dynInputsIndex + NMS_POSITION ] );
-      jointCoordinate->setSpeedValue( state, dynInputs[ dynInputsIndex + NMS_VELOCITY ] );
-#ifdef OSIM_LEGACY
-      actuatorsList[ jointIndex ]->setOverrideForce( state, dynInputs[ dynInputsIndex + NMS_TORQUE_EXT ] );
-#else
-      actuatorsList[ jointIndex ]->setOverrideActuation( state, dynInputs[ dynInputsIndex + NMS_TORQUE_EXT ] );
-#endif
-    }
-    OpenSim::Set<OpenSim::Muscle>& muscleSet = internalModel.updMuscles();
-    SimTK::Vector muscleForcesList( muscleSet.getSize() );
-    for( int muscleIndex = 0; muscleIndex < muscleSet.getSize(); muscleIndex++ )
-    {
-      double activation = ( std::exp( activationFactorsList[ muscleIndex ] * emgInputs[ muscleIndex ] ) - 1 ) / ( std::exp( activationFactorsList[ muscleIndex ] ) - 1 );
-#ifdef OSIM_LEGACY
-      muscleSet[ muscleIndex ].setActivation( state, activation );
-#else
-      muscleSet[ muscleIndex ].setExcitation( state, activation );
-#endif
+      for( size_t muscleIndex = 0; muscleIndex < musclesNumber; muscleIndex++ )
+        momentArmsList[ jointIndex * musclesNumber + muscleIndex ] = muscleGeometryTable.GetMomentArm( muscleIndex, jointIndex, dynInputsList[ jointIndex * NMS_INPUT_VARS_NUMBER + NMS_POSITION ] );
     }
-
-    internalModel.equilibrateMuscles( state );
-
-    for( int muscleIndex = 0; muscleIndex < muscleSet.getSize(); muscleIndex++ )
-      muscleForcesList[ muscleIndex ] = muscleSet[ muscleIndex ].getActiveFiberForce( state ) + muscleSet[ muscleIndex ].getPassiveFiberForce( state );
+    return;
+  }
   
-    for( size_t jointIndex = 0; jointIndex < actuatorsList.size(); jointIndex++ )
+  try
+  {
+    for( size_t jointIndex = 0; jointIndex < instance.jointCoordinatesList.size(); jointIndex++ )
+      instance.jointCoordinatesList[ jointIndex ]->setValue( state, dynInputsList[ jointIndex * NMS_INPUT_VARS_NUMBER + NMS_POSITION ], false );
+    instance.model->realizePosition( state );
+    
+    const OpenSim::Set<OpenSim::Muscle>& muscleSet = instance.model->getMuscles();
+    for( size_t jointIndex = 0; jointIndex < instance.jointCoordinatesList.size(); jointIndex++ )
     {
-      OpenSim::Coordinate* jointCoordinate = actuatorsList[ jointIndex ]->getCoordinate();
-      int torqueIndex = jointIndex * NMS_OUTPUT_VARS_NUMBER + NMS_TORQUE_INT;
-      int stiffnessIndex = jointIndex * NMS_OUTPUT_VARS_NUMBER + NMS_STIFFNESS;
-      torqueInternalOutputs[ torqueIndex ] = torqueInternalOutputs[ stiffnessIndex ] = 0.0;
       for( int muscleIndex = 0; muscleIndex < muscleSet.getSize(); muscleIndex++ )
-      {
-        double muscleJointMomentArm = muscleSet[ muscleIndex ].computeMomentArm( state, *jointCoordinate );
-        double muscleJointTorque = muscleForcesList[ muscleIndex ] * muscleJointMomentArm;
-        torqueInternalOutputs[ torqueIndex ] += muscleJointTorque;
-        torqueInternalOutputs[ stiffnessIndex ] += std::abs( muscleJointTorque );
-      }
-      //std::cout << "joint " << jointIndex << " torque: " << torqueInternalOutputs[ torqueIndex ] << std::endl;
+        momentArmsList[ jointIndex * muscleSet.getSize() + muscleIndex ] = muscleSet[ muscleIndex ].computeMomentArm( state, *(instance.jointCoordinatesList[ jointIndex ]) );
     }
   }
   catch( OpenSim::Exception ex )
@@ -178,6 +499,83 @@ SimTK::Vector NMSProcessor::CalculateOutputs( const SimTK::Vector& dynInputs, co
   {
     std::cout << ex.what() << std::endl;
   }
+}
+
+// Muscle force engine evaluation from instance activations, with tabulated muscle-tendon lengths
+void NMSProcessor::CalculateInstanceMuscleForces( ModelInstance& instance, const double* parametersList, const double* dynInputsList, const double* momentArmsList ) const
+{
+  size_t jointsNumber = instance.jointCoordinatesList.size();
+  // Muscle-tendon velocity from moment arms, as these are minus the length derivatives
+  for( size_t muscleIndex = 0; muscleIndex < musclesNumber; muscleIndex++ )
+  {
+    instance.muscleLengthsList[ muscleIndex ] = muscleGeometryTable.GetReferenceLength( muscleIndex );
+    instance.muscleVelocitiesList[ muscleIndex ] = 0.0;
+    for( size_t jointIndex = 0; jointIndex < jointsNumber; jointIndex++ )
+    {
+      const double* jointInputsList = dynInputsList + jointIndex * NMS_INPUT_VARS_NUMBER;
+      instance.muscleLengthsList[ muscleIndex ] += muscleGeometryTable.GetLengthOffset( muscleIndex, jointIndex, jointInputsList[ NMS_POSITION ] );
+      instance.muscleVelocitiesList[ muscleIndex ] -= momentArmsList[ jointIndex * musclesNumber + muscleIndex ] * jointInputsList[ NMS_VELOCITY ];
+    }
+  }
+  muscleForceEngine->CalculateFiberForces( parametersList, EMG_OPT_VARS_NUMBER, instance.muscleActivationsList.data(), instance.muscleLengthsList.data(), 
+                                           instance.muscleVelocitiesList.data(), instance.muscleForcesList.data() );
+}
+
+void NMSProcessor::CalculateInstanceOutputs( ModelInstance& instance, const double* parametersList, const double* dynInputsList, const double* emgInputsList, 
+                                             const double* momentArmsList, double* torqueInternalOutputsList ) const
+{
+  SimTK::State& state = instance.workingState;
+  size_t jointsNumber = instance.jointCoordinatesList.size();
   
-  return torqueInternalOutputs;
+  for( size_t muscleIndex = 0; muscleIndex < musclesNumber; muscleIndex++ )
+  {
+    double activationFactor = parametersList[ muscleIndex * EMG_OPT_VARS_NUMBER + EMG_ACTIVATION_FACTOR ];
+    instance.muscleActivationsList[ muscleIndex ] = ( std::exp( activationFactor * emgInputsList[ muscleIndex ] ) - 1 ) / ( std::exp( activationFactor ) - 1 );
+  }
+  
+  if( isMuscleForceEngineEnabled )
+  {
+    if( momentArmsList == NULL )
+    {
+      CalculateInstanceMomentArms( instance, dynInputsList, instance.momentArmsList.data() );
+      momentArmsList = instance.momentArmsList.data();
+    }
+    CalculateInstanceMuscleForces( instance, parametersList, dynInputsList, momentArmsList );
+  }
+  else
+  {
+    try
+    {
+      for( size_t jointIndex = 0; jointIndex < jointsNumber; jointIndex++ )
+      {
+        int dynInputsIndex = jointIndex * NMS_INPUT_VARS_NUMBER;
+        instance.jointCoordinatesList[ jointIndex ]->setValue( state, dynInputsList[ dynInputsIndex + NMS_POSITION ], false );
+        instance.jointCoordinatesList[ jointIndex ]->setSpeedValue( state, dynInputsList[ dynInputsIndex + NMS_VELOCITY ] );
+      }
+      OpenSim::Set<OpenSim::Muscle>& muscleSet = instance.model->updMuscles();
+      for( int muscleIndex = 0; muscleIndex < muscleSet.getSize(); muscleIndex++ )
+        SetMuscleActivation( muscleSet[ muscleIndex ], state, instance.muscleActivationsList[ muscleIndex ] );
+
+      instance.model->equilibrateMuscles( state );
+
+      for( int muscleIndex = 0; muscleIndex < muscleSet.getSize(); muscleIndex++ )
+        instance.muscleForcesList[ muscleIndex ] = muscleSet[ muscleIndex ].getActiveFiberForce( state ) + muscleSet[ muscleIndex ].getPassiveFiberForce( state );
+    }
+    catch( OpenSim::Exception ex )
+    {
+      std::cout << ex.getMessage() << std::endl;
+    }
+    catch( std::exception ex )
+    {
+      std::cout << ex.what() << std::endl;
+    }
+    // Path evaluation needs positions only, so it does not disturb the equilibrium just read
+    if( momentArmsList == NULL )
+    {
+      CalculateInstanceMomentArms( instance, dynInputsList, instance.momentArmsList.data() );
+      momentArmsList = instance.momentArmsList.data();
+    }
+  }
+  
+  sumJointTorques( instance.muscleForcesList.data(), momentArmsList, jointsNumber, musclesNumber, torqueInternalOutputsList );
 }
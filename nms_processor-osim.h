@@ -2,25 +2,80 @@
 #define NMS_PROCESSOR_H
 
 #include "nms_processor-base.h"
+#include "muscle_geometry_table.h"
+#include "muscle_force_engine.h"
+#include "controller_core.h"
 
 class NMSProcessor : public NMSProcessorBase
 {
   public:
-    /* Constructor class. Parameters accessed in objectiveFunc() class */
-    NMSProcessor( OpenSim::Model&, ActuatorsList&, const size_t );
+    /* Constructor class. Parameters accessed in objectiveFunc() class. The moment arm table and the muscle force engine are only used while 
+       their max errors, in meters and relative to max isometric force, stay within the given tolerances */
+    NMSProcessor( OpenSim::Model&, ActuatorsList&, const size_t, double momentArmTolerance = 1.0e-3, double muscleForceTolerance = 1.0e-2 );
     ~NMSProcessor();
  
     int objectiveFunc( const SimTK::Vector&, bool, SimTK::Real& ) const;
 
     SimTK::Vector CalculateOutputs( const SimTK::Vector&, const SimTK::Vector& ) const;
+    using NMSProcessorBase::CalculateOutputs;
 
     SimTK::Vector GetInitialParameters();
     void SetParameters( const SimTK::Vector& );
+    const char* GetTypeName() const;
+    void PrepareParameters( const SimTK::Vector& );
+    bool CommitParameters();
+    
+    /* Interpolate moment arms from precomputed curves instead of evaluating muscle paths */
+    void SetMomentArmTable( bool );
+    double GetMomentArmTableError() const;
+    
+    /* Solve muscle forces with the standalone Hill-type engine, over tabulated moment arms and muscle-tendon lengths */
+    void SetMuscleForceEngine( bool );
+    double GetMuscleForceEngineError() const;
+    
+  protected:
+    void PrepareEvaluation() const;
+    SimTK::Real CalculateError( const SimTK::Vector&, size_t ) const;
     
   private:
-    OpenSim::Model& internalModel;
-    ActuatorsList& actuatorsList;
-    SimTK::Vector activationFactorsList;
+    /* Model copy with its realized working state, rebuilt only when muscle properties change */
+    struct ModelInstance
+    {
+      OpenSim::Model* model;
+      SimTK::State workingState;
+      std::vector<OpenSim::Coordinate*> jointCoordinatesList;
+      SimTK::Vector modelParametersList;
+      std::vector<double> muscleActivationsList, muscleLengthsList, muscleVelocitiesList, muscleForcesList;
+      std::vector<double> momentArmsList;
+      std::vector<double> batchEmgTable, batchActivationsTable, batchForcesTable, batchMomentArmsTable, batchTorquesList, batchStiffnessesList;
+    };
+
+    void CreateInstance( ModelInstance&, const OpenSim::Model&, const SimTK::Vector& ) const;
+    void UpdateInstance( ModelInstance&, const SimTK::Vector& ) const;
+    SimTK::Real CalculateSamplesError( ModelInstance&, const SimTK::Vector&, size_t, size_t ) const;
+    SimTK::Real CalculateBatchSamplesError( ModelInstance&, const SimTK::Vector&, size_t, size_t ) const;
+    void CalculateInstanceMomentArms( ModelInstance&, const double*, double* ) const;
+    void CalculateInstanceMuscleForces( ModelInstance&, const double*, const double*, const double* ) const;
+    void CalculateInstanceOutputs( ModelInstance&, const double*, const double*, const double*, const double*, double* ) const;
+    double CalculateMuscleForceEngineError();
+
+    /* Instance used by the controller, and the next one being prepared, swapped on commit */
+    mutable ModelInstance* controlInstance;
+    ModelInstance* pendingInstance;
+    OpenSim::Model* templateModel;
+    SimTK::Vector templateParametersList;
+    mutable std::vector<ModelInstance> workerInstancesList;
+    std::vector<std::string> jointNamesList;
+    size_t musclesNumber;
+    JointTorquesFunction sumJointTorques;
+    mutable std::vector<double> momentArmsTable;
+    mutable size_t kinematicsSamplesRevision;
+    MuscleGeometryTable muscleGeometryTable;
+    double momentArmTableError, momentArmTableTolerance;
+    bool isMomentArmTableEnabled;
+    MuscleForceEngine* muscleForceEngine;
+    double muscleForceEngineError, muscleForceEngineTolerance;
+    bool isMuscleForceEngineEnabled;
 
     //Log optimizationLog;
 };
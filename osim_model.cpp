@@ -1,23 +1,37 @@
 #include <OpenSim/OpenSim.h>
 #include <OpenSim/Simulation/Model/Model.h>
 #include <OpenSim/Actuators/CoordinateActuator.h>
-#include <OpenSim/Simulation/InverseDynamicsSolver.h>
 
 #include <iostream>
 #include <string>
+#include <algorithm>
 
 #include "interface/robot_control.h"
 
+#include "controller_instance.h"
+
+#include "integration_engine.h"
+#include "inverse_dynamics_engine.h"
+#include "calibration_engine.h"
+#include "sample_queue.h"
+#include "controller_core.h"
+#include "tick_profiler.h"
+#include "model_snapshot.h"
+
 #ifndef USE_NN
   #include "nms_processor-nn.h"
 #else
   #include "nms_processor-osim.h"
 #endif
 
-struct
+struct ControllerInstance
 {
   OpenSim::Model* osimModel;
   SimTK::State state;
+  IntegrationEngine* integrator;
+  InverseDynamicsEngine* idSolver;
+  SimTK::Vector idForcesList;
+  SimTK::Vector actuatorInputs, actuatorOutputs;
   std::vector<OpenSim::CoordinateActuator*> actuatorsList;
   std::vector<int> accelerationIndexesList;
   std::vector<char*> jointNamesList;
@@ -25,128 +39,290 @@ struct
   enum ControlState controlState;
   SimTK::Vector emgInputs;
   NMSProcessor* nmsProcessor;
-}
-controller;
+  CalibrationEngine* calibrator;
+  SimTK::Vector calibratedParametersList;
+  bool isCalibrated;
+  std::string calibrationFilePath;
+  uint64_t modelHash;
+  bool isCalibrationStored, hasNewCalibration;
+  SampleRingBuffer* samplesBuffer;
+  SampleConsumer* samplesConsumer;
+  SimTK::Vector sampleInputs, sampleEMGInputs, sampleOutputs;
+  TickProfiler* tickProfiler;
+  void (*packInputs)( DoFVariables**, size_t, double* );
+  void (*unpackOutputs)( const double*, const double*, DoFVariables**, DoFVariables**, DoFVariables**, size_t );
+};
 
 
 DECLARE_MODULE_INTERFACE( ROBOT_CONTROL_INTERFACE );
 
+const IntegratorType INTEGRATOR_TYPE = INTEGRATOR_RUNGE_KUTTA_MERSON;
+const double INTEGRATOR_STEP_SIZE = 0.0; // Error controlled if not positive
+
+const size_t SAMPLES_QUEUE_CAPACITY = 256;
+#ifdef ONLINE_LEARNING_BUDGET_US
+const double ONLINE_LEARNING_BUDGET = ONLINE_LEARNING_BUDGET_US; // Microseconds per control step, disabled if not positive
+#else
+const double ONLINE_LEARNING_BUDGET = 0.0;
+#endif
+
+#ifdef TICK_LATENCIES_DUMP
+const bool DUMP_TICK_LATENCIES = true; // Print step phase latencies when the controller ends
+#else
+const bool DUMP_TICK_LATENCIES = false;
+#endif
+
+const bool REFINE_STORED_CALIBRATION = false; // Optimize again from a calibration loaded at startup, instead of using it as is
+
+// Latency statistics follow, as LATENCY_STATISTICS_NUMBER values for each step phase
+enum { CALIBRATION_RUNNING, CALIBRATION_ITERATIONS, CALIBRATION_RESIDUAL, SAMPLES_OVERRUNS, TICK_LATENCIES, 
+       EXTRA_OUTPUTS_NUMBER = TICK_LATENCIES + TICK_PHASES_NUMBER * LATENCY_STATISTICS_NUMBER };
+
+void StoreSampleRecord( Controller, const double* );
+void StoreCalibration( Controller );
 
-bool InitController( const char* data )
+// Seconds since the given phase start, which is moved to the current time
+double MeasurePhase( std::chrono::steady_clock::time_point& phaseStartTime )
+{
+  std::chrono::steady_clock::time_point phaseEndTime = std::chrono::steady_clock::now();
+  double phaseTime = std::chrono::duration<double>( phaseEndTime - phaseStartTime ).count();
+  phaseStartTime = phaseEndTime;
+  return phaseTime;
+}
+
+Controller CreateController( const char* data )
 { 
+  Controller controller = new ControllerInstance();
   try 
   {
+    std::chrono::steady_clock::time_point startupTime = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point phaseStartTime = startupTime;
+    
     // Create an OpenSim model from XML (.osim) file
-    controller.osimModel = new OpenSim::Model( std::string( "config/robots/" ) + data + ".osim" );
-    controller.osimModel->printBasicInfo( std::cout );
-    controller.osimModel->setGravity( SimTK::Vec3( 0.0, -9.80665, 0.0 ) );
-    controller.osimModel->setUseVisualizer( false ); // not for RT
+    // Controller data is the model name, optionally followed by ':' and an identifier of the subject wearing the robot
+    std::string controllerData( data );
+    size_t subjectSeparatorPosition = controllerData.find( ':' );
+    std::string modelName = controllerData.substr( 0, subjectSeparatorPosition );
+    std::string subjectName = ( subjectSeparatorPosition != std::string::npos ) ? controllerData.substr( subjectSeparatorPosition + 1 ) : "";
+    std::string modelFilePath = std::string( "config/robots/" ) + modelName + ".osim";
+    // Models of other controller instances may be loading at the same time
+    {
+      std::lock_guard<std::mutex> modelLoadingLock( NMSProcessor::modelLoadingMutex );
+      controller->osimModel = new OpenSim::Model( modelFilePath );
+    }
+    controller->osimModel->printBasicInfo( std::cout );
+    controller->osimModel->setGravity( SimTK::Vec3( 0.0, -9.80665, 0.0 ) );
+    controller->osimModel->setUseVisualizer( false ); // not for RT
+    double parsingTime = MeasurePhase( phaseStartTime );
 
     // Initialize the system
-    controller.state = controller.osimModel->initSystem();
-    std::cout << "OpenSim model loaded successfully ! (" << controller.osimModel->getNumCoordinates() << " coordinates)" << std::endl;
-    OpenSim::Set<OpenSim::Muscle> muscleSet = controller.osimModel->getMuscles();
+    {
+      std::lock_guard<std::mutex> modelLoadingLock( NMSProcessor::modelLoadingMutex );
+      controller->state = controller->osimModel->initSystem();
+    }
+    std::cout << "OpenSim model loaded successfully ! (" << controller->osimModel->getNumCoordinates() << " coordinates)" << std::endl;
+    double initializationTime = MeasurePhase( phaseStartTime );
+    const OpenSim::Set<OpenSim::Muscle>& muscleSet = controller->osimModel->getMuscles();
     for( int muscleIndex = 0; muscleIndex < muscleSet.getSize(); muscleIndex++ )
 #ifdef OSIM_LEGACY
-      muscleSet[ muscleIndex ].setDisabled( controller.state, true );
+      muscleSet[ muscleIndex ].setDisabled( controller->state, true );
 #else
-      muscleSet[ muscleIndex ].setAppliesForce( controller.state, false );
+      muscleSet[ muscleIndex ].setAppliesForce( controller->state, false );
 #endif
-    const OpenSim::Set<OpenSim::Actuator>& actuatorSet = controller.osimModel->getActuators();
-    for( int actuatorIndex = 0; actuatorIndex < actuatorSet.getSize(); actuatorIndex++ )
+    // Joint actuators and their coordinates are found once per model file version
+    ModelSnapshot modelSnapshot( modelFilePath );
+    const OpenSim::Set<OpenSim::Actuator>& actuatorSet = controller->osimModel->getActuators();
+    OpenSim::CoordinateSet& coordinateSet = controller->osimModel->updCoordinateSet();
+    std::vector<double> actuatorIndexesList;
+    bool isSnapshotLoaded = modelSnapshot.GetSection( "actuator_coordinate_indexes", actuatorIndexesList );
+    if( not isSnapshotLoaded )
     {
-      std::string actuatorName = actuatorSet[ actuatorIndex ].getName();
-      if( not muscleSet.contains( actuatorName ) )
+      for( int actuatorIndex = 0; actuatorIndex < actuatorSet.getSize(); actuatorIndex++ )
       {
-        OpenSim::CoordinateActuator* actuator = dynamic_cast<OpenSim::CoordinateActuator*>(&(actuatorSet[ actuatorIndex ]));
-        if( actuator != NULL )
-        {
+        if( muscleSet.contains( actuatorSet[ actuatorIndex ].getName() ) ) continue;
+        if( dynamic_cast<OpenSim::CoordinateActuator*>(&(actuatorSet[ actuatorIndex ])) == NULL ) continue;
+        int coordinateIndex = coordinateSet.getIndex( actuatorSet[ actuatorIndex ].getName() );
+        if( coordinateIndex < 0 ) continue;
+        actuatorIndexesList.push_back( actuatorIndex );
+        actuatorIndexesList.push_back( coordinateIndex );
+      }
+      modelSnapshot.SetSection( "actuator_coordinate_indexes", actuatorIndexesList );
+    }
+    for( size_t jointIndex = 0; jointIndex < actuatorIndexesList.size() / 2; jointIndex++ )
+    {
+      OpenSim::CoordinateActuator* actuator = static_cast<OpenSim::CoordinateActuator*>(&(actuatorSet[ (int) actuatorIndexesList[ 2 * jointIndex ] ]));
+      OpenSim::Coordinate& actuatorCoordinate = coordinateSet[ (int) actuatorIndexesList[ 2 * jointIndex + 1 ] ];
 #ifdef OSIM_LEGACY
-          actuator->overrideForce( controller.state, true );
+      actuator->overrideForce( controller->state, true );
 #else
-          actuator->overrideActuation( controller.state, true );
+      actuator->overrideActuation( controller->state, true );
 #endif
-          OpenSim::CoordinateSet coordinateSet = controller.osimModel->getCoordinateSet();
-          OpenSim::Coordinate& actuatorCoordinate = coordinateSet.get( actuator->getName() );
-          actuator->setCoordinate( &actuatorCoordinate );
-          controller.actuatorsList.push_back( actuator );
-          controller.jointNamesList.push_back( (char*) actuator->getCoordinate()->getName().c_str() );
-          controller.axisNamesList.push_back( (char*) actuator->getCoordinate()->getName().c_str() );
-          controller.accelerationIndexesList.push_back( coordinateSet.getIndex( &actuatorCoordinate ) );
-        }
-      }
+      actuator->setCoordinate( &actuatorCoordinate );
+      controller->actuatorsList.push_back( actuator );
+      controller->jointNamesList.push_back( (char*) actuator->getCoordinate()->getName().c_str() );
+      controller->axisNamesList.push_back( (char*) actuator->getCoordinate()->getName().c_str() );
+      controller->accelerationIndexesList.push_back( (int) actuatorIndexesList[ 2 * jointIndex + 1 ] );
     }
+    double discoveryTime = MeasurePhase( phaseStartTime );
     std::cout << "Initial locations taken" << std::endl;
-    controller.nmsProcessor = new NMSProcessor( *(controller.osimModel), controller.actuatorsList, 1000 );
+    controller->idSolver = new InverseDynamicsEngine( *(controller->osimModel) );
+    controller->idForcesList.resize( controller->osimModel->getNumSpeeds() );
+    controller->actuatorInputs.resize( NMS_INPUT_VARS_NUMBER * controller->actuatorsList.size() );
+    controller->actuatorOutputs.resize( NMS_OUTPUT_VARS_NUMBER * controller->actuatorsList.size() );
+    // Per step loops specialized for the model size
+    size_t musclesNumber = controller->osimModel->getMuscles().getSize();
+    controller->packInputs = SELECT_CONTROLLER_CORE( controller->actuatorsList.size(), musclesNumber, PackInputs<DoFVariables> );
+    controller->unpackOutputs = SELECT_CONTROLLER_CORE( controller->actuatorsList.size(), musclesNumber, UnpackOutputs<DoFVariables> );
+    phaseStartTime = std::chrono::steady_clock::now();
+    controller->nmsProcessor = new NMSProcessor( *(controller->osimModel), controller->actuatorsList, 1000 );
     std::cout << "Neuromusculoskeletal processor created" << std::endl;
-    SetControlState( /*CONTROL_PASSIVE*/CONTROL_PREPROCESSING );
+    double processorTime = MeasurePhase( phaseStartTime );
+    controller->calibrator = new CalibrationEngine( *(controller->nmsProcessor) );
+    // Presized, so that fetching calibrated parameters in the control loop does not allocate
+    controller->calibratedParametersList.resize( controller->nmsProcessor->getNumParameters() );
+    controller->isCalibrated = false;
+    // Calibration from a previous session of the same subject, model file and processor, used directly or as optimization starting point
+    controller->modelHash = ModelSnapshot::HashFile( modelFilePath );
+    controller->calibrationFilePath.clear();
+    if( not subjectName.empty() ) 
+      controller->calibrationFilePath = std::string( "config/robots/" ) + modelName + "-" + subjectName + "-" + controller->nmsProcessor->GetTypeName() + "-calibration.bin";
+    else
+      std::cout << "No subject identifier given, calibrations will not be stored" << std::endl;
+    controller->isCalibrationStored = not controller->calibrationFilePath.empty() 
+                                      && controller->nmsProcessor->LoadCalibration( controller->calibrationFilePath, controller->modelHash, controller->calibratedParametersList );
+    controller->hasNewCalibration = false;
+    if( controller->isCalibrationStored )
+    {
+      std::cout << "Calibration loaded from " << controller->calibrationFilePath << std::endl;
+      controller->calibrator->SetInitialParameters( controller->calibratedParametersList );
+      controller->isCalibrated = true;
+    }
+    // Samples records hold actuator inputs, EMG inputs and actuator outputs, in that order
+    controller->emgInputs = SimTK::Vector( controller->osimModel->getMuscles().getSize(), 0.0 );
+    controller->sampleInputs.resize( controller->actuatorInputs.size() );
+    controller->sampleEMGInputs.resize( controller->emgInputs.size() );
+    controller->sampleOutputs.resize( controller->actuatorOutputs.size() );
+    size_t sampleRecordSize = controller->actuatorInputs.size() + controller->emgInputs.size() + controller->actuatorOutputs.size();
+    controller->samplesBuffer = new SampleRingBuffer( sampleRecordSize, SAMPLES_QUEUE_CAPACITY );
+    controller->samplesConsumer = new SampleConsumer( *(controller->samplesBuffer), [ controller ]( const double* sampleRecord ) { StoreSampleRecord( controller, sampleRecord ); } );
+    controller->tickProfiler = new TickProfiler();
+    SetControllerState( controller, /*CONTROL_PASSIVE*/CONTROL_PREPROCESSING );
     
+    controller->integrator = new IntegrationEngine( *(controller->osimModel), INTEGRATOR_TYPE, INTEGRATOR_STEP_SIZE );
+    controller->integrator->Initialize( controller->state );
     std::cout << "OSim: integration manager created" << std::endl;
+    
+    if( not isSnapshotLoaded && not modelSnapshot.Save() ) std::cout << "Could not write model snapshot for " << modelFilePath << std::endl;
+    std::cout << "Startup times (s): model parsing " << parsingTime << ", system initialization " << initializationTime << ", actuators discovery " << discoveryTime 
+              << ( isSnapshotLoaded ? " (cached)" : "" ) << ", NMS processor " << processorTime << ", total " << MeasurePhase( startupTime ) << std::endl;
   }
   catch( OpenSim::Exception ex )
   {
     std::cout << ex.getMessage() << std::endl;
-    EndController();
-    return false;
+    DestroyController( controller );
+    return NULL;
   }
   catch( std::exception ex )
   {
     std::cout << ex.what() << std::endl;
-    EndController();
-    return false;
+    DestroyController( controller );
+    return NULL;
   }
   catch( ... )
   {
     std::cout << "UNRECOGNIZED EXCEPTION" << std::endl;
-    EndController();
-    return false;
+    DestroyController( controller );
+    return NULL;
   }
   
   std::cout << "OpenSim controller initialized successfully !" << std::endl;
   
-  return true;
+  return controller;
 }
 
-void EndController()
+void DestroyController( Controller controller )
 {
-  delete controller.osimModel;
+  if( controller == NULL ) return;
+  
+  if( controller->nmsProcessor != NULL ) StoreCalibration( controller );
+  
+  delete controller->integrator;
+  delete controller->idSolver;
   
-  controller.jointNamesList.clear();
-  controller.axisNamesList.clear();
+  delete controller->samplesConsumer;
+  delete controller->samplesBuffer;
+  delete controller->calibrator;
+  delete controller->nmsProcessor;
   
-  controller.emgInputs.clear();
+  if( DUMP_TICK_LATENCIES && controller->tickProfiler != NULL ) controller->tickProfiler->Print( std::cout );
+  delete controller->tickProfiler;
+  
+  delete controller->osimModel;
+  
+  delete controller;
 }
 
-size_t GetJointsNumber() { return (size_t) controller.jointNamesList.size(); }
+size_t GetControllerJointsNumber( Controller controller ) { return (size_t) controller->jointNamesList.size(); }
 
-const char** GetJointNamesList() { return (const char**) controller.jointNamesList.data(); }
+const char** GetControllerJointNamesList( Controller controller ) { return (const char**) controller->jointNamesList.data(); }
 
-size_t GetAxesNumber() { return (size_t) controller.axisNamesList.size(); }
+size_t GetControllerAxesNumber( Controller controller ) { return (size_t) controller->axisNamesList.size(); }
 
-const char** GetAxisNamesList() { return (const char**) controller.axisNamesList.data(); }
+const char** GetControllerAxisNamesList( Controller controller ) { return (const char**) controller->axisNamesList.data(); }
 
-size_t GetExtraInputsNumber( void ) { return controller.osimModel->getMuscles().getSize(); }
+size_t GetControllerExtraInputsNumber( Controller controller ) { return controller->osimModel->getMuscles().getSize(); }
       
-void SetExtraInputsList( double* inputsList ) 
+void SetControllerExtraInputsList( Controller controller, double* inputsList ) 
 { 
-  controller.emgInputs = SimTK::Vector( controller.osimModel->getMuscles().getSize(), inputsList );
+  // Copy in place, as this is called from the control loop
+  std::copy( inputsList, inputsList + controller->emgInputs.size(), controller->emgInputs.updContiguousScalarData() );
 }
 
-size_t GetExtraOutputsNumber( void ) { return 0; }
+size_t GetControllerExtraOutputsNumber( Controller controller ) { return EXTRA_OUTPUTS_NUMBER; }
          
-void GetExtraOutputsList( double* outputsList ) { }
-
-void SetControlState( enum ControlState newControlState )
+// Calibration progress, readable at any time without waiting for the optimizer
+void GetControllerExtraOutputsList( Controller controller, double* outputsList ) 
 { 
-  std::cout << "setting new control state: " << newControlState;
+  outputsList[ CALIBRATION_RUNNING ] = controller->calibrator->IsRunning() ? 1.0 : 0.0;
+  outputsList[ CALIBRATION_ITERATIONS ] = (double) controller->calibrator->GetIterationsCount();
+  outputsList[ CALIBRATION_RESIDUAL ] = controller->calibrator->GetResidual();
+  outputsList[ SAMPLES_OVERRUNS ] = (double) controller->samplesBuffer->GetOverrunsCount();
+  controller->tickProfiler->GetStatistics( outputsList + TICK_LATENCIES );
+}
 
-  const OpenSim::ForceSet &forceSet = controller.osimModel->getForceSet();
+void SetForcesEnabled( Controller controller, bool enabled )
+{
+  const OpenSim::ForceSet &forceSet = controller->osimModel->getForceSet();
   for( int forceIndex = 0; forceIndex < forceSet.getSize(); forceIndex++ )
 #ifdef OSIM_LEGACY
-    forceSet[ forceIndex ].setDisabled( controller.state, true );
+    forceSet[ forceIndex ].setDisabled( controller->state, not enabled );
 #else
-    forceSet[ forceIndex ].setAppliesForce( controller.state, false );
+    forceSet[ forceIndex ].setAppliesForce( controller->state, enabled );
 #endif
+}
+
+// Saved out of the control loop, on state changes and when the controller ends
+void StoreCalibration( Controller controller )
+{
+  if( not controller->hasNewCalibration || controller->calibrationFilePath.empty() ) return;
+  
+  if( controller->nmsProcessor->SaveCalibration( controller->calibrationFilePath, controller->modelHash, controller->calibratedParametersList ) )
+    std::cout << "Calibration saved to " << controller->calibrationFilePath << std::endl;
+  else
+    std::cout << "Could not write calibration to " << controller->calibrationFilePath << std::endl;
+  controller->hasNewCalibration = false;
+}
+
+void SetControllerState( Controller controller, enum ControlState newControlState )
+{ 
+  std::cout << "setting new control state: " << newControlState;
+
+  // Samples storage may be reset or optimized over below, so pending samples are stored first
+  controller->samplesConsumer->Flush();
+  
+  StoreCalibration( controller );
+
+  SetForcesEnabled( controller, false );
 
   if( newControlState == CONTROL_OFFSET )
   {
@@ -159,72 +335,58 @@ void SetControlState( enum ControlState newControlState )
   else if( newControlState == CONTROL_PREPROCESSING )
   {
     std::cout << "reseting sampling count" << std::endl;
-    controller.nmsProcessor->ResetSamplesStorage();
+    controller->calibrator->Stop();
+    controller->nmsProcessor->ResetSamplesStorage();
   }
   else 
   {
     if( newControlState == CONTROL_OPERATION )
     {
-      if( controller.controlState == CONTROL_PREPROCESSING )
-      {
-        std::cout << "starting optimization" << std::endl;
-        SimTK::Vector parametersList = controller.nmsProcessor->GetInitialParameters();
-        SimTK::Optimizer optimizer( *(controller.nmsProcessor), SimTK::LBFGSB );
-        optimizer.setConvergenceTolerance( 0.05 );
-        optimizer.useNumericalGradient( true );
-        optimizer.setMaxIterations( 1000 );
-        optimizer.setLimitedMemoryHistory( 500 );
-        SimTK::Real remainingError = optimizer.optimize( parametersList );
-        std::cout << "optimization ended with residual: " << remainingError << std::endl;
-        controller.nmsProcessor->SetParameters( parametersList );
-
-        for( int forceIndex = 0; forceIndex < forceSet.getSize(); forceIndex++ )
-#ifdef OSIM_LEGACY
-          forceSet[ forceIndex ].setDisabled( controller.state, false );
-#else
-          forceSet[ forceIndex ].setAppliesForce( controller.state, true );
-#endif
-      }
+      // Optimization runs in background: keep previous parameters meanwhile, or stay passive if there are none.
+      // A stored calibration skips it once, unless refined
+      if( controller->controlState == CONTROL_PREPROCESSING && ( REFINE_STORED_CALIBRATION || not controller->isCalibrationStored ) ) controller->calibrator->Start();
+      controller->isCalibrationStored = false;
+      if( controller->isCalibrated ) SetForcesEnabled( controller, true );
     }
   }
 
-  controller.controlState = newControlState;
+  controller->controlState = newControlState;
 }
 
 
-void PreProcessSample( SimTK::Vector& inputSample, SimTK::Vector& outputSample )
+void PreProcessSample( Controller controller, SimTK::Vector& inputSample, SimTK::Vector& outputSample )
 {
-  OpenSim::InverseDynamicsSolver idSolver( *(controller.osimModel) );
-
-  SimTK::Vector accelerationsList( controller.osimModel->getCoordinateSet().getSize(), 0.0 );
-  for( size_t jointIndex = 0; jointIndex < controller.actuatorsList.size(); jointIndex++ )
+  SimTK::Vector& accelerationsList = controller->idSolver->UpdAccelerationsList();
+  for( size_t jointIndex = 0; jointIndex < controller->actuatorsList.size(); jointIndex++ )
   {
-    OpenSim::Coordinate* jointCoordinate = controller.actuatorsList[ jointIndex ]->getCoordinate();
-    int actuatorInputsIndex = controller.emgInputs.size() + jointIndex * NMS_INPUT_VARS_NUMBER;
-    jointCoordinate->setValue( controller.state, inputSample[ actuatorInputsIndex + NMS_POSITION ] );
-    jointCoordinate->setSpeedValue( controller.state, inputSample[ actuatorInputsIndex + NMS_VELOCITY ] );
-    int jointAccelerationIndex = controller.accelerationIndexesList[ jointIndex ];
+    OpenSim::Coordinate* jointCoordinate = controller->actuatorsList[ jointIndex ]->getCoordinate();
+    int actuatorInputsIndex = jointIndex * NMS_INPUT_VARS_NUMBER;
+    jointCoordinate->setValue( controller->state, inputSample[ actuatorInputsIndex + NMS_POSITION ], false );
+    jointCoordinate->setSpeedValue( controller->state, inputSample[ actuatorInputsIndex + NMS_VELOCITY ] );
+    int jointAccelerationIndex = controller->accelerationIndexesList[ jointIndex ];
     accelerationsList[ jointAccelerationIndex ] = inputSample[ actuatorInputsIndex + NMS_ACCELERATION ];
 #ifdef OSIM_LEGACY
-    controller.actuatorsList[ jointIndex ]->setOverrideForce( controller.state, inputSample[ actuatorInputsIndex + NMS_TORQUE_EXT ] );
+    controller->actuatorsList[ jointIndex ]->setOverrideForce( controller->state, inputSample[ actuatorInputsIndex + NMS_TORQUE_EXT ] );
 #else
-    controller.actuatorsList[ jointIndex ]->setOverrideActuation( controller.state, inputSample[ actuatorInputsIndex + NMS_TORQUE_EXT ] );
+    controller->actuatorsList[ jointIndex ]->setOverrideActuation( controller->state, inputSample[ actuatorInputsIndex + NMS_TORQUE_EXT ] );
 #endif
   }
   
   try
   {
-    SimTK::Vector idForcesList = idSolver.solve( controller.state, accelerationsList );
+    controller->idSolver->Solve( controller->state, controller->idForcesList );
     
-    for( int jointIndex = 0; jointIndex < controller.actuatorsList.size(); jointIndex++ )
+    for( size_t jointIndex = 0; jointIndex < controller->actuatorsList.size(); jointIndex++ )
     {
-      int actuatorInputsIndex = controller.emgInputs.size() + jointIndex * NMS_INPUT_VARS_NUMBER;
+      int actuatorInputsIndex = jointIndex * NMS_INPUT_VARS_NUMBER;
       double positionError = inputSample[ actuatorInputsIndex + NMS_SETPOINT ] - inputSample[ actuatorInputsIndex + NMS_POSITION ];
-      int jointTorqueIndex = controller.accelerationIndexesList[ jointIndex ];
+      int jointTorqueIndex = controller->accelerationIndexesList[ jointIndex ];
+#ifdef ID_TRACING
       std::cout << "joint " << jointIndex << " coordinate index: " << jointTorqueIndex << std::endl;
+#endif
       int actuatorOutputsIndex = jointIndex * NMS_OUTPUT_VARS_NUMBER;
-      outputSample[ actuatorOutputsIndex + NMS_TORQUE_INT ] = idForcesList[ jointIndex ];
-      outputSample[ actuatorOutputsIndex + NMS_STIFFNESS ] = ( std::abs( positionError ) > 1.0e-6 ) ? idForcesList[ jointIndex ] / ( positionError ) : 100.0;
+      outputSample[ actuatorOutputsIndex + NMS_TORQUE_INT ] = controller->idForcesList[ jointTorqueIndex ];
+      outputSample[ actuatorOutputsIndex + NMS_STIFFNESS ] = ( std::abs( positionError ) > 1.0e-6 ) ? controller->idForcesList[ jointTorqueIndex ] / ( positionError ) : 100.0;
     }
   }
   catch( OpenSim::Exception ex )
@@ -237,51 +399,104 @@ void PreProcessSample( SimTK::Vector& inputSample, SimTK::Vector& outputSample )
   }
 }
 
-void RunControlStep( DoFVariables** jointMeasuresList, DoFVariables** axisMeasuresList, DoFVariables** jointSetpointsList, DoFVariables** axisSetpointsList, double timeDelta )
+// Runs on the samples consumer thread
+void StoreSampleRecord( Controller controller, const double* sampleRecord )
 {
-  controller.state.updTime() = 0.0;
+  const double* sampleEMGRecord = sampleRecord + controller->sampleInputs.size();
+  const double* sampleOutputsRecord = sampleEMGRecord + controller->sampleEMGInputs.size();
+  std::copy( sampleRecord, sampleEMGRecord, controller->sampleInputs.updContiguousScalarData() );
+  std::copy( sampleEMGRecord, sampleOutputsRecord, controller->sampleEMGInputs.updContiguousScalarData() );
+  std::copy( sampleOutputsRecord, sampleOutputsRecord + controller->sampleOutputs.size(), controller->sampleOutputs.updContiguousScalarData() );
+  controller->nmsProcessor->StoreSamples( controller->sampleInputs, controller->sampleEMGInputs, controller->sampleOutputs );
+}
 
-  SimTK::Vector actuatorInputs( NMS_INPUT_VARS_NUMBER * controller.actuatorsList.size() );
-  SimTK::Vector actuatorOutputs( NMS_OUTPUT_VARS_NUMBER * controller.actuatorsList.size() );
-  for( size_t jointIndex = 0; jointIndex < controller.actuatorsList.size(); jointIndex++ )
-  {
-    size_t actuatorInputsIndex = jointIndex * NMS_INPUT_VARS_NUMBER;
-    actuatorInputs[ actuatorInputsIndex + NMS_POSITION ] = jointMeasuresList[ jointIndex ]->position;
-    actuatorInputs[ actuatorInputsIndex + NMS_VELOCITY ] = jointMeasuresList[ jointIndex ]->velocity;
-    actuatorInputs[ actuatorInputsIndex + NMS_ACCELERATION ] = jointMeasuresList[ jointIndex ]->acceleration;
-    actuatorInputs[ actuatorInputsIndex + NMS_SETPOINT ] = jointMeasuresList[ jointIndex ]->acceleration;
-    actuatorInputs[ actuatorInputsIndex + NMS_TORQUE_EXT ] = jointMeasuresList[ jointIndex ]->force;
-  }
-  
-  PreProcessSample( actuatorInputs, actuatorOutputs );
+void RunControllerStep( Controller controller, DoFVariables** jointMeasuresList, DoFVariables** axisMeasuresList, DoFVariables** jointSetpointsList, DoFVariables** axisSetpointsList, double timeDelta )
+{
+  std::chrono::steady_clock::time_point tickStartTime = controller->tickProfiler->GetTime();
+  std::chrono::steady_clock::time_point phaseStartTime = tickStartTime;
   
-  if( controller.controlState == CONTROL_PREPROCESSING )
-    controller.nmsProcessor->StoreSamples( actuatorInputs, controller.emgInputs, actuatorOutputs );
-  else if( controller.controlState == CONTROL_OPERATION )
-    actuatorOutputs = controller.nmsProcessor->CalculateOutputs( actuatorInputs, controller.emgInputs );
+  controller->state.updTime() = 0.0;
+
+  SimTK::Vector& actuatorInputs = controller->actuatorInputs;
+  SimTK::Vector& actuatorOutputs = controller->actuatorOutputs;
+  controller->packInputs( jointMeasuresList, controller->actuatorsList.size(), actuatorInputs.updContiguousScalarData() );
+  phaseStartTime = controller->tickProfiler->RegisterPhase( TICK_INPUTS_PACKING, phaseStartTime );
   
-  OpenSim::Manager manager( *(controller.osimModel) );
-#ifdef OSIM_LEGACY
-  manager.integrate( controller.state, timeDelta );
-#else
-  controller.state = manager.integrate( timeDelta );
-#endif
+  PreProcessSample( controller, actuatorInputs, actuatorOutputs );
+  phaseStartTime = controller->tickProfiler->RegisterPhase( TICK_INVERSE_DYNAMICS, phaseStartTime );
   
-  for( size_t jointIndex = 0; jointIndex < controller.actuatorsList.size(); jointIndex++ )
+  if( controller->controlState == CONTROL_PREPROCESSING )
   {
-    size_t actuatorInputsIndex = jointIndex * NMS_INPUT_VARS_NUMBER;
-    axisMeasuresList[ jointIndex ]->position = actuatorInputs[ actuatorInputsIndex + NMS_POSITION ];
-    axisMeasuresList[ jointIndex ]->velocity = actuatorInputs[ actuatorInputsIndex + NMS_VELOCITY ];
-    axisMeasuresList[ jointIndex ]->acceleration = actuatorInputs[ actuatorInputsIndex + NMS_ACCELERATION ];
-    size_t actuatorOutputsIndex = jointIndex * NMS_OUTPUT_VARS_NUMBER;
-    axisMeasuresList[ jointIndex ]->force = actuatorOutputs[ actuatorOutputsIndex + NMS_TORQUE_INT ];
-    axisMeasuresList[ jointIndex ]->stiffness = actuatorOutputs[ actuatorOutputsIndex + NMS_STIFFNESS ];
-
-    jointSetpointsList[ jointIndex ]->position = axisSetpointsList[ jointIndex ]->position;
-    jointSetpointsList[ jointIndex ]->velocity = axisSetpointsList[ jointIndex ]->velocity;
-    jointSetpointsList[ jointIndex ]->acceleration = axisSetpointsList[ jointIndex ]->acceleration;
-    jointSetpointsList[ jointIndex ]->force = axisSetpointsList[ jointIndex ]->force;
+    // Hand samples over to the consumer thread, dropping them (counted as overruns) if it falls behind
+    double* sampleRecord = controller->samplesBuffer->AcquireWriteRecord();
+    if( sampleRecord != NULL )
+    {
+      sampleRecord = std::copy( actuatorInputs.getContiguousScalarData(), actuatorInputs.getContiguousScalarData() + actuatorInputs.size(), sampleRecord );
+      sampleRecord = std::copy( controller->emgInputs.getContiguousScalarData(), controller->emgInputs.getContiguousScalarData() + controller->emgInputs.size(), sampleRecord );
+      std::copy( actuatorOutputs.getContiguousScalarData(), actuatorOutputs.getContiguousScalarData() + actuatorOutputs.size(), sampleRecord );
+      controller->samplesBuffer->CommitWriteRecord();
+    }
   }
+  else if( controller->controlState == CONTROL_OPERATION )
+  {
+    // Swap in newly calibrated parameters between control steps, already prepared by the calibration thread
+    if( controller->calibrator->FetchParameters( controller->calibratedParametersList ) )
+    {
+      controller->nmsProcessor->CommitParameters();
+      if( not controller->isCalibrated ) SetForcesEnabled( controller, true );
+      controller->isCalibrated = true;
+      controller->hasNewCalibration = true;
+    }
+    if( controller->isCalibrated )
+    {
+      // Inverse dynamics outputs are the targets for incremental model updates, stored along with the calibration on the next state change or at the end
+      if( controller->nmsProcessor->LearnOnline( actuatorInputs, controller->emgInputs, actuatorOutputs, ONLINE_LEARNING_BUDGET ) ) controller->hasNewCalibration = true;
+      controller->nmsProcessor->CalculateOutputs( actuatorInputs, controller->emgInputs, actuatorOutputs );
+    }
+  }
+  phaseStartTime = controller->tickProfiler->RegisterPhase( TICK_NMS_OUTPUTS, phaseStartTime );
+  
+  controller->integrator->Integrate( controller->state, timeDelta );
+  phaseStartTime = controller->tickProfiler->RegisterPhase( TICK_INTEGRATION, phaseStartTime );
+  
+  controller->unpackOutputs( actuatorInputs.getContiguousScalarData(), actuatorOutputs.getContiguousScalarData(), axisMeasuresList, 
+                           jointSetpointsList, axisSetpointsList, controller->actuatorsList.size() );
+  (void) controller->tickProfiler->RegisterPhase( TICK_TOTAL, tickStartTime );
+
+  //std::cout << "joint 0 position: " << controller->actuatorsList[ 0 ]->getCoordinate()->getValue( state ) << std::endl;
+}
+
+
+// Single model module interface, forwarded to a default instance
+Controller defaultController = NULL;
+
+bool InitController( const char* data ) { return ( ( defaultController = CreateController( data ) ) != NULL ); }
+
+void EndController()
+{
+  DestroyController( defaultController );
+  defaultController = NULL;
+}
 
-  //std::cout << "joint 0 position: " << controller.actuatorsList[ 0 ]->getCoordinate()->getValue( state ) << std::endl;
+size_t GetJointsNumber() { return GetControllerJointsNumber( defaultController ); }
+
+const char** GetJointNamesList() { return GetControllerJointNamesList( defaultController ); }
+
+size_t GetAxesNumber() { return GetControllerAxesNumber( defaultController ); }
+
+const char** GetAxisNamesList() { return GetControllerAxisNamesList( defaultController ); }
+
+size_t GetExtraInputsNumber( void ) { return GetControllerExtraInputsNumber( defaultController ); }
+
+void SetExtraInputsList( double* inputsList ) { SetControllerExtraInputsList( defaultController, inputsList ); }
+
+size_t GetExtraOutputsNumber( void ) { return GetControllerExtraOutputsNumber( defaultController ); }
+
+void GetExtraOutputsList( double* outputsList ) { GetControllerExtraOutputsList( defaultController, outputsList ); }
+
+void SetControlState( enum ControlState newControlState ) { SetControllerState( defaultController, newControlState ); }
+
+void RunControlStep( DoFVariables** jointMeasuresList, DoFVariables** axisMeasuresList, DoFVariables** jointSetpointsList, DoFVariables** axisSetpointsList, double timeDelta )
+{
+  RunControllerStep( defaultController, jointMeasuresList, axisMeasuresList, jointSetpointsList, axisSetpointsList, timeDelta );
 }
@@ -8,6 +8,26 @@
 
 #include <iostream>
 #include <chrono>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <mutex>
+#include <stdexcept>
+#include <cmath>
+
+#include "integration_engine.h"
+#include "inverse_kinematics_engine.h"
+#include "sample_queue.h"
+#include "tick_profiler.h"
+#include "trajectory_recording.h"
+#include "worker_pool.h"
+
+const double SIMULATION_PERIOD_SECONDS = 0.005;
+const std::chrono::microseconds SIMULATION_PERIOD( (long) ( SIMULATION_PERIOD_SECONDS * 1e6 ) );
+const std::chrono::milliseconds RENDER_PERIOD( 33 );
+const double MAX_STEP_DELTA = 0.05; // Simulated seconds per step, so that stalls do not turn into a long integration
+const double REPORT_INTERVAL = 1.0;
+const size_t SNAPSHOTS_CAPACITY = 64;
 
 class SliderEventHandler : public SimTK::PeriodicEventHandler
 {
@@ -35,144 +55,402 @@ private:
   OpenSim::CoordinateActuator* actuator;
 };
 
+const char* REFERENCE_AXIS_NAMES[ 3 ] = { "_x", "_y", "_z" };
+
+/* Finds reference ("_ref") markers and coordinate actuators, returning the initial state with muscles disabled and actuation overridden */
+SimTK::State& InitializeModel( OpenSim::Model& osimModel, std::vector<std::string>& markerLabels, std::vector<SimTK::Vec3>& markerInitialLocations, 
+                               OpenSim::Set<OpenSim::MarkerWeight>& markerWeights, std::vector<OpenSim::CoordinateActuator*>& actuatorsList )
+{
+  osimModel.setGravity( SimTK::Vec3( 0.0, -9.80665, 0.0 ) );
+  const OpenSim::MarkerSet& markerSet = osimModel.getMarkerSet(); 
+  std::cout << "OSim: found " << markerSet.getSize() << " markers" << std::endl;
+  for( int markerIndex = 0; markerIndex < markerSet.getSize(); markerIndex++ )
+  {
+    std::string markerName = markerSet[ markerIndex ].getName();
+    if( markerName.find( "_ref" ) != std::string::npos )
+    {
+      std::cout << "OSim: found reference marker " << markerName << std::endl;
+      markerWeights.adoptAndAppend( new OpenSim::MarkerWeight( markerName, 1.0 ) );
+      markerLabels.push_back( markerName );
+    }
+  }
+  const OpenSim::Set<OpenSim::Muscle>& muscleSet = osimModel.getMuscles();
+  const OpenSim::Set<OpenSim::Actuator>& actuatorSet = osimModel.getActuators();
+  osimModel.buildSystem();
+  for( int actuatorIndex = 0; actuatorIndex < actuatorSet.getSize(); actuatorIndex++ )
+  {
+    std::string actuatorName = actuatorSet[ actuatorIndex ].getName();
+    if( not muscleSet.contains( actuatorName ) )
+    {
+      OpenSim::CoordinateActuator* actuator = dynamic_cast<OpenSim::CoordinateActuator*>(&(actuatorSet[ actuatorIndex ]));
+      if( actuator != NULL )
+      {
+        std::cout << "Found coordinate actuator " << actuator->getName() << std::endl;
+        std::cout << "Actuator coordinate: " << actuator->getCoordinate()->getName() << std::endl;
+        actuatorsList.push_back( actuator );
+      }
+    }
+  }
+  std::cout << "OpenSim model loaded successfully ! (" << osimModel.getNumCoordinates() << " coordinates)" << std::endl;
+  SimTK::State& state = osimModel.initializeState();    // Initialize the system
+  for( int muscleIndex = 0; muscleIndex < muscleSet.getSize(); muscleIndex++ )
+#ifdef OSIM_LEGACY
+    muscleSet[ muscleIndex ].setDisabled( state, true );
+#else
+    muscleSet[ muscleIndex ].setAppliesForce( state, false );
+#endif
+  for( size_t jointIndex = 0; jointIndex < actuatorsList.size(); jointIndex++ )
+  {
+#ifdef OSIM_LEGACY
+    actuatorsList[ jointIndex ]->overrideForce( state, true );
+#else
+    actuatorsList[ jointIndex ]->overrideActuation( state, true );
+#endif
+    actuatorsList[ jointIndex ]->getCoordinate()->setValue( state, 0.0 );
+  }
+  markerInitialLocations.assign( markerLabels.size(), SimTK::Vec3( 0.0 ) );
+  for( size_t markerIndex = 0; markerIndex < markerLabels.size(); markerIndex++ )
+  {
+    const OpenSim::Marker& marker = markerSet.get( markerLabels[ markerIndex ] );
+#ifdef OSIM_LEGACY
+    osimModel.getSimbodyEngine().getPosition( state, marker.getBody(), marker.getOffset(), markerInitialLocations[ markerIndex ] );
+#else
+    markerInitialLocations[ markerIndex ] = marker.getLocationInGround( state );
+#endif
+  }
+  state.setTime( 0.0 );
+  
+  return state;
+}
+
+/* Runs IK over marker setpoint trajectories, one model per worker and files taken in turn. Trajectory columns are named after 
+   the visualizer sliders (<marker>_x, _y, _z) and hold the same offsets from the initial marker locations, missing ones staying at zero.
+   Joint angles and the largest marker error of each row go to <trajectory>-joints<extension>. Returns the number of files not converted */
+size_t RunBatchIK( const std::string& modelFilePath, const std::vector<std::string>& trajectoryFilePathsList, const std::string& outputExtension, size_t workersNumber )
+{
+  if( workersNumber == 0 ) workersNumber = std::thread::hardware_concurrency();
+  WorkerPool workerPool( std::max( std::min( workersNumber, trajectoryFilePathsList.size() ), (size_t) 1 ) );
+  std::mutex modelLoadingMutex, outputMutex;
+  std::atomic<size_t> nextFileIndex( 0 ), rowsCount( 0 ), convertedFilesCount( 0 );
+  
+  std::chrono::steady_clock::time_point initialTime = std::chrono::steady_clock::now();
+  workerPool.Run( workerPool.GetWorkersNumber(), [&]( size_t workerIndex )
+  {
+    std::vector<std::string> markerLabels;
+    std::vector<SimTK::Vec3> markerInitialLocations;
+    OpenSim::Set<OpenSim::MarkerWeight> markerWeights;
+    std::vector<OpenSim::CoordinateActuator*> actuatorsList;
+    SimTK::Array_<OpenSim::CoordinateReference> coordinateReferences;
+    OpenSim::Model* osimModel = NULL;
+    SimTK::State initialState;
+    try
+    {
+      // Model parsing and system creation are not known to be thread safe, and only happen once per worker
+      std::lock_guard<std::mutex> lock( modelLoadingMutex );
+      osimModel = new OpenSim::Model( modelFilePath );
+      osimModel->setUseVisualizer( false );
+      initialState = InitializeModel( *osimModel, markerLabels, markerInitialLocations, markerWeights, actuatorsList );
+    }
+    catch( const std::exception& ex )
+    {
+      // Files are left to the other workers, and counted as failed if none of them could take them
+      std::lock_guard<std::mutex> lock( outputMutex );
+      std::cout << "worker " << workerIndex << ": " << ex.what() << std::endl;
+      delete osimModel;
+      return;
+    }
+    
+    std::vector<std::string> outputColumnNamesList( 1, "time" );
+    for( size_t jointIndex = 0; jointIndex < actuatorsList.size(); jointIndex++ )
+      outputColumnNamesList.push_back( actuatorsList[ jointIndex ]->getCoordinate()->getName() );
+    outputColumnNamesList.push_back( "marker_error" );
+    std::vector<double> outputRowList( outputColumnNamesList.size() );
+    
+    size_t fileIndex;
+    while( ( fileIndex = nextFileIndex++ ) < trajectoryFilePathsList.size() )
+    {
+      const std::string& trajectoryFilePath = trajectoryFilePathsList[ fileIndex ];
+      size_t extensionPosition = trajectoryFilePath.find_last_of( "./" );
+      if( extensionPosition == std::string::npos || trajectoryFilePath[ extensionPosition ] == '/' ) extensionPosition = trajectoryFilePath.size();
+      std::string outputFilePath = trajectoryFilePath.substr( 0, extensionPosition ) + "-joints" + ( outputExtension.empty() ? trajectoryFilePath.substr( extensionPosition ) : outputExtension );
+      std::chrono::steady_clock::time_point fileInitialTime = std::chrono::steady_clock::now();
+      TrajectoryRecording trajectory, jointsTrajectory( outputColumnNamesList );
+      double maxMarkerError = 0.0;
+      size_t skippedRowsCount = 0;
+      try
+      {
+        if( not trajectory.Load( trajectoryFilePath ) ) throw std::runtime_error( "could not read " + trajectoryFilePath );
+        size_t timeColumnIndex = trajectory.GetColumnIndex( "time" );
+        std::vector<size_t> setpointColumnIndexesList;
+        for( size_t markerIndex = 0; markerIndex < markerLabels.size(); markerIndex++ )
+        {
+          for( size_t axisIndex = 0; axisIndex < 3; axisIndex++ )
+            setpointColumnIndexesList.push_back( trajectory.GetColumnIndex( markerLabels[ markerIndex ] + REFERENCE_AXIS_NAMES[ axisIndex ] ) );
+        }
+        if( std::count( setpointColumnIndexesList.begin(), setpointColumnIndexesList.end(), TrajectoryRecording::INVALID_COLUMN ) == (long) setpointColumnIndexesList.size() )
+          throw std::runtime_error( "no marker setpoint columns" );
+        
+        // Every trajectory starts from the initial pose, so results do not depend on the files order
+        SimTK::State state = initialState;
+        InverseKinematicsEngine ikEngine( *osimModel, markerLabels, markerInitialLocations, markerWeights, coordinateReferences );
+        jointsTrajectory.Reserve( trajectory.GetRowsNumber() );
+        for( size_t rowIndex = 0; rowIndex < trajectory.GetRowsNumber(); rowIndex++ )
+        {
+          // Missing values (read as NaN) would make the solver diverge, so their rows are left out
+          bool isRowValid = true;
+          for( size_t columnIndex : setpointColumnIndexesList )
+          {
+            if( columnIndex != TrajectoryRecording::INVALID_COLUMN && not std::isfinite( trajectory.GetValue( rowIndex, columnIndex ) ) ) isRowValid = false;
+          }
+          if( not isRowValid )
+          {
+            skippedRowsCount++;
+            continue;
+          }
+          for( size_t markerIndex = 0; markerIndex < markerLabels.size(); markerIndex++ )
+          {
+            SimTK::Vec3 setpoint = markerInitialLocations[ markerIndex ];
+            for( size_t axisIndex = 0; axisIndex < 3; axisIndex++ )
+            {
+              size_t columnIndex = setpointColumnIndexesList[ 3 * markerIndex + axisIndex ];
+              if( columnIndex != TrajectoryRecording::INVALID_COLUMN ) setpoint[ axisIndex ] += trajectory.GetValue( rowIndex, columnIndex );
+            }
+            ikEngine.SetMarkerSetpoint( markerIndex, setpoint );
+          }
+          ikEngine.Solve( state );
+          
+          outputRowList[ 0 ] = ( timeColumnIndex != TrajectoryRecording::INVALID_COLUMN ) ? trajectory.GetValue( rowIndex, timeColumnIndex ) : (double) rowIndex;
+          for( size_t jointIndex = 0; jointIndex < actuatorsList.size(); jointIndex++ )
+            outputRowList[ 1 + jointIndex ] = actuatorsList[ jointIndex ]->getCoordinate()->getValue( state );
+          outputRowList.back() = ikEngine.GetMaxMarkerError();
+          maxMarkerError = std::max( maxMarkerError, outputRowList.back() );
+          jointsTrajectory.AppendRow( outputRowList.data() );
+        }
+        if( jointsTrajectory.GetRowsNumber() == 0 ) throw std::runtime_error( "no rows with valid marker setpoints" );
+        if( not jointsTrajectory.Save( outputFilePath ) ) throw std::runtime_error( "could not write " + outputFilePath );
+      }
+      catch( const std::exception& ex )
+      {
+        std::lock_guard<std::mutex> lock( outputMutex );
+        std::cout << trajectoryFilePath << ": " << ex.what() << std::endl;
+        continue;
+      }
+      rowsCount += jointsTrajectory.GetRowsNumber();
+      convertedFilesCount++;
+      
+      double fileTime = std::chrono::duration_cast<std::chrono::duration<double>>( std::chrono::steady_clock::now() - fileInitialTime ).count();
+      std::lock_guard<std::mutex> lock( outputMutex );
+      std::cout << trajectoryFilePath << " -> " << outputFilePath << ": " << jointsTrajectory.GetRowsNumber() << " rows";
+      if( skippedRowsCount > 0 ) std::cout << " (" << skippedRowsCount << " skipped)";
+      std::cout << ", " << fileTime << " s, max marker error " << maxMarkerError << std::endl;
+    }
+    
+    delete osimModel;
+  } );
+  
+  double totalTime = std::chrono::duration_cast<std::chrono::duration<double>>( std::chrono::steady_clock::now() - initialTime ).count();
+  std::cout << "batch IK: " << convertedFilesCount << "/" << trajectoryFilePathsList.size() << " files, " << rowsCount << " rows, " 
+            << workerPool.GetWorkersNumber() << " workers, " << totalTime << " s (" << rowsCount / totalTime << " rows/s)" << std::endl;
+  
+  return trajectoryFilePathsList.size() - convertedFilesCount;
+}
+
 int main( int argc, char* argv[] )
 { 
-  const char* REFERENCE_AXIS_NAMES[ 3 ] = { "_x", "_y", "_z" };
-  
   std::vector<OpenSim::CoordinateActuator*> actuatorsList;
-  std::vector<int> accelerationIndexesList;
   SimTK::Array_<OpenSim::CoordinateReference> coordinateReferences;
-  OpenSim::MarkerSet markers;
-  OpenSim::MarkersReference markersReference;
   OpenSim::Set<OpenSim::MarkerWeight> markerWeights;
-  std::vector<char*> jointNamesList;
-  std::vector<char*> axisNamesList;
   std::vector<std::string> markerLabels;
+  std::vector<SimTK::Vec3> markerInitialLocations;
+  
+  std::string modelFilePath, outputExtension;
+  size_t workersNumber = 0;
+  std::vector<std::string> trajectoryFilePathsList;
+  for( int argumentIndex = 1; argumentIndex < argc; argumentIndex++ )
+  {
+    std::string argument = argv[ argumentIndex ];
+    bool hasValue = ( argumentIndex + 1 < argc );
+    if( argument == "-j" && hasValue ) workersNumber = (size_t) atoi( argv[ ++argumentIndex ] );
+    else if( argument == "-e" && hasValue ) outputExtension = argv[ ++argumentIndex ];
+    else if( modelFilePath.empty() ) modelFilePath = argument;
+    else trajectoryFilePathsList.push_back( argument );
+  }
+  if( modelFilePath.empty() )
+  {
+    std::cout << "usage: " << argv[ 0 ] << " <model.osim> [-j workers number] [-e output extension] [marker trajectory files...]" << std::endl;
+    std::cout << "  (interactive with the visualizer, or headless batch IK over the given trajectory files)" << std::endl;
+    exit( -1 );
+  }
   
-  if( argc < 2 ) exit( -1 );
+  // Headless mode, with outputs in the format of each input unless an extension is given
+  if( not trajectoryFilePathsList.empty() )
+  {
+    size_t failuresCount = RunBatchIK( modelFilePath, trajectoryFilePathsList, outputExtension, workersNumber );
+    exit( ( failuresCount > 0 ) ? -1 : 0 );
+  }
   
   try 
   { // Create an OpenSim model from XML (.osim) file
-    OpenSim::Model osimModel( argv[ 1 ] );
+    OpenSim::Model osimModel( modelFilePath );
     osimModel.printBasicInfo( std::cout );    
-    osimModel.setGravity( SimTK::Vec3( 0.0, -9.80665, 0.0 ) );
     osimModel.setUseVisualizer( true ); // not for RT
-    OpenSim::MarkerSet& markerSet = osimModel.updMarkerSet(); 
-    std::cout << "OSim: found " << markerSet.getSize() << " markers" << std::endl;
-    for( int markerIndex = 0; markerIndex < markerSet.getSize(); markerIndex++ )
+    SimTK::State& state = InitializeModel( osimModel, markerLabels, markerInitialLocations, markerWeights, actuatorsList );
+    std::vector<SimTK::Vec3> markerSetpoints( markerLabels.size(), SimTK::Vec3( 0.0 ) );
+    for( size_t markerIndex = 0; markerIndex < markerLabels.size(); markerIndex++ )
     {
-      std::string markerName = markerSet[ markerIndex ].getName();
-      if( markerName.find( "_ref" ) != std::string::npos )
+      for( size_t axisIndex = 0; axisIndex < 3; axisIndex++ )
       {
-        std::cout << "OSim: found reference marker " << markerName << std::endl;
-        markerWeights.adoptAndAppend( new OpenSim::MarkerWeight( markerName, 1.0 ) );
-        markers.adoptAndAppend( &(markerSet[ markerIndex ]) );
-        markerLabels.push_back( markerName );
-        for( size_t referenceAxisIndex = 0; referenceAxisIndex < 3; referenceAxisIndex++ )
-        {
-          std::string markerAxisName = markerName + REFERENCE_AXIS_NAMES[ referenceAxisIndex ];
-          axisNamesList.push_back( (char*) markerAxisName.c_str() );
-        }
+        int sliderID = 3 * markerIndex + axisIndex;
+        std::string axisLabel = markerLabels[ markerIndex ] + REFERENCE_AXIS_NAMES[ axisIndex ];
+        osimModel.updVisualizer().updSimbodyVisualizer().addSlider( axisLabel, sliderID, -1.0, 1.0, 0.0 );
       }
     }
-    std::cout << "OSim: generated markers reference size" << markersReference.updMarkerWeightSet().getSize() << std::endl;
-    std::cout << "OSim: generated coordinates reference size: " << coordinateReferences.size() << std::endl;
-    const OpenSim::Set<OpenSim::Muscle> muscleSet = osimModel.getMuscles();
-    const OpenSim::Set<OpenSim::Actuator>& actuatorSet = osimModel.getActuators();
-    osimModel.buildSystem();
-    for( int actuatorIndex = 0; actuatorIndex < actuatorSet.getSize(); actuatorIndex++ )
+    SimTK::State ikState = state;
+    SimTK::State renderState = state;
+    InverseKinematicsEngine ikEngine( osimModel, markerLabels, markerInitialLocations, markerWeights, coordinateReferences );
+    IntegrationEngine integrator( osimModel );
+    integrator.Initialize( state );
+    // Marker setpoints go from the input side to the simulation one, time and coordinates come back for drawing
+    SampleRingBuffer setpointsBuffer( 3 * markerLabels.size(), SNAPSHOTS_CAPACITY );
+    SampleRingBuffer snapshotsBuffer( 1 + state.getNQ(), SNAPSHOTS_CAPACITY );
+    LatencyHistogram stepHistogram, frameHistogram;
+    std::atomic<bool> isRunning( true );
+    
+    // Fixed rate simulation, advancing the state by the measured time since the previous step
+    std::thread simulationThread( [&]()
     {
-      std::string actuatorName = actuatorSet[ actuatorIndex ].getName();
-      if( not muscleSet.contains( actuatorName ) )
+      bool hasNewSetpoints = true;
+      std::chrono::steady_clock::time_point stepTime = std::chrono::steady_clock::now();
+      std::chrono::steady_clock::time_point lastStepTime = stepTime;
+      // Exceptions would not reach the main thread handlers, so the session is ended here instead
+      try
       {
-        OpenSim::CoordinateActuator* actuator = dynamic_cast<OpenSim::CoordinateActuator*>(&(actuatorSet[ actuatorIndex ]));
-        if( actuator != NULL )
+        while( isRunning.load() )
         {
-          std::cout << "Found coordinate actuator " << actuator->getName() << std::endl;
-          std::cout << "Actuator coordinate: " << actuator->getCoordinate()->getName() << std::endl;
-          //coordinateReferences.push_back( OpenSim::CoordinateReference( actuator->getCoordinate()->getName(), OpenSim::Constant( 0.0 ) ) );
-          actuatorsList.push_back( actuator );
-          jointNamesList.push_back( (char*) actuator->getCoordinate()->getName().c_str() );
-          accelerationIndexesList.push_back( osimModel.getCoordinateSet().getIndex( actuator->getCoordinate()->getName() ) );
+          std::chrono::steady_clock::time_point stepStartTime = std::chrono::steady_clock::now();
+          const double* setpointsRecord = NULL;
+          while( ( setpointsRecord = setpointsBuffer.AcquireReadRecord() ) != NULL )
+          {
+            for( size_t markerIndex = 0; markerIndex < markerLabels.size(); markerIndex++ )
+              ikEngine.SetMarkerSetpoint( markerIndex, SimTK::Vec3( setpointsRecord[ 3 * markerIndex ], setpointsRecord[ 3 * markerIndex + 1 ], setpointsRecord[ 3 * markerIndex + 2 ] ) );
+            setpointsBuffer.ReleaseReadRecord();
+            hasNewSetpoints = true;
+          }
+          // Unchanged setpoints keep the previous solution
+          if( hasNewSetpoints )
+          {
+            ikEngine.Solve( ikState );
+            for( size_t jointIndex = 0; jointIndex < actuatorsList.size(); jointIndex++ )
+            {
+              OpenSim::Coordinate* jointCoordinate = actuatorsList[ jointIndex ]->getCoordinate();
+              jointCoordinate->setValue( state, jointCoordinate->getValue( ikState ) );
+            }
+            hasNewSetpoints = false;
+          }
+          double timeDelta = std::chrono::duration_cast<std::chrono::duration<double>>( stepStartTime - lastStepTime ).count();
+          lastStepTime = stepStartTime;
+          integrator.Integrate( state, std::min( timeDelta, MAX_STEP_DELTA ) );
+          // A slow renderer only loses snapshots, never delays the simulation
+          double* snapshotRecord = snapshotsBuffer.AcquireWriteRecord();
+          if( snapshotRecord != NULL )
+          {
+            snapshotRecord[ 0 ] = state.getTime();
+            std::copy( state.getQ().getContiguousScalarData(), state.getQ().getContiguousScalarData() + state.getNQ(), snapshotRecord + 1 );
+            snapshotsBuffer.CommitWriteRecord();
+          }
+          stepHistogram.Register( std::chrono::duration_cast<std::chrono::duration<double,std::micro>>( std::chrono::steady_clock::now() - stepStartTime ).count() );
+          // Late steps restart the schedule instead of running back to back to catch up
+          stepTime += SIMULATION_PERIOD;
+          if( stepTime < std::chrono::steady_clock::now() ) stepTime = std::chrono::steady_clock::now();
+          std::this_thread::sleep_until( stepTime );
         }
       }
-    }
-    std::cout << "OpenSim model loaded successfully ! (" << osimModel.getNumCoordinates() << " coordinates)" << std::endl;
-    SimTK::State& state = osimModel.initializeState();    // Initialize the system
-    for( int muscleIndex = 0; muscleIndex < muscleSet.getSize(); muscleIndex++ )
-#ifdef OSIM_LEGACY
-      muscleSet[ muscleIndex ].setDisabled( state, true );
-#else
-      muscleSet[ muscleIndex ].setAppliesForce( state, false );
-#endif
-    for( size_t jointIndex = 0; jointIndex < actuatorsList.size(); jointIndex++ )
-    {
-#ifdef OSIM_LEGACY
-      actuatorsList[ jointIndex ]->overrideForce( state, true );
-#else
-      actuatorsList[ jointIndex ]->overrideActuation( state, true );
-#endif
-      actuatorsList[ jointIndex ]->getCoordinate()->setValue( state, 0.0 );
-    }
-    std::vector<SimTK::Vec3> markerSetpoints( markers.getSize(), SimTK::Vec3( 0.0 ) );
-    std::vector<SimTK::Vec3> markerInitialLocations( markers.getSize(), SimTK::Vec3( 0.0 ) );
-    for( int markerIndex = 0; markerIndex < markers.getSize(); markerIndex++ )
-    {
-      for( size_t axisIndex = 0; axisIndex < 3; axisIndex++ )
+      catch( const std::exception& ex )
       {
-        int sliderID = 3 * markerIndex + axisIndex;
-        std::string axisLabel = markerLabels[ markerIndex ] + REFERENCE_AXIS_NAMES[ axisIndex ];
-        osimModel.updVisualizer().updSimbodyVisualizer().addSlider( axisLabel, sliderID, -1.0, 1.0, 0.0 );
+        std::cout << ex.what() << std::endl;
+        isRunning.store( false );
       }
-#ifdef OSIM_LEGACY
-      osimModel.getSimbodyEngine().getPosition( state, markers[ markerIndex ].getBody(), markers[ markerIndex ].getOffset(), markerInitialLocations[ markerIndex ] );
-#else
-      markerInitialLocations[ markerIndex ] = markers[ markerIndex ].getLocationInGround( state );
-#endif
-    }
-    state.setTime( 0.0 );
-    SimTK::State ikState = state;
-    std::chrono::steady_clock::time_point initialTime = std::chrono::steady_clock::now();
-    std::chrono::steady_clock::time_point simulationTime = std::chrono::steady_clock::now();
-    SimTK::Matrix_<SimTK::Vec3> markersTable( 1, markers.getSize() );
-    while( true )
+    } );
+    
+    // Input polling and drawing of the latest simulated state, until Esc is pressed
+    SimTK::Visualizer::InputSilo& inputSilo = osimModel.updVisualizer().updInputSilo();
+    std::chrono::steady_clock::time_point frameTime = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point reportTime = frameTime;
+    size_t reportStepsCount = 0, reportFramesCount = 0;
+    while( isRunning.load() )
     {
-      simulationTime = std::chrono::steady_clock::now();
-      while( osimModel.updVisualizer().updInputSilo().isAnyUserInput() ) 
+      std::chrono::steady_clock::time_point frameStartTime = std::chrono::steady_clock::now();
+      bool hasNewSetpoints = false;
+      while( inputSilo.isAnyUserInput() ) 
       {
         int sliderID;
         SimTK::Real userInputValue;
-        while( osimModel.updVisualizer().updInputSilo().takeSliderMove( sliderID, userInputValue ) )
+        while( inputSilo.takeSliderMove( sliderID, userInputValue ) )
         {
-          //std::cout << "received input on slider " << sliderID << ", marker " << sliderID / 3 << ", axis " << sliderID % 3 << std::endl;
           size_t markerIndex = (size_t) ( sliderID / 3 );
           size_t axisIndex = (size_t) ( sliderID % 3 );
           markerSetpoints[ markerIndex ][ axisIndex ] = userInputValue;
-          markersTable.set( 0, markerIndex, markerInitialLocations[ markerIndex ] + markerSetpoints[ markerIndex ] );
-          //std::cout << "setpoint ( " << markerSetpoints[ markerIndex ][ 0 ] << ", " << markerSetpoints[ markerIndex ][ 1 ] << ", " << markerSetpoints[ markerIndex ][ 2 ] << " )" << std::endl;
+          hasNewSetpoints = true;
+        }
+        unsigned keyCode, modifiers;
+        while( inputSilo.takeKeyHit( keyCode, modifiers ) )
+          if( keyCode == SimTK::Visualizer::InputListener::KeyEsc ) isRunning.store( false );
+      }
+      if( hasNewSetpoints )
+      {
+        double* setpointsRecord = setpointsBuffer.AcquireWriteRecord();
+        if( setpointsRecord != NULL )
+        {
+          for( size_t markerIndex = 0; markerIndex < markerLabels.size(); markerIndex++ )
+          {
+            for( size_t axisIndex = 0; axisIndex < 3; axisIndex++ )
+              setpointsRecord[ 3 * markerIndex + axisIndex ] = markerInitialLocations[ markerIndex ][ axisIndex ] + markerSetpoints[ markerIndex ][ axisIndex ];
+          }
+          setpointsBuffer.CommitWriteRecord();
         }
       }
-      OpenSim::TimeSeriesTableVec3 markersTimeTable( std::vector<double>( { ikState.getTime() } ), markersTable, markerLabels );
-      OpenSim::MarkersReference markersReference( markersTimeTable, &markerWeights );
-      OpenSim::InverseKinematicsSolver ikSolver( osimModel, markersReference, coordinateReferences, 0.0 );
-      ikSolver.setAccuracy( 1.0e-4 ); //std::cout << "OSim: IK solver set up" << std::endl;
-      ikSolver.assemble( ikState ); //std::cout << "OSim: IK solver assembled" << std::endl;
-      ikSolver.track( ikState );
-      std::cout << "simulation time: " << state.getTime();
-      for( size_t jointIndex = 0; jointIndex < actuatorsList.size(); jointIndex++ )
+      const double* snapshotRecord = NULL;
+      bool hasNewSnapshot = false;
+      while( ( snapshotRecord = snapshotsBuffer.AcquireReadRecord() ) != NULL )
+      {
+        renderState.setTime( snapshotRecord[ 0 ] );
+        std::copy( snapshotRecord + 1, snapshotRecord + 1 + renderState.getNQ(), renderState.updQ().updContiguousScalarData() );
+        snapshotsBuffer.ReleaseReadRecord();
+        hasNewSnapshot = true;
+      }
+      if( hasNewSnapshot )
       {
-        OpenSim::Coordinate* jointCoordinate = actuatorsList[ jointIndex ]->getCoordinate();
-        jointCoordinate->setValue( state, jointCoordinate->getValue( ikState ) );
-        //jointCoordinate->setSpeedValue( state, jointCoordinate->getSpeedValue( ikState ) );
-        //jointCoordinate->setAccelerationValue( state, jointCoordinate->getAccelerationValue( ikState ) );
-        std::cout << ", position: " << jointCoordinate->getValue( state );
+        // Setting positions invalidates the state kinematics, which drawing needs
+        osimModel.realizePosition( renderState );
+        osimModel.getVisualizer().show( renderState );
       }
-      std::cout << std::endl;
-      OpenSim::Manager manager( osimModel );
-      manager.initialize( state );
-      state = manager.integrate( std::chrono::duration_cast<std::chrono::duration<double>>( simulationTime - initialTime ).count() );
-      std::this_thread::sleep_until( simulationTime + std::chrono::milliseconds( 10 ) );      
-    }    
+      
+      std::chrono::steady_clock::time_point frameEndTime = std::chrono::steady_clock::now();
+      frameHistogram.Register( std::chrono::duration_cast<std::chrono::duration<double,std::micro>>( frameEndTime - frameStartTime ).count() );
+      double reportInterval = std::chrono::duration_cast<std::chrono::duration<double>>( frameEndTime - reportTime ).count();
+      if( reportInterval >= REPORT_INTERVAL )
+      {
+        double stepStatisticsList[ LATENCY_STATISTICS_NUMBER ], frameStatisticsList[ LATENCY_STATISTICS_NUMBER ];
+        stepHistogram.GetStatistics( stepStatisticsList );
+        frameHistogram.GetStatistics( frameStatisticsList );
+        std::cout << "simulation time: " << renderState.getTime() << ", rate: " << ( stepHistogram.GetSamplesCount() - reportStepsCount ) / reportInterval 
+                  << " steps/s (target " << 1.0 / SIMULATION_PERIOD_SECONDS << "), step latency (us) mean " << stepStatisticsList[ LATENCY_MEAN ] << ", max " << stepStatisticsList[ LATENCY_MAX ]
+                  << ", frame rate: " << ( frameHistogram.GetSamplesCount() - reportFramesCount ) / reportInterval << " frames/s, frame time (us) mean " << frameStatisticsList[ LATENCY_MEAN ] 
+                  << ", max " << frameStatisticsList[ LATENCY_MAX ];
+        for( size_t jointIndex = 0; jointIndex < actuatorsList.size(); jointIndex++ )
+          std::cout << ", position: " << actuatorsList[ jointIndex ]->getCoordinate()->getValue( renderState );
+        std::cout << std::endl;
+        reportStepsCount = stepHistogram.GetSamplesCount();
+        reportFramesCount = frameHistogram.GetSamplesCount();
+        reportTime = frameEndTime;
+      }
+      frameTime += RENDER_PERIOD;
+      if( frameTime < frameEndTime ) frameTime = frameEndTime;
+      std::this_thread::sleep_until( frameTime );
+    }
+    
+    simulationThread.join();
+    std::cout << "dropped snapshots: " << snapshotsBuffer.GetOverrunsCount() << ", dropped setpoints: " << setpointsBuffer.GetOverrunsCount() << std::endl;
   }
   catch( OpenSim::Exception ex )
   {
@@ -0,0 +1,154 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <cmath>
+#include <cstdlib>
+
+#include "robot_control_plugin.h"
+#include "trajectory_recording.h"
+#include "tick_profiler.h"
+
+const double CONTROL_PERIOD = 0.001;
+const double TRAJECTORY_AMPLITUDE = 0.5, TRAJECTORY_FREQUENCY = 0.5;
+
+/* One period of sinusoidal motion, phase shifted per joint, with rectified sines as EMG */
+TrajectoryRecording CreateSyntheticRecording( size_t jointsNumber, size_t extraInputsNumber )
+{
+  std::vector<std::string> columnNamesList = RecordedInputs( TrajectoryRecording(), jointsNumber, extraInputsNumber, CONTROL_PERIOD ).GetColumnNamesList();
+  TrajectoryRecording recording( columnNamesList );
+  
+  size_t stepsNumber = (size_t) ( 1.0 / ( TRAJECTORY_FREQUENCY * CONTROL_PERIOD ) );
+  double angularFrequency = 2 * M_PI * TRAJECTORY_FREQUENCY;
+  std::vector<double> rowValuesList( columnNamesList.size(), 0.0 );
+  recording.Reserve( stepsNumber );
+  for( size_t stepIndex = 0; stepIndex < stepsNumber; stepIndex++ )
+  {
+    double time = stepIndex * CONTROL_PERIOD;
+    rowValuesList[ 0 ] = time;
+    for( size_t jointIndex = 0; jointIndex < jointsNumber; jointIndex++ )
+    {
+      double phase = angularFrequency * time + jointIndex;
+      double* jointValuesList = rowValuesList.data() + 1 + jointIndex * RECORDED_JOINT_VARS_NUMBER;
+      jointValuesList[ RECORDED_POSITION ] = TRAJECTORY_AMPLITUDE * std::sin( phase );
+      jointValuesList[ RECORDED_VELOCITY ] = TRAJECTORY_AMPLITUDE * angularFrequency * std::cos( phase );
+      jointValuesList[ RECORDED_ACCELERATION ] = -TRAJECTORY_AMPLITUDE * angularFrequency * angularFrequency * std::sin( phase );
+    }
+    for( size_t inputIndex = 0; inputIndex < extraInputsNumber; inputIndex++ )
+      rowValuesList[ 1 + jointsNumber * RECORDED_JOINT_VARS_NUMBER + inputIndex ] = std::abs( std::sin( angularFrequency * time + inputIndex ) );
+    recording.AppendRow( rowValuesList.data() );
+  }
+  
+  return recording;
+}
+
+double GetElapsedSeconds( std::chrono::steady_clock::time_point initialTime )
+{
+  return std::chrono::duration_cast<std::chrono::duration<double>>( std::chrono::steady_clock::now() - initialTime ).count();
+}
+
+void PrintLatencies( const std::string& phaseName, const LatencyHistogram& latencyHistogram, double elapsedTime )
+{
+  double statisticsList[ LATENCY_STATISTICS_NUMBER ];
+  latencyHistogram.GetStatistics( statisticsList );
+  std::cout << "  " << phaseName << ": " << latencyHistogram.GetSamplesCount() << " steps, " << latencyHistogram.GetSamplesCount() / elapsedTime << " steps/s, latency (us) min "
+            << statisticsList[ LATENCY_MIN ] << ", mean " << statisticsList[ LATENCY_MEAN ] << ", max " << statisticsList[ LATENCY_MAX ] << ", p99 " << statisticsList[ LATENCY_P99 ] << std::endl;
+}
+
+void BenchmarkPlugin( const std::string& pluginPath, const std::string& modelName, const TrajectoryRecording& trajectory,
+                      size_t samplesNumber, size_t stepsNumber, double calibrationTimeout )
+{
+  std::cout << "plugin " << pluginPath << std::endl;
+
+  RobotControlPlugin plugin;
+  if( not LoadPlugin( pluginPath, plugin ) ) return;
+
+  std::chrono::steady_clock::time_point initialTime = std::chrono::steady_clock::now();
+  if( plugin.InitController( modelName.c_str() ) )
+  {
+    std::cout << "  initialization: " << GetElapsedSeconds( initialTime ) << " s, " << plugin.GetJointsNumber() << " joints" << std::endl;
+
+    PluginRunner runner( plugin );
+    size_t jointsNumber = runner.GetJointsNumber(), extraInputsNumber = runner.UpdExtraInputsList().size();
+    RecordedInputs inputs( ( trajectory.GetRowsNumber() > 0 ) ? trajectory : CreateSyntheticRecording( jointsNumber, extraInputsNumber ),
+                           jointsNumber, extraInputsNumber, CONTROL_PERIOD );
+    size_t stepIndex = 0;
+
+    // Sample acquisition, as fast as possible
+    LatencyHistogram samplingHistogram;
+    plugin.SetControlState( CONTROL_PREPROCESSING );
+    initialTime = std::chrono::steady_clock::now();
+    for( size_t sampleIndex = 0; sampleIndex < samplesNumber; sampleIndex++ )
+    {
+      inputs.SetStep( stepIndex++, runner );
+      samplingHistogram.Register( runner.RunStep( CONTROL_PERIOD ) );
+    }
+    PrintLatencies( "preprocessing", samplingHistogram, GetElapsedSeconds( initialTime ) );
+
+    // Background calibration, with steps paced at the control rate meanwhile
+    LatencyHistogram calibrationHistogram;
+    plugin.SetControlState( CONTROL_OPERATION );
+    initialTime = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point nextStepTime = initialTime;
+    while( runner.IsCalibrating() && GetElapsedSeconds( initialTime ) < calibrationTimeout )
+    {
+      inputs.SetStep( stepIndex++, runner );
+      calibrationHistogram.Register( runner.RunStep( CONTROL_PERIOD ) );
+      nextStepTime += std::chrono::microseconds( (long) ( CONTROL_PERIOD * 1e6 ) );
+      std::this_thread::sleep_until( nextStepTime );
+    }
+    double calibrationTime = GetElapsedSeconds( initialTime );
+    std::cout << "  calibration: " << calibrationTime << " s" << ( runner.IsCalibrating() ? " (timed out)" : "" ) << std::endl;
+    if( calibrationHistogram.GetSamplesCount() > 0 ) PrintLatencies( "calibrating operation", calibrationHistogram, calibrationTime );
+
+    // Calibrated operation, as fast as possible
+    LatencyHistogram operationHistogram;
+    initialTime = std::chrono::steady_clock::now();
+    for( size_t operationStepIndex = 0; operationStepIndex < stepsNumber; operationStepIndex++ )
+    {
+      inputs.SetStep( stepIndex++, runner );
+      operationHistogram.Register( runner.RunStep( CONTROL_PERIOD ) );
+    }
+    PrintLatencies( "operation", operationHistogram, GetElapsedSeconds( initialTime ) );
+  }
+  else
+  {
+    std::cout << "  initialization failed" << std::endl;
+  }
+
+  plugin.EndController();
+  UnloadPlugin( plugin );
+}
+
+int main( int argc, char* argv[] )
+{
+  std::string modelName = "robot_model", trajectoryFilePath;
+  long samplesNumber = 1000, stepsNumber = 10000;
+  double calibrationTimeout = 600.0;
+  std::vector<std::string> pluginPathsList;
+  for( int argumentIndex = 1; argumentIndex < argc; argumentIndex++ )
+  {
+    std::string argument = argv[ argumentIndex ];
+    bool hasValue = ( argumentIndex + 1 < argc );
+    if( argument == "-m" && hasValue ) modelName = argv[ ++argumentIndex ];
+    else if( argument == "-t" && hasValue ) trajectoryFilePath = argv[ ++argumentIndex ];
+    else if( argument == "-s" && hasValue ) samplesNumber = atol( argv[ ++argumentIndex ] );
+    else if( argument == "-n" && hasValue ) stepsNumber = atol( argv[ ++argumentIndex ] );
+    else if( argument == "-c" && hasValue ) calibrationTimeout = atof( argv[ ++argumentIndex ] );
+    else pluginPathsList.push_back( argument );
+  }
+  if( pluginPathsList.empty() || samplesNumber < 1 || stepsNumber < 1 )
+  {
+    std::cout << "usage: " << argv[ 0 ] << " [-m model name[:subject]] [-t trajectory file] [-s samples number] [-n operation steps] [-c calibration timeout] <plugin.so>..." << std::endl;
+    exit( -1 );
+  }
+
+  TrajectoryRecording trajectory;
+  if( not trajectoryFilePath.empty() && not trajectory.Load( trajectoryFilePath ) ) std::cout << "could not read " << trajectoryFilePath << ", using synthetic motion" << std::endl;
+
+  for( size_t pluginIndex = 0; pluginIndex < pluginPathsList.size(); pluginIndex++ )
+    BenchmarkPlugin( pluginPathsList[ pluginIndex ], modelName, trajectory, (size_t) samplesNumber, (size_t) stepsNumber, calibrationTimeout );
+
+  exit( 0 );
+}
@@ -0,0 +1,190 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <cmath>
+#include <cstdlib>
+
+#include "robot_control_plugin.h"
+#include "trajectory_recording.h"
+#include "tick_profiler.h"
+
+const double DEFAULT_TIME_DELTA = 0.001;
+const double CALIBRATION_POLLING_PERIOD = 0.1;
+
+enum { AXIS_POSITION, AXIS_VELOCITY, AXIS_ACCELERATION, AXIS_FORCE, AXIS_STIFFNESS, AXIS_VARS_NUMBER };
+const char* AXIS_VARIABLE_NAMES[ AXIS_VARS_NUMBER ] = { "position", "velocity", "acceleration", "force", "stiffness" };
+
+double GetElapsedSeconds( std::chrono::steady_clock::time_point initialTime )
+{
+  return std::chrono::duration_cast<std::chrono::duration<double>>( std::chrono::steady_clock::now() - initialTime ).count();
+}
+
+/* Plays every recorded step through the plugin once. Steps are paced at the recording rate times the speed factor,
+   or run as fast as possible for non-positive factors. Each step inputs and outputs are appended to the output recording, if any */
+void PlayRecording( PluginRunner& runner, const RecordedInputs& inputs, size_t stepsNumber, double speedFactor,
+                    LatencyHistogram& latencyHistogram, TrajectoryRecording* outputRecording )
+{
+  size_t inputColumnsNumber = inputs.GetColumnNamesList().size();
+  std::vector<double> rowValuesList( ( outputRecording != NULL ) ? outputRecording->GetColumnsNumber() : 0 );
+  
+  std::chrono::steady_clock::time_point nextStepTime = std::chrono::steady_clock::now();
+  for( size_t stepIndex = 0; stepIndex < stepsNumber; stepIndex++ )
+  {
+    double timeDelta = inputs.GetTimeDelta( stepIndex );
+    inputs.SetStep( stepIndex, runner );
+    double stepLatency = runner.RunStep( timeDelta );
+    latencyHistogram.Register( stepLatency );
+    
+    if( outputRecording != NULL )
+    {
+      inputs.GetRow( stepIndex, rowValuesList.data() );
+      double* outputValuesList = rowValuesList.data() + inputColumnsNumber;
+      for( size_t axisIndex = 0; axisIndex < runner.GetAxesNumber(); axisIndex++ )
+      {
+        const DoFVariables& axisMeasures = runner.GetAxisMeasures( axisIndex );
+        double axisValuesList[ AXIS_VARS_NUMBER ] = { axisMeasures.position, axisMeasures.velocity, axisMeasures.acceleration, axisMeasures.force, axisMeasures.stiffness };
+        outputValuesList = std::copy( axisValuesList, axisValuesList + AXIS_VARS_NUMBER, outputValuesList );
+      }
+      *(outputValuesList++) = stepLatency;
+      const std::vector<double>& extraOutputsList = runner.GetExtraOutputsList();
+      std::copy( extraOutputsList.begin(), extraOutputsList.end(), outputValuesList );
+      outputRecording->AppendRow( rowValuesList.data() );
+    }
+    
+    if( speedFactor > 0.0 )
+    {
+      nextStepTime += std::chrono::duration_cast<std::chrono::steady_clock::duration>( std::chrono::duration<double>( timeDelta / speedFactor ) );
+      std::this_thread::sleep_until( nextStepTime );
+    }
+  }
+}
+
+/* Root mean square difference between simulated axis forces and recorded reference torques, per joint */
+void PrintTorqueErrors( const RecordedInputs& inputs, const TrajectoryRecording& outputRecording, size_t jointsNumber )
+{
+  size_t inputColumnsNumber = inputs.GetColumnNamesList().size();
+  for( size_t jointIndex = 0; jointIndex < jointsNumber; jointIndex++ )
+  {
+    double squaredErrorsSum = 0.0;
+    size_t forceColumn = inputColumnsNumber + jointIndex * AXIS_VARS_NUMBER + AXIS_FORCE;
+    for( size_t stepIndex = 0; stepIndex < outputRecording.GetRowsNumber(); stepIndex++ )
+    {
+      double torqueError = outputRecording.GetValue( stepIndex, forceColumn ) - inputs.GetJointValue( stepIndex, jointIndex, RECORDED_REFERENCE_TORQUE );
+      squaredErrorsSum += torqueError * torqueError;
+    }
+    std::cout << "  joint " << jointIndex << " torque RMS error: " << std::sqrt( squaredErrorsSum / outputRecording.GetRowsNumber() ) << std::endl;
+  }
+}
+
+int main( int argc, char* argv[] )
+{
+  std::string modelName = "robot_model", outputFilePath;
+  long samplesNumber = 0;
+  double speedFactor = 0.0, defaultTimeDelta = DEFAULT_TIME_DELTA, calibrationTimeout = 600.0;
+  std::vector<std::string> filePathsList;
+  for( int argumentIndex = 1; argumentIndex < argc; argumentIndex++ )
+  {
+    std::string argument = argv[ argumentIndex ];
+    bool hasValue = ( argumentIndex + 1 < argc );
+    if( argument == "-m" && hasValue ) modelName = argv[ ++argumentIndex ];
+    else if( argument == "-o" && hasValue ) outputFilePath = argv[ ++argumentIndex ];
+    else if( argument == "-s" && hasValue ) samplesNumber = atol( argv[ ++argumentIndex ] );
+    else if( argument == "-x" && hasValue ) speedFactor = atof( argv[ ++argumentIndex ] );
+    else if( argument == "-d" && hasValue ) defaultTimeDelta = atof( argv[ ++argumentIndex ] );
+    else if( argument == "-c" && hasValue ) calibrationTimeout = atof( argv[ ++argumentIndex ] );
+    else filePathsList.push_back( argument );
+  }
+  if( filePathsList.size() != 2 )
+  {
+    std::cout << "usage: " << argv[ 0 ] << " [-m model name[:subject]] [-o output recording] [-s calibration samples (0: whole recording, -1: none)] [-x speed factor (0: unpaced)]"
+              << " [-d default time step] [-c calibration timeout] <plugin.so> <recording(.csv)>" << std::endl;
+    exit( -1 );
+  }
+  
+  TrajectoryRecording recording;
+  if( not recording.Load( filePathsList[ 1 ] ) || recording.GetRowsNumber() == 0 )
+  {
+    std::cout << "could not read " << filePathsList[ 1 ] << std::endl;
+    exit( -1 );
+  }
+  
+  RobotControlPlugin plugin;
+  if( not LoadPlugin( filePathsList[ 0 ], plugin ) ) exit( -1 );
+  
+  if( plugin.InitController( modelName.c_str() ) )
+  {
+    PluginRunner runner( plugin );
+    size_t jointsNumber = runner.GetJointsNumber();
+    RecordedInputs inputs( recording, jointsNumber, runner.UpdExtraInputsList().size(), defaultTimeDelta );
+    std::cout << "replaying " << inputs.GetStepsNumber() << " steps (" << inputs.GetTime( inputs.GetStepsNumber() - 1 ) - inputs.GetTime( 0 ) << " s) over "
+              << jointsNumber << " joints" << std::endl;
+    
+    // Sampling pass over the recording start, followed by calibration with playback held
+    // Negative counts skip calibration
+    if( samplesNumber >= 0 )
+    {
+      if( samplesNumber == 0 || (size_t) samplesNumber > inputs.GetStepsNumber() ) samplesNumber = (long) inputs.GetStepsNumber();
+      LatencyHistogram samplingHistogram;
+      plugin.SetControlState( CONTROL_PREPROCESSING );
+      PlayRecording( runner, inputs, (size_t) samplesNumber, speedFactor, samplingHistogram, NULL );
+      
+      plugin.SetControlState( CONTROL_OPERATION );
+      std::chrono::steady_clock::time_point initialTime = std::chrono::steady_clock::now();
+      while( runner.IsCalibrating() && GetElapsedSeconds( initialTime ) < calibrationTimeout )
+        std::this_thread::sleep_for( std::chrono::duration<double>( CALIBRATION_POLLING_PERIOD ) );
+      std::cout << "  calibration over " << samplesNumber << " samples: " << GetElapsedSeconds( initialTime ) << " s" << ( runner.IsCalibrating() ? " (timed out)" : "" ) << std::endl;
+    }
+    else
+    {
+      // Controllers start in preprocessing, and going from there to operation would calibrate over no samples
+      plugin.SetControlState( CONTROL_PASSIVE );
+      plugin.SetControlState( CONTROL_OPERATION );
+      std::cout << "  calibration skipped: using stored parameters, if any" << std::endl;
+    }
+    
+    std::vector<std::string> columnNamesList = inputs.GetColumnNamesList();
+    for( size_t axisIndex = 0; axisIndex < runner.GetAxesNumber(); axisIndex++ )
+    {
+      for( size_t variableIndex = 0; variableIndex < AXIS_VARS_NUMBER; variableIndex++ )
+      {
+        std::ostringstream columnName;
+        columnName << "axis" << axisIndex << "_" << AXIS_VARIABLE_NAMES[ variableIndex ];
+        columnNamesList.push_back( columnName.str() );
+      }
+    }
+    columnNamesList.push_back( "step_latency" );
+    for( size_t outputIndex = 0; outputIndex < runner.GetExtraOutputsList().size(); outputIndex++ )
+    {
+      std::ostringstream columnName;
+      columnName << "extra_output" << outputIndex;
+      columnNamesList.push_back( columnName.str() );
+    }
+    TrajectoryRecording outputRecording( columnNamesList );
+    outputRecording.Reserve( inputs.GetStepsNumber() );
+    
+    LatencyHistogram operationHistogram;
+    std::chrono::steady_clock::time_point initialTime = std::chrono::steady_clock::now();
+    PlayRecording( runner, inputs, inputs.GetStepsNumber(), speedFactor, operationHistogram, &outputRecording );
+    double elapsedTime = GetElapsedSeconds( initialTime );
+    
+    double statisticsList[ LATENCY_STATISTICS_NUMBER ];
+    operationHistogram.GetStatistics( statisticsList );
+    std::cout << "  operation: " << elapsedTime << " s (" << ( inputs.GetTime( inputs.GetStepsNumber() - 1 ) - inputs.GetTime( 0 ) ) / elapsedTime << "x real time), latency (us) min "
+              << statisticsList[ LATENCY_MIN ] << ", mean " << statisticsList[ LATENCY_MEAN ] << ", max " << statisticsList[ LATENCY_MAX ] << ", p99 " << statisticsList[ LATENCY_P99 ] << std::endl;
+    if( inputs.HasReferenceTorques() ) PrintTorqueErrors( inputs, outputRecording, std::min( jointsNumber, runner.GetAxesNumber() ) );
+    
+    if( not outputFilePath.empty() && not outputRecording.Save( outputFilePath ) ) std::cout << "could not write " << outputFilePath << std::endl;
+  }
+  else
+  {
+    std::cout << "initialization failed" << std::endl;
+  }
+  
+  plugin.EndController();
+  UnloadPlugin( plugin );
+  
+  exit( 0 );
+}
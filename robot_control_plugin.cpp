@@ -0,0 +1,210 @@
+#include "robot_control_plugin.h"
+
+#include <iostream>
+#include <sstream>
+#include <chrono>
+#include <algorithm>
+
+#include <dlfcn.h>
+
+const size_t CALIBRATION_RUNNING_OUTPUT = 0; // First extra output of the NMS plugins
+
+template <typename FunctionType> bool LoadFunction( void* handle, const char* functionName, FunctionType& function )
+{
+  function = (FunctionType) dlsym( handle, functionName );
+  if( function == NULL ) std::cout << "missing plugin function " << functionName << std::endl;
+  return ( function != NULL );
+}
+
+bool LoadPlugin( const std::string& pluginPath, RobotControlPlugin& plugin )
+{
+  plugin.handle = dlopen( pluginPath.c_str(), RTLD_NOW | RTLD_LOCAL );
+  if( plugin.handle == NULL )
+  {
+    std::cout << "could not load " << pluginPath << ": " << dlerror() << std::endl;
+    return false;
+  }
+
+  bool isLoaded = LoadFunction( plugin.handle, "InitController", plugin.InitController );
+  isLoaded = LoadFunction( plugin.handle, "EndController", plugin.EndController ) && isLoaded;
+  isLoaded = LoadFunction( plugin.handle, "GetJointsNumber", plugin.GetJointsNumber ) && isLoaded;
+  isLoaded = LoadFunction( plugin.handle, "GetAxesNumber", plugin.GetAxesNumber ) && isLoaded;
+  isLoaded = LoadFunction( plugin.handle, "GetExtraInputsNumber", plugin.GetExtraInputsNumber ) && isLoaded;
+  isLoaded = LoadFunction( plugin.handle, "SetExtraInputsList", plugin.SetExtraInputsList ) && isLoaded;
+  isLoaded = LoadFunction( plugin.handle, "GetExtraOutputsNumber", plugin.GetExtraOutputsNumber ) && isLoaded;
+  isLoaded = LoadFunction( plugin.handle, "GetExtraOutputsList", plugin.GetExtraOutputsList ) && isLoaded;
+  isLoaded = LoadFunction( plugin.handle, "SetControlState", plugin.SetControlState ) && isLoaded;
+  isLoaded = LoadFunction( plugin.handle, "RunControlStep", plugin.RunControlStep ) && isLoaded;
+  if( not isLoaded ) dlclose( plugin.handle );
+
+  return isLoaded;
+}
+
+void UnloadPlugin( RobotControlPlugin& plugin )
+{
+  dlclose( plugin.handle );
+  plugin.handle = NULL;
+}
+
+PluginRunner::PluginRunner( RobotControlPlugin& plugin ) : plugin( plugin )
+{
+  size_t jointsNumber = plugin.GetJointsNumber();
+  size_t axesNumber = plugin.GetAxesNumber();
+  jointMeasuresList.resize( jointsNumber );
+  jointSetpointsList.resize( jointsNumber );
+  axisMeasuresList.resize( axesNumber );
+  axisSetpointsList.resize( axesNumber );
+  for( size_t jointIndex = 0; jointIndex < jointsNumber; jointIndex++ )
+  {
+    jointMeasuresPointersList.push_back( &(jointMeasuresList[ jointIndex ]) );
+    jointSetpointsPointersList.push_back( &(jointSetpointsList[ jointIndex ]) );
+  }
+  for( size_t axisIndex = 0; axisIndex < axesNumber; axisIndex++ )
+  {
+    axisMeasuresPointersList.push_back( &(axisMeasuresList[ axisIndex ]) );
+    axisSetpointsPointersList.push_back( &(axisSetpointsList[ axisIndex ]) );
+  }
+  extraInputsList.resize( plugin.GetExtraInputsNumber() );
+  extraOutputsList.resize( plugin.GetExtraOutputsNumber() );
+}
+
+double PluginRunner::RunStep( double timeDelta )
+{
+  std::chrono::steady_clock::time_point stepStartTime = std::chrono::steady_clock::now();
+  if( not extraInputsList.empty() ) plugin.SetExtraInputsList( extraInputsList.data() );
+  plugin.RunControlStep( jointMeasuresPointersList.data(), axisMeasuresPointersList.data(), jointSetpointsPointersList.data(), axisSetpointsPointersList.data(), timeDelta );
+  return std::chrono::duration<double, std::micro>( std::chrono::steady_clock::now() - stepStartTime ).count();
+}
+
+const std::vector<double>& PluginRunner::GetExtraOutputsList()
+{
+  if( not extraOutputsList.empty() ) plugin.GetExtraOutputsList( extraOutputsList.data() );
+  return extraOutputsList;
+}
+
+bool PluginRunner::IsCalibrating()
+{
+  if( extraOutputsList.size() <= CALIBRATION_RUNNING_OUTPUT ) return false;
+  return ( GetExtraOutputsList()[ CALIBRATION_RUNNING_OUTPUT ] > 0.0 );
+}
+
+const char* JOINT_VARIABLE_NAMES[ RECORDED_JOINT_VARS_NUMBER ] = { "position", "velocity", "acceleration", "force", "reference_torque" };
+
+std::string GetJointColumnName( size_t jointIndex, size_t variableIndex )
+{
+  std::ostringstream columnName;
+  columnName << "joint" << jointIndex << "_" << JOINT_VARIABLE_NAMES[ variableIndex ];
+  return columnName.str();
+}
+
+std::string GetEMGColumnName( size_t inputIndex )
+{
+  std::ostringstream columnName;
+  columnName << "emg" << inputIndex;
+  return columnName.str();
+}
+
+// Central differences inside, one sided at the ends
+void Differentiate( const std::vector<double>& timesList, size_t stride, size_t offset, size_t derivativeOffset, std::vector<double>& valuesTable )
+{
+  size_t stepsNumber = timesList.size();
+  if( stepsNumber < 2 ) return;
+  for( size_t stepIndex = 0; stepIndex < stepsNumber; stepIndex++ )
+  {
+    size_t previousIndex = ( stepIndex > 0 ) ? stepIndex - 1 : stepIndex;
+    size_t nextIndex = ( stepIndex < stepsNumber - 1 ) ? stepIndex + 1 : stepIndex;
+    double timeDelta = timesList[ nextIndex ] - timesList[ previousIndex ];
+    double valueDelta = valuesTable[ nextIndex * stride + offset ] - valuesTable[ previousIndex * stride + offset ];
+    valuesTable[ stepIndex * stride + derivativeOffset ] = ( timeDelta > 0.0 ) ? valueDelta / timeDelta : 0.0;
+  }
+}
+
+RecordedInputs::RecordedInputs( const TrajectoryRecording& recording, size_t jointsNumber, size_t extraInputsNumber, double defaultTimeDelta )
+: jointsNumber( jointsNumber ), extraInputsNumber( extraInputsNumber ), defaultTimeDelta( defaultTimeDelta ), hasReferenceTorques( false )
+{
+  size_t stepsNumber = recording.GetRowsNumber();
+  
+  size_t timeColumn = recording.GetColumnIndex( "time" );
+  timesList.resize( stepsNumber );
+  for( size_t stepIndex = 0; stepIndex < stepsNumber; stepIndex++ )
+    timesList[ stepIndex ] = ( timeColumn != TrajectoryRecording::INVALID_COLUMN ) ? recording.GetValue( stepIndex, timeColumn ) : stepIndex * defaultTimeDelta;
+  
+  size_t jointStride = jointsNumber * RECORDED_JOINT_VARS_NUMBER;
+  jointValuesTable.assign( stepsNumber * jointStride, 0.0 );
+  for( size_t jointIndex = 0; jointIndex < jointsNumber; jointIndex++ )
+  {
+    bool hasColumnsList[ RECORDED_JOINT_VARS_NUMBER ];
+    for( size_t variableIndex = 0; variableIndex < RECORDED_JOINT_VARS_NUMBER; variableIndex++ )
+    {
+      size_t column = recording.GetColumnIndex( GetJointColumnName( jointIndex, variableIndex ) );
+      hasColumnsList[ variableIndex ] = ( column != TrajectoryRecording::INVALID_COLUMN );
+      if( not hasColumnsList[ variableIndex ] ) continue;
+      for( size_t stepIndex = 0; stepIndex < stepsNumber; stepIndex++ )
+        jointValuesTable[ stepIndex * jointStride + jointIndex * RECORDED_JOINT_VARS_NUMBER + variableIndex ] = recording.GetValue( stepIndex, column );
+    }
+    
+    size_t jointOffset = jointIndex * RECORDED_JOINT_VARS_NUMBER;
+    if( not hasColumnsList[ RECORDED_VELOCITY ] ) Differentiate( timesList, jointStride, jointOffset + RECORDED_POSITION, jointOffset + RECORDED_VELOCITY, jointValuesTable );
+    if( not hasColumnsList[ RECORDED_ACCELERATION ] ) Differentiate( timesList, jointStride, jointOffset + RECORDED_VELOCITY, jointOffset + RECORDED_ACCELERATION, jointValuesTable );
+    if( hasColumnsList[ RECORDED_REFERENCE_TORQUE ] ) hasReferenceTorques = true;
+  }
+  
+  extraInputsTable.assign( stepsNumber * extraInputsNumber, 0.0 );
+  for( size_t inputIndex = 0; inputIndex < extraInputsNumber; inputIndex++ )
+  {
+    size_t column = recording.GetColumnIndex( GetEMGColumnName( inputIndex ) );
+    if( column == TrajectoryRecording::INVALID_COLUMN ) continue;
+    for( size_t stepIndex = 0; stepIndex < stepsNumber; stepIndex++ )
+      extraInputsTable[ stepIndex * extraInputsNumber + inputIndex ] = recording.GetValue( stepIndex, column );
+  }
+}
+
+double RecordedInputs::GetTimeDelta( size_t stepIndex ) const
+{
+  if( stepIndex == 0 || stepIndex >= timesList.size() ) return defaultTimeDelta;
+  double timeDelta = timesList[ stepIndex ] - timesList[ stepIndex - 1 ];
+  return ( timeDelta > 0.0 ) ? timeDelta : defaultTimeDelta;
+}
+
+void RecordedInputs::SetStep( size_t stepIndex, PluginRunner& runner ) const
+{
+  if( timesList.empty() ) return;
+  stepIndex = stepIndex % timesList.size();
+  
+  for( size_t jointIndex = 0; jointIndex < jointsNumber && jointIndex < runner.GetJointsNumber(); jointIndex++ )
+  {
+    DoFVariables& jointMeasures = runner.UpdJointMeasures( jointIndex );
+    jointMeasures.position = GetJointValue( stepIndex, jointIndex, RECORDED_POSITION );
+    jointMeasures.velocity = GetJointValue( stepIndex, jointIndex, RECORDED_VELOCITY );
+    jointMeasures.acceleration = GetJointValue( stepIndex, jointIndex, RECORDED_ACCELERATION );
+    jointMeasures.force = GetJointValue( stepIndex, jointIndex, RECORDED_FORCE );
+  }
+  
+  std::vector<double>& extraInputsList = runner.UpdExtraInputsList();
+  const double* stepExtraInputsList = extraInputsTable.data() + stepIndex * extraInputsNumber;
+  for( size_t inputIndex = 0; inputIndex < extraInputsNumber && inputIndex < extraInputsList.size(); inputIndex++ )
+    extraInputsList[ inputIndex ] = stepExtraInputsList[ inputIndex ];
+}
+
+std::vector<std::string> RecordedInputs::GetColumnNamesList() const
+{
+  std::vector<std::string> columnNamesList( 1, "time" );
+  for( size_t jointIndex = 0; jointIndex < jointsNumber; jointIndex++ )
+  {
+    for( size_t variableIndex = 0; variableIndex < RECORDED_JOINT_VARS_NUMBER; variableIndex++ )
+      columnNamesList.push_back( GetJointColumnName( jointIndex, variableIndex ) );
+  }
+  for( size_t inputIndex = 0; inputIndex < extraInputsNumber; inputIndex++ )
+    columnNamesList.push_back( GetEMGColumnName( inputIndex ) );
+  
+  return columnNamesList;
+}
+
+void RecordedInputs::GetRow( size_t stepIndex, double* valuesList ) const
+{
+  valuesList[ 0 ] = timesList[ stepIndex ];
+  const double* stepJointValuesList = jointValuesTable.data() + stepIndex * jointsNumber * RECORDED_JOINT_VARS_NUMBER;
+  std::copy( stepJointValuesList, stepJointValuesList + jointsNumber * RECORDED_JOINT_VARS_NUMBER, valuesList + 1 );
+  const double* stepExtraInputsList = extraInputsTable.data() + stepIndex * extraInputsNumber;
+  std::copy( stepExtraInputsList, stepExtraInputsList + extraInputsNumber, valuesList + 1 + jointsNumber * RECORDED_JOINT_VARS_NUMBER );
+}
@@ -0,0 +1,92 @@
+#ifndef ROBOT_CONTROL_PLUGIN_H
+#define ROBOT_CONTROL_PLUGIN_H
+
+#include <string>
+#include <vector>
+
+#include "interface/robot_control.h"
+
+#include "trajectory_recording.h"
+
+/* Module functions, resolved by name as the control host does */
+struct RobotControlPlugin
+{
+  void* handle;
+  bool (*InitController)( const char* );
+  void (*EndController)( void );
+  size_t (*GetJointsNumber)( void );
+  size_t (*GetAxesNumber)( void );
+  size_t (*GetExtraInputsNumber)( void );
+  void (*SetExtraInputsList)( double* );
+  size_t (*GetExtraOutputsNumber)( void );
+  void (*GetExtraOutputsList)( double* );
+  void (*SetControlState)( enum ControlState );
+  void (*RunControlStep)( DoFVariables**, DoFVariables**, DoFVariables**, DoFVariables**, double );
+};
+
+bool LoadPlugin( const std::string&, RobotControlPlugin& );
+void UnloadPlugin( RobotControlPlugin& );
+
+/* Owns the DoF variables passed to the plugin and drives its control steps, as the control host would */
+class PluginRunner
+{
+  public:
+    PluginRunner( RobotControlPlugin& );
+
+    inline size_t GetJointsNumber() const { return jointMeasuresList.size(); }
+    inline size_t GetAxesNumber() const { return axisMeasuresList.size(); }
+    inline DoFVariables& UpdJointMeasures( size_t jointIndex ) { return jointMeasuresList[ jointIndex ]; }
+    inline const DoFVariables& GetAxisMeasures( size_t axisIndex ) const { return axisMeasuresList[ axisIndex ]; }
+    inline std::vector<double>& UpdExtraInputsList() { return extraInputsList; }
+
+    /* Single control step, returning its latency in microseconds */
+    double RunStep( double );
+
+    /* Refreshed from the plugin on each call */
+    const std::vector<double>& GetExtraOutputsList();
+    bool IsCalibrating();
+
+  private:
+    RobotControlPlugin& plugin;
+    std::vector<DoFVariables> jointMeasuresList, jointSetpointsList, axisMeasuresList, axisSetpointsList;
+    std::vector<DoFVariables*> jointMeasuresPointersList, jointSetpointsPointersList, axisMeasuresPointersList, axisSetpointsPointersList;
+    std::vector<double> extraInputsList, extraOutputsList;
+};
+
+enum { RECORDED_POSITION, RECORDED_VELOCITY, RECORDED_ACCELERATION, RECORDED_FORCE, RECORDED_REFERENCE_TORQUE, RECORDED_JOINT_VARS_NUMBER };
+
+/* Plugin inputs taken from recording columns named "time", "joint<j>_<position|velocity|acceleration|force|reference_torque>" and "emg<i>".
+   Missing velocities and accelerations are derived from positions by finite differences, other missing columns read as zero */
+class RecordedInputs
+{
+  public:
+    /* Default time step used when there is no time column */
+    RecordedInputs( const TrajectoryRecording&, size_t, size_t, double );
+
+    inline size_t GetStepsNumber() const { return timesList.size(); }
+    inline double GetTime( size_t stepIndex ) const { return timesList[ stepIndex ]; }
+    /* Time elapsed since the previous step (default step for the first one) */
+    double GetTimeDelta( size_t ) const;
+    inline double GetJointValue( size_t stepIndex, size_t jointIndex, size_t variableIndex ) const
+    {
+      return jointValuesTable[ ( stepIndex * jointsNumber + jointIndex ) * RECORDED_JOINT_VARS_NUMBER + variableIndex ];
+    }
+    inline bool HasReferenceTorques() const { return hasReferenceTorques; }
+
+    /* Copies the given (cycled) step values to the runner measures and extra inputs */
+    void SetStep( size_t, PluginRunner& ) const;
+
+    /* Column names and values of the inputs fed at each step, for output recordings */
+    std::vector<std::string> GetColumnNamesList() const;
+    void GetRow( size_t, double* ) const;
+
+  private:
+    size_t jointsNumber, extraInputsNumber;
+    double defaultTimeDelta;
+    bool hasReferenceTorques;
+    std::vector<double> timesList;
+    std::vector<double> jointValuesTable;
+    std::vector<double> extraInputsTable;
+};
+
+#endif // ROBOT_CONTROL_PLUGIN_H
@@ -0,0 +1,87 @@
+#include "sample_queue.h"
+
+#include <chrono>
+
+const std::chrono::microseconds CONSUMER_IDLE_TIME( 500 );
+
+// One slot is kept free to tell a full ring from an empty one
+SampleRingBuffer::SampleRingBuffer( size_t recordSize, size_t capacity )
+: RECORD_SIZE( recordSize ), CAPACITY( capacity + 1 ), writeIndex( 0 ), readIndex( 0 ), overrunsCount( 0 )
+{
+  recordsTable.resize( RECORD_SIZE * CAPACITY );
+}
+
+SampleRingBuffer::~SampleRingBuffer() { }
+
+size_t SampleRingBuffer::GetRecordSize() const { return RECORD_SIZE; }
+
+double* SampleRingBuffer::AcquireWriteRecord()
+{
+  size_t currentWriteIndex = writeIndex.load( std::memory_order_relaxed );
+  if( ( currentWriteIndex + 1 ) % CAPACITY == readIndex.load( std::memory_order_acquire ) )
+  {
+    overrunsCount.fetch_add( 1, std::memory_order_relaxed );
+    return NULL;
+  }
+  
+  return recordsTable.data() + currentWriteIndex * RECORD_SIZE;
+}
+
+void SampleRingBuffer::CommitWriteRecord()
+{
+  writeIndex.store( ( writeIndex.load( std::memory_order_relaxed ) + 1 ) % CAPACITY, std::memory_order_release );
+}
+
+const double* SampleRingBuffer::AcquireReadRecord()
+{
+  size_t currentReadIndex = readIndex.load( std::memory_order_relaxed );
+  if( currentReadIndex == writeIndex.load( std::memory_order_acquire ) ) return NULL;
+  
+  return recordsTable.data() + currentReadIndex * RECORD_SIZE;
+}
+
+void SampleRingBuffer::ReleaseReadRecord()
+{
+  readIndex.store( ( readIndex.load( std::memory_order_relaxed ) + 1 ) % CAPACITY, std::memory_order_release );
+}
+
+bool SampleRingBuffer::IsEmpty() const { return ( readIndex.load( std::memory_order_acquire ) == writeIndex.load( std::memory_order_acquire ) ); }
+
+size_t SampleRingBuffer::GetOverrunsCount() const { return overrunsCount.load( std::memory_order_relaxed ); }
+
+
+SampleConsumer::SampleConsumer( SampleRingBuffer& ringBuffer, const std::function<void( const double* )>& handleRecord )
+: ringBuffer( ringBuffer ), handleRecord( handleRecord ), isRunning( true ), isHandling( false )
+{
+  consumerThread = std::thread( &SampleConsumer::Consume, this );
+}
+
+SampleConsumer::~SampleConsumer()
+{
+  isRunning.store( false );
+  consumerThread.join();
+}
+
+void SampleConsumer::Flush()
+{
+  while( not ringBuffer.IsEmpty() || isHandling.load() )
+    std::this_thread::sleep_for( CONSUMER_IDLE_TIME );
+}
+
+// The producer never blocks, so the consumer polls instead of waiting on a condition
+void SampleConsumer::Consume()
+{
+  while( isRunning.load() )
+  {
+    isHandling.store( true );
+    const double* record = ringBuffer.AcquireReadRecord();
+    if( record != NULL )
+    {
+      handleRecord( record );
+      ringBuffer.ReleaseReadRecord();
+    }
+    isHandling.store( false );
+    
+    if( record == NULL ) std::this_thread::sleep_for( CONSUMER_IDLE_TIME );
+  }
+}
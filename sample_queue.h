@@ -0,0 +1,56 @@
+#ifndef SAMPLE_QUEUE_H
+#define SAMPLE_QUEUE_H
+
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <vector>
+
+/* Lock-free single producer/single consumer ring of fixed size sample records, preallocated on construction */
+class SampleRingBuffer
+{
+  public:
+    /* Constructor class. Capacity is the number of records that can wait for the consumer */
+    SampleRingBuffer( size_t recordSize, size_t capacity );
+    ~SampleRingBuffer();
+
+    size_t GetRecordSize() const;
+
+    /* Producer side, wait-free. Returns NULL and counts an overrun when the ring is full */
+    double* AcquireWriteRecord();
+    void CommitWriteRecord();
+
+    /* Consumer side. Returns NULL when the ring is empty */
+    const double* AcquireReadRecord();
+    void ReleaseReadRecord();
+
+    bool IsEmpty() const;
+    size_t GetOverrunsCount() const;
+
+  private:
+    const size_t RECORD_SIZE, CAPACITY;
+    std::vector<double> recordsTable;
+    std::atomic<size_t> writeIndex, readIndex;
+    std::atomic<size_t> overrunsCount;
+};
+
+/* Thread draining a sample ring into a handler, out of the real-time path */
+class SampleConsumer
+{
+  public:
+    SampleConsumer( SampleRingBuffer&, const std::function<void( const double* )>& );
+    ~SampleConsumer();
+
+    /* Blocks until all records pushed so far are handled */
+    void Flush();
+
+  private:
+    void Consume();
+
+    SampleRingBuffer& ringBuffer;
+    std::function<void( const double* )> handleRecord;
+    std::thread consumerThread;
+    std::atomic<bool> isRunning, isHandling;
+};
+
+#endif // SAMPLE_QUEUE_H
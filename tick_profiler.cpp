@@ -0,0 +1,86 @@
+#include "tick_profiler.h"
+
+#include <cmath>
+#include <limits>
+#include <iomanip>
+
+const char* TICK_PHASE_NAMES[ TICK_PHASES_NUMBER ] = { "inputs packing", "inverse dynamics", "nms outputs", "integration", "inverse kinematics", "total" };
+
+const double LATENCY_PERCENTILE = 0.99;
+
+LatencyHistogram::LatencyHistogram()
+: samplesCount( 0 ), latencySum( 0.0 ), latencyMin( std::numeric_limits<double>::max() ), latencyMax( 0.0 )
+{
+  for( size_t binIndex = 0; binIndex < BINS_NUMBER; binIndex++ )
+    binCountsList[ binIndex ].store( 0 );
+}
+
+// Only one thread writes, so plain load/store pairs replace read-modify-write operations
+void LatencyHistogram::Register( double latency )
+{
+  size_t binIndex = ( latency < BINS_NUMBER - 1 ) ? (size_t) std::max( latency, 0.0 ) : BINS_NUMBER - 1;
+  binCountsList[ binIndex ].store( binCountsList[ binIndex ].load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+  latencySum.store( latencySum.load( std::memory_order_relaxed ) + latency, std::memory_order_relaxed );
+  if( latency < latencyMin.load( std::memory_order_relaxed ) ) latencyMin.store( latency, std::memory_order_relaxed );
+  if( latency > latencyMax.load( std::memory_order_relaxed ) ) latencyMax.store( latency, std::memory_order_relaxed );
+  samplesCount.store( samplesCount.load( std::memory_order_relaxed ) + 1, std::memory_order_release );
+}
+
+size_t LatencyHistogram::GetSamplesCount() const { return (size_t) samplesCount.load( std::memory_order_acquire ); }
+
+void LatencyHistogram::GetStatistics( double* statisticsList ) const
+{
+  uint64_t currentSamplesCount = samplesCount.load( std::memory_order_acquire );
+  if( currentSamplesCount == 0 )
+  {
+    for( size_t statisticIndex = 0; statisticIndex < LATENCY_STATISTICS_NUMBER; statisticIndex++ )
+      statisticsList[ statisticIndex ] = 0.0;
+    return;
+  }
+  
+  statisticsList[ LATENCY_MIN ] = latencyMin.load( std::memory_order_relaxed );
+  statisticsList[ LATENCY_MEAN ] = latencySum.load( std::memory_order_relaxed ) / currentSamplesCount;
+  statisticsList[ LATENCY_MAX ] = latencyMax.load( std::memory_order_relaxed );
+  
+  // Upper edge of the bin holding the percentile, capped by the maximum
+  uint64_t percentileCount = (uint64_t) std::ceil( LATENCY_PERCENTILE * currentSamplesCount );
+  uint64_t accumulatedCount = 0;
+  size_t binIndex = 0;
+  for( ; binIndex < BINS_NUMBER - 1; binIndex++ )
+  {
+    accumulatedCount += binCountsList[ binIndex ].load( std::memory_order_relaxed );
+    if( accumulatedCount >= percentileCount ) break;
+  }
+  statisticsList[ LATENCY_P99 ] = std::min( (double) ( binIndex + 1 ), statisticsList[ LATENCY_MAX ] );
+}
+
+TickProfiler::TickProfiler() { }
+
+std::chrono::steady_clock::time_point TickProfiler::RegisterPhase( size_t phaseIndex, std::chrono::steady_clock::time_point startTime )
+{
+  std::chrono::steady_clock::time_point currentTime = std::chrono::steady_clock::now();
+  phaseHistogramsList[ phaseIndex ].Register( std::chrono::duration<double, std::micro>( currentTime - startTime ).count() );
+  return currentTime;
+}
+
+void TickProfiler::GetStatistics( double* statisticsTable ) const
+{
+  for( size_t phaseIndex = 0; phaseIndex < TICK_PHASES_NUMBER; phaseIndex++ )
+    phaseHistogramsList[ phaseIndex ].GetStatistics( statisticsTable + phaseIndex * LATENCY_STATISTICS_NUMBER );
+}
+
+void TickProfiler::Print( std::ostream& outputStream ) const
+{
+  outputStream << "tick latencies (us): phase, samples, min, mean, max, p99" << std::endl;
+  for( size_t phaseIndex = 0; phaseIndex < TICK_PHASES_NUMBER; phaseIndex++ )
+  {
+    size_t samplesCount = phaseHistogramsList[ phaseIndex ].GetSamplesCount();
+    if( samplesCount == 0 ) continue;
+    double statisticsList[ LATENCY_STATISTICS_NUMBER ];
+    phaseHistogramsList[ phaseIndex ].GetStatistics( statisticsList );
+    outputStream << std::setw( 20 ) << TICK_PHASE_NAMES[ phaseIndex ] << "\t" << samplesCount << std::fixed << std::setprecision( 1 );
+    for( size_t statisticIndex = 0; statisticIndex < LATENCY_STATISTICS_NUMBER; statisticIndex++ )
+      outputStream << "\t" << statisticsList[ statisticIndex ];
+    outputStream << std::defaultfloat << std::endl;
+  }
+}
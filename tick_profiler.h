@@ -0,0 +1,54 @@
+#ifndef TICK_PROFILER_H
+#define TICK_PROFILER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+
+enum { TICK_INPUTS_PACKING, TICK_INVERSE_DYNAMICS, TICK_NMS_OUTPUTS, TICK_INTEGRATION, TICK_INVERSE_KINEMATICS, TICK_TOTAL, TICK_PHASES_NUMBER };
+enum { LATENCY_MIN, LATENCY_MEAN, LATENCY_MAX, LATENCY_P99, LATENCY_STATISTICS_NUMBER };
+
+/* Single writer latency accumulator, in microseconds. Readable from any thread without locks (statistics may lag one sample) */
+class LatencyHistogram
+{
+  public:
+    LatencyHistogram();
+
+    /* Writer side, wait-free */
+    void Register( double );
+
+    size_t GetSamplesCount() const;
+    /* Fills min/mean/max/p99 values, all zero if nothing was registered */
+    void GetStatistics( double* ) const;
+
+  private:
+    // 1 us wide bins up to twice the 1 ms control period, with the last one collecting anything above
+    static const size_t BINS_NUMBER = 2001;
+
+    std::atomic<uint64_t> samplesCount;
+    std::atomic<double> latencySum, latencyMin, latencyMax;
+    std::atomic<uint32_t> binCountsList[ BINS_NUMBER ];
+};
+
+/* Per phase latencies of the control step */
+class TickProfiler
+{
+  public:
+    TickProfiler();
+
+    inline std::chrono::steady_clock::time_point GetTime() const { return std::chrono::steady_clock::now(); }
+
+    /* Registers time elapsed for the given phase since the given instant, returning the current one (start of the next phase) */
+    std::chrono::steady_clock::time_point RegisterPhase( size_t, std::chrono::steady_clock::time_point );
+
+    /* Phase statistics, one row of LATENCY_STATISTICS_NUMBER values per phase */
+    void GetStatistics( double* ) const;
+
+    void Print( std::ostream& ) const;
+
+  private:
+    LatencyHistogram phaseHistogramsList[ TICK_PHASES_NUMBER ];
+};
+
+#endif // TICK_PROFILER_H
@@ -0,0 +1,159 @@
+#include "trajectory_recording.h"
+
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <limits>
+#include <cstring>
+#include <cstdint>
+
+const char FILE_SIGNATURE[ 8 ] = { 'N', 'M', 'S', 'T', 'R', 'A', 'J', '1' };
+
+bool IsTextFile( const std::string& filePath )
+{
+  const std::string TEXT_EXTENSION = ".csv";
+  return ( filePath.size() >= TEXT_EXTENSION.size() && filePath.compare( filePath.size() - TEXT_EXTENSION.size(), TEXT_EXTENSION.size(), TEXT_EXTENSION ) == 0 );
+}
+
+TrajectoryRecording::TrajectoryRecording() { }
+
+TrajectoryRecording::TrajectoryRecording( const std::vector<std::string>& columnNamesList ) : columnNamesList( columnNamesList ) { }
+
+TrajectoryRecording::~TrajectoryRecording() { }
+
+bool TrajectoryRecording::Load( const std::string& filePath )
+{
+  columnNamesList.clear();
+  valuesTable.clear();
+  
+  bool isLoaded = IsTextFile( filePath ) ? LoadText( filePath ) : LoadBinary( filePath );
+  if( not isLoaded )
+  {
+    columnNamesList.clear();
+    valuesTable.clear();
+  }
+  
+  return isLoaded;
+}
+
+bool TrajectoryRecording::Save( const std::string& filePath ) const
+{
+  return IsTextFile( filePath ) ? SaveText( filePath ) : SaveBinary( filePath );
+}
+
+size_t TrajectoryRecording::GetColumnsNumber() const { return columnNamesList.size(); }
+
+size_t TrajectoryRecording::GetRowsNumber() const { return columnNamesList.empty() ? 0 : valuesTable.size() / columnNamesList.size(); }
+
+const std::vector<std::string>& TrajectoryRecording::GetColumnNamesList() const { return columnNamesList; }
+
+size_t TrajectoryRecording::GetColumnIndex( const std::string& columnName ) const
+{
+  std::vector<std::string>::const_iterator columnIterator = std::find( columnNamesList.begin(), columnNamesList.end(), columnName );
+  return ( columnIterator != columnNamesList.end() ) ? (size_t) ( columnIterator - columnNamesList.begin() ) : INVALID_COLUMN;
+}
+
+void TrajectoryRecording::AppendRow( const double* valuesList )
+{
+  valuesTable.insert( valuesTable.end(), valuesList, valuesList + columnNamesList.size() );
+}
+
+void TrajectoryRecording::Reserve( size_t rowsNumber )
+{
+  valuesTable.reserve( rowsNumber * columnNamesList.size() );
+}
+
+// Comma or whitespace separated. Missing or unparseable values are read as NaN
+bool TrajectoryRecording::LoadText( const std::string& filePath )
+{
+  std::ifstream recordingFile( filePath.c_str() );
+  std::string line;
+  if( not std::getline( recordingFile, line ) ) return false;
+  
+  std::replace( line.begin(), line.end(), ',', ' ' );
+  std::istringstream headerStream( line );
+  std::string columnName;
+  while( headerStream >> columnName ) columnNamesList.push_back( columnName );
+  if( columnNamesList.empty() ) return false;
+  
+  std::vector<double> rowValuesList( columnNamesList.size() );
+  while( std::getline( recordingFile, line ) )
+  {
+    std::replace( line.begin(), line.end(), ',', ' ' );
+    std::istringstream lineStream( line );
+    std::string valueString;
+    size_t valuesCount = 0;
+    for( ; valuesCount < rowValuesList.size() && lineStream >> valueString; valuesCount++ )
+    {
+      char* valueEnd = NULL;
+      rowValuesList[ valuesCount ] = std::strtod( valueString.c_str(), &valueEnd );
+      if( *valueEnd != '\0' ) rowValuesList[ valuesCount ] = std::numeric_limits<double>::quiet_NaN();
+    }
+    if( valuesCount == 0 ) continue;
+    std::fill( rowValuesList.begin() + valuesCount, rowValuesList.end(), std::numeric_limits<double>::quiet_NaN() );
+    AppendRow( rowValuesList.data() );
+  }
+  
+  return true;
+}
+
+bool TrajectoryRecording::LoadBinary( const std::string& filePath )
+{
+  std::ifstream recordingFile( filePath.c_str(), std::ios::binary );
+  if( not recordingFile.is_open() ) return false;
+  
+  char signature[ sizeof(FILE_SIGNATURE) ];
+  uint64_t sizesList[ 2 ];
+  recordingFile.read( signature, sizeof(signature) );
+  recordingFile.read( (char*) sizesList, sizeof(sizesList) );
+  if( not recordingFile.good() || std::memcmp( signature, FILE_SIGNATURE, sizeof(FILE_SIGNATURE) ) != 0 ) return false;
+  
+  size_t columnsNumber = (size_t) sizesList[ 0 ], rowsNumber = (size_t) sizesList[ 1 ];
+  for( size_t columnIndex = 0; columnIndex < columnsNumber; columnIndex++ )
+  {
+    std::string columnName;
+    if( not std::getline( recordingFile, columnName, '\0' ) ) return false;
+    columnNamesList.push_back( columnName );
+  }
+  
+  valuesTable.resize( rowsNumber * columnsNumber );
+  recordingFile.read( (char*) valuesTable.data(), valuesTable.size() * sizeof(double) );
+  
+  return recordingFile.good();
+}
+
+bool TrajectoryRecording::SaveText( const std::string& filePath ) const
+{
+  std::ofstream recordingFile( filePath.c_str() );
+  if( not recordingFile.is_open() ) return false;
+  
+  for( size_t columnIndex = 0; columnIndex < columnNamesList.size(); columnIndex++ )
+    recordingFile << ( ( columnIndex > 0 ) ? "," : "" ) << columnNamesList[ columnIndex ];
+  recordingFile << std::endl;
+  
+  recordingFile.precision( std::numeric_limits<double>::max_digits10 );
+  for( size_t rowIndex = 0; rowIndex < GetRowsNumber(); rowIndex++ )
+  {
+    const double* rowValuesList = GetRow( rowIndex );
+    for( size_t columnIndex = 0; columnIndex < columnNamesList.size(); columnIndex++ )
+      recordingFile << ( ( columnIndex > 0 ) ? "," : "" ) << rowValuesList[ columnIndex ];
+    recordingFile << "\n";
+  }
+  
+  return recordingFile.good();
+}
+
+bool TrajectoryRecording::SaveBinary( const std::string& filePath ) const
+{
+  std::ofstream recordingFile( filePath.c_str(), std::ios::binary );
+  if( not recordingFile.is_open() ) return false;
+  
+  uint64_t sizesList[ 2 ] = { (uint64_t) columnNamesList.size(), (uint64_t) GetRowsNumber() };
+  recordingFile.write( FILE_SIGNATURE, sizeof(FILE_SIGNATURE) );
+  recordingFile.write( (const char*) sizesList, sizeof(sizesList) );
+  for( size_t columnIndex = 0; columnIndex < columnNamesList.size(); columnIndex++ )
+    recordingFile.write( columnNamesList[ columnIndex ].c_str(), columnNamesList[ columnIndex ].size() + 1 );
+  recordingFile.write( (const char*) valuesTable.data(), valuesTable.size() * sizeof(double) );
+  
+  return recordingFile.good();
+}
@@ -0,0 +1,45 @@
+#ifndef TRAJECTORY_RECORDING_H
+#define TRAJECTORY_RECORDING_H
+
+#include <string>
+#include <vector>
+
+/* Table of named columns with one row per time step, stored either as CSV text (.csv files, header line with column names)
+   or as compact binary (signature, sizes, null terminated names and row-major doubles) */
+class TrajectoryRecording
+{
+  public:
+    static const size_t INVALID_COLUMN = (size_t) -1;
+
+    TrajectoryRecording();
+    TrajectoryRecording( const std::vector<std::string>& );
+    ~TrajectoryRecording();
+
+    /* Format chosen from the file extension */
+    bool Load( const std::string& );
+    bool Save( const std::string& ) const;
+
+    size_t GetColumnsNumber() const;
+    size_t GetRowsNumber() const;
+    const std::vector<std::string>& GetColumnNamesList() const;
+    /* INVALID_COLUMN if not present */
+    size_t GetColumnIndex( const std::string& ) const;
+
+    inline const double* GetRow( size_t rowIndex ) const { return valuesTable.data() + rowIndex * columnNamesList.size(); }
+    inline double GetValue( size_t rowIndex, size_t columnIndex ) const { return valuesTable[ rowIndex * columnNamesList.size() + columnIndex ]; }
+
+    /* Appends a row of GetColumnsNumber() values */
+    void AppendRow( const double* );
+    void Reserve( size_t );
+
+  private:
+    bool LoadText( const std::string& );
+    bool LoadBinary( const std::string& );
+    bool SaveText( const std::string& ) const;
+    bool SaveBinary( const std::string& ) const;
+
+    std::vector<std::string> columnNamesList;
+    std::vector<double> valuesTable;
+};
+
+#endif // TRAJECTORY_RECORDING_H
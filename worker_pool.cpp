@@ -0,0 +1,71 @@
+#include "worker_pool.h"
+
+WorkerPool::WorkerPool( size_t workersNumber )
+: currentJob( NULL ), jobsNumber( 0 ), nextJobIndex( 0 ), pendingJobsNumber( 0 ), isRunning( true )
+{
+  if( workersNumber == 0 ) workersNumber = std::thread::hardware_concurrency();
+  if( workersNumber == 0 ) workersNumber = 1;
+  
+  for( size_t workerIndex = 0; workerIndex < workersNumber; workerIndex++ )
+    workersList.push_back( std::thread( &WorkerPool::Work, this ) );
+}
+
+WorkerPool::~WorkerPool()
+{
+  {
+    std::lock_guard<std::mutex> lock( jobMutex );
+    isRunning = false;
+  }
+  jobCondition.notify_all();
+  
+  for( size_t workerIndex = 0; workerIndex < workersList.size(); workerIndex++ )
+    workersList[ workerIndex ].join();
+}
+
+size_t WorkerPool::GetWorkersNumber() const { return workersList.size(); }
+
+void WorkerPool::Run( size_t newJobsNumber, const std::function<void( size_t )>& job )
+{
+  if( newJobsNumber == 0 ) return;
+  
+  std::lock_guard<std::mutex> runLock( runMutex );
+  std::unique_lock<std::mutex> lock( jobMutex );
+  currentJob = &job;
+  jobsNumber = newJobsNumber;
+  nextJobIndex = 0;
+  pendingJobsNumber = newJobsNumber;
+  jobCondition.notify_all();
+  
+  doneCondition.wait( lock, [ this ]{ return pendingJobsNumber == 0; } );
+  currentJob = NULL;
+  jobsNumber = nextJobIndex = 0;
+  
+  // First failure of the run goes to the caller, as escaping a worker thread would terminate the process
+  if( jobException )
+  {
+    std::exception_ptr runException = jobException;
+    jobException = NULL;
+    std::rethrow_exception( runException );
+  }
+}
+
+void WorkerPool::Work()
+{
+  std::unique_lock<std::mutex> lock( jobMutex );
+  while( true )
+  {
+    jobCondition.wait( lock, [ this ]{ return not isRunning || nextJobIndex < jobsNumber; } );
+    if( not isRunning ) return;
+    
+    size_t jobIndex = nextJobIndex++;
+    const std::function<void( size_t )>& job = *currentJob;
+    lock.unlock();
+    std::exception_ptr currentException;
+    try { job( jobIndex ); }
+    catch( ... ) { currentException = std::current_exception(); }
+    lock.lock();
+    if( currentException && not jobException ) jobException = currentException;
+    
+    if( --pendingJobsNumber == 0 ) doneCondition.notify_all();
+  }
+}
@@ -0,0 +1,36 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <vector>
+
+/* Fixed set of threads running indexed jobs. Run() blocks until all jobs are done, rethrowing the first exception thrown by one of them, 
+   and must not be called from inside a job */
+class WorkerPool
+{
+  public:
+    /* Constructor class. Zero workers means one per hardware thread */
+    WorkerPool( size_t workersNumber = 0 );
+    ~WorkerPool();
+
+    size_t GetWorkersNumber() const;
+
+    void Run( size_t, const std::function<void( size_t )>& );
+
+  private:
+    void Work();
+
+    std::vector<std::thread> workersList;
+    std::mutex runMutex, jobMutex;
+    std::condition_variable jobCondition, doneCondition;
+    const std::function<void( size_t )>* currentJob;
+    size_t jobsNumber, nextJobIndex, pendingJobsNumber;
+    std::exception_ptr jobException;
+    bool isRunning;
+};
+
+#endif // WORKER_POOL_H